@@ -0,0 +1,240 @@
+#pragma once
+#include "fft.h"
+#include "job_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#ifdef SYNTH_WITH_FFTW
+namespace synth {
+	// Wait-free single producer / single consumer ring of samples, like
+	// spsc_ring but moving whole blocks at a time instead of one item
+	template<size_t nCapacity>
+	class sample_ring {
+		static_assert((nCapacity & (nCapacity - 1)) == 0, "sample_ring capacity must be a power of two");
+
+	public:
+		// producer side: all of it or nothing, false if there isn't room
+		bool push(const float* pData, size_t nCount) {
+			size_t nHead = m_nHead.load(std::memory_order_relaxed);
+			size_t nTail = m_nTail.load(std::memory_order_acquire);
+			if (nCapacity - (nHead - nTail) < nCount)
+				return false;
+
+			for (size_t i = 0; i < nCount; i++)
+				m_fData[(nHead + i) & (nCapacity - 1)] = pData[i];
+			m_nHead.store(nHead + nCount, std::memory_order_release);
+			return true;
+		}
+
+		// consumer side
+		size_t available() const {
+			return m_nHead.load(std::memory_order_acquire) - m_nTail.load(std::memory_order_relaxed);
+		}
+
+		// takes exactly nCount samples, false if there aren't that many yet
+		bool pop(float* pData, size_t nCount) {
+			size_t nTail = m_nTail.load(std::memory_order_relaxed);
+			if (m_nHead.load(std::memory_order_acquire) - nTail < nCount)
+				return false;
+
+			for (size_t i = 0; i < nCount; i++)
+				pData[i] = m_fData[(nTail + i) & (nCapacity - 1)];
+			m_nTail.store(nTail + nCount, std::memory_order_release);
+			return true;
+		}
+
+	private:
+		// the counters only ever grow, the difference is the fill level
+		alignas(64) std::atomic<size_t> m_nHead{ 0 };
+		alignas(64) std::atomic<size_t> m_nTail{ 0 };
+		alignas(64) float m_fData[nCapacity];
+	};
+
+	// One analysis result, everything in dB relative to full scale
+	struct spectrum {
+		std::vector<float> vecMagnitude; // one per bin, bin i is at i * dBinWidth Hz
+		double dBinWidth = 0.0;
+		float fRMS = -120.0f;   // over the samples that were new for this frame
+		float fPeak = -120.0f;
+		double dPeakFrequency = 0.0; // loudest bin, interpolated
+		uint64_t nFrame = 0;    // counts up by one per analysis, 0 = nothing yet
+
+		// loudest bin from dLow up to (not including) dHigh
+		float band(double dLow, double dHigh) const {
+			float fMax = -120.0f;
+			for (size_t i = (size_t)ceil(dLow / dBinWidth); i < vecMagnitude.size() && i * dBinWidth < dHigh; i++)
+				fMax = std::max(fMax, vecMagnitude[i]);
+			return fMax;
+		}
+	};
+
+	// Live spectrum and level meters off the output. The audio thread only
+	// copies each finished block into a ring (push, never waits, drops the block
+	// if the ring is full); a low priority thread does the rest. It takes
+	// nSize-sample Hann windowed frames every nHop samples and runs them through
+	// a real FFT planned once in the constructor, then publishes the result
+	// through a triple buffer so the UI always gets the newest complete frame
+	// without either side locking.
+	class spectrum_analyzer {
+	public:
+		spectrum_analyzer(double dSampleRate, size_t nSize = 2048, size_t nHop = 1024) {
+			m_nSize = nSize;
+			m_nHop = std::min(nHop, nSize);
+			m_vecFrame.assign(m_nSize, 0.0f);
+			m_vecHop.assign(m_nHop, 0.0f);
+			m_vecDownmix.reserve(4096);
+
+			m_vecWindow.resize(m_nSize);
+			double dSum = 0.0;
+			for (size_t i = 0; i < m_nSize; i++) {
+				m_vecWindow[i] = 0.5 - 0.5 * cos(2.0 * 3.14159265358979323846 * i / m_nSize);
+				dSum += m_vecWindow[i];
+			}
+			m_dScale = 2.0 / dSum; // a full scale sine reads 0 dB
+
+			for (auto& s : m_spectra) {
+				s.vecMagnitude.assign(m_nSize / 2 + 1, -120.0f);
+				s.dBinWidth = dSampleRate / m_nSize;
+			}
+
+			// the planner isn't thread safe, it runs here once and never again
+			m_pIn = fftw_alloc_real(m_nSize);
+			m_pOut = fftw_alloc_complex(m_nSize / 2 + 1);
+			m_plan = fftw_plan_dft_r2c_1d((int)m_nSize, m_pIn, m_pOut, FFTW_MEASURE);
+		}
+
+		~spectrum_analyzer() {
+			stop();
+			fftw_destroy_plan(m_plan);
+			fftw_free(m_pIn);
+			fftw_free(m_pOut);
+		}
+
+		void start() {
+			if (m_thread.joinable())
+				return;
+			m_bRunning = true;
+			m_thread = std::thread(&spectrum_analyzer::run, this);
+		}
+
+		void stop() {
+			m_bRunning = false;
+			if (m_thread.joinable())
+				m_thread.join();
+		}
+
+		// Audio thread: hands over a finished block of interleaved frames,
+		// channels averaged. Never blocks; if the analyzer has fallen that far
+		// behind the block is simply not analysed
+		void push(const float* pFrames, size_t nFrames, size_t nChannels) {
+			m_vecDownmix.resize(nFrames); // only grows past the reserve for huge blocks
+			float fScale = 1.0f / (float)nChannels;
+			for (size_t i = 0; i < nFrames; i++) {
+				float fSum = 0.0f;
+				for (size_t c = 0; c < nChannels; c++)
+					fSum += pFrames[i * nChannels + c];
+				m_vecDownmix[i] = fSum * fScale;
+			}
+			if (!m_ringSamples.push(m_vecDownmix.data(), nFrames))
+				m_nDropped++;
+		}
+
+		// blocks the audio thread had to throw away so far
+		uint64_t dropped() const { return m_nDropped; }
+
+		// One reader thread: the newest published spectrum, valid until the next call
+		spectrum const& latest() {
+			if (m_nMiddle.load(std::memory_order_acquire) & nFresh)
+				m_nFront = m_nMiddle.exchange(m_nFront, std::memory_order_acq_rel) & ~nFresh;
+			return m_spectra[m_nFront];
+		}
+
+	private:
+		static const int nFresh = 4; // set in m_nMiddle when it holds a frame the reader hasn't seen
+
+		size_t m_nSize;
+		size_t m_nHop;
+		double m_dScale;
+		std::vector<double> m_vecWindow;
+		std::vector<float> m_vecFrame, m_vecHop, m_vecDownmix;
+
+		sample_ring<1 << 16> m_ringSamples;
+		std::atomic<uint64_t> m_nDropped{ 0 };
+
+		double* m_pIn;
+		fftw_complex* m_pOut;
+		fftw_plan m_plan;
+
+		// triple buffer: the analysis thread owns m_nBack, the reader m_nFront
+		spectrum m_spectra[3];
+		int m_nBack = 0;
+		int m_nFront = 1;
+		std::atomic<int> m_nMiddle{ 2 };
+		uint64_t m_nFrames = 0;
+
+		std::atomic<bool> m_bRunning{ false };
+		std::thread m_thread;
+
+		void run() {
+			set_background_priority();
+			while (m_bRunning) {
+				// polls instead of being woken, so the audio thread never has to signal anything
+				if (!m_ringSamples.pop(m_vecHop.data(), m_nHop)) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(5));
+					continue;
+				}
+				analyse();
+			}
+		}
+
+		void analyse() {
+			// slide the frame along by one hop
+			std::copy(m_vecFrame.begin() + m_nHop, m_vecFrame.end(), m_vecFrame.begin());
+			std::copy(m_vecHop.begin(), m_vecHop.end(), m_vecFrame.end() - m_nHop);
+
+			spectrum& s = m_spectra[m_nBack];
+			double dSquares = 0.0, dPeak = 0.0;
+			for (float f : m_vecHop) {
+				dSquares += (double)f * f;
+				dPeak = std::max(dPeak, (double)fabsf(f));
+			}
+			s.fRMS = decibels(sqrt(dSquares / m_nHop));
+			s.fPeak = decibels(dPeak);
+
+			for (size_t i = 0; i < m_nSize; i++)
+				m_pIn[i] = m_vecFrame[i] * m_vecWindow[i];
+			fftw_execute(m_plan);
+
+			size_t nBins = m_nSize / 2 + 1, nLoudest = 0;
+			for (size_t i = 0; i < nBins; i++) {
+				double dMagnitude = sqrt(m_pOut[i][0] * m_pOut[i][0] + m_pOut[i][1] * m_pOut[i][1]) * m_dScale;
+				s.vecMagnitude[i] = decibels(dMagnitude);
+				if (s.vecMagnitude[i] > s.vecMagnitude[nLoudest])
+					nLoudest = i;
+			}
+
+			// parabola through the loudest bin and its neighbours for the in-between frequency
+			double dOffset = 0.0;
+			if (nLoudest > 0 && nLoudest + 1 < nBins) {
+				double a = s.vecMagnitude[nLoudest - 1], b = s.vecMagnitude[nLoudest], c = s.vecMagnitude[nLoudest + 1];
+				double dDenominator = a - 2.0 * b + c;
+				if (dDenominator != 0.0)
+					dOffset = 0.5 * (a - c) / dDenominator;
+			}
+			s.dPeakFrequency = (nLoudest + dOffset) * s.dBinWidth;
+			s.nFrame = ++m_nFrames;
+
+			m_nBack = m_nMiddle.exchange(m_nBack | nFresh, std::memory_order_acq_rel) & ~nFresh;
+		}
+
+		static float decibels(double dLevel) {
+			return (float)std::max(-120.0, 20.0 * log10(dLevel + 1e-12));
+		}
+	};
+}
+#endif
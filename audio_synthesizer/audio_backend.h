@@ -0,0 +1,385 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sample_format.h"
+
+#ifdef _WIN32
+#pragma comment(lib, "winmm.lib")
+#ifndef NOMINMAX
+#define NOMINMAX // std::min/max, and the simd traits have min/max members
+#endif
+#include <Windows.h>
+#endif
+
+// ALSA is opt in, build with -DSYNTH_WITH_ALSA and link -lasound
+#ifdef SYNTH_WITH_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+namespace synth {
+	struct audio_config {
+		unsigned int nSampleRate = 44100;
+		unsigned int nChannels = 1;
+		unsigned int nBlocks = 8;
+		unsigned int nBlockSamples = 512; // per block, all channels together
+		sample_format eFormat = sample_format::pcm16;
+
+		unsigned int bytes_per_sample() const { return synth::bytes_per_sample(eFormat); }
+		unsigned int block_frames() const { return nBlockSamples / nChannels; }
+		double block_seconds() const { return (double)block_frames() / (double)nSampleRate; }
+	};
+
+	// What olcNoiseMaker measured about its output, all times in seconds
+	struct latency_stats {
+		double dBufferSeconds = 0.0; // what the block ring holds when full, nBlocks * block period
+		double dLatencyMean = 0.0;   // block rendered -> block starts playing, plus whatever the device buffers
+		double dLatencyMax = 0.0;
+		double dJitterMean = 0.0;    // how far apart block done callbacks are compared to the block period
+		double dJitterMax = 0.0;
+		uint64_t nBlocksPlayed = 0;
+		uint64_t nUnderruns = 0;     // times the device played out everything it had been given
+	};
+
+	// Where finished blocks go. olcNoiseMaker owns the ring of blocks and hands
+	// them over one at a time with write(); the backend calls onBlockDone once
+	// a block has been played and may be refilled. Blocks always come back in
+	// the order they were written.
+	class audio_backend {
+	public:
+		virtual ~audio_backend() {}
+
+		virtual const char* name() const = 0;
+		virtual std::vector<std::wstring> devices() = 0;
+		virtual bool open(std::wstring const& sDevice, audio_config const& config, std::function<void()> onBlockDone) = 0;
+		virtual void write(unsigned int nBlock, const void* pData, size_t nBytes) = 0;
+		virtual void close() = 0;
+
+		// latency the device still adds after it has reported a block done
+		virtual double device_latency() const { return 0.0; }
+	};
+
+	// No sound card at all. A timer thread "plays" one block every block period,
+	// so the block ring is asked for data at exactly the pace a real device
+	// would. Good for servers, soak tests and measuring the render side alone.
+	class null_backend : public audio_backend {
+	public:
+		~null_backend() {
+			close();
+		}
+
+		const char* name() const override { return "null"; }
+		std::vector<std::wstring> devices() override { return { L"null" }; }
+
+		bool open(std::wstring const& /*sDevice*/, audio_config const& config, std::function<void()> onBlockDone) override {
+			close();
+			m_config = config;
+			m_onBlockDone = onBlockDone;
+			m_nQueued = 0;
+			m_bRunning = true;
+			m_thread = std::thread(&null_backend::run, this);
+			return true;
+		}
+
+		void write(unsigned int /*nBlock*/, const void* /*pData*/, size_t /*nBytes*/) override {
+			std::lock_guard<std::mutex> lm(m_mux);
+			m_nQueued++;
+		}
+
+		void close() override {
+			m_bRunning = false;
+			if (m_thread.joinable())
+				m_thread.join();
+		}
+
+	private:
+		audio_config m_config;
+		std::function<void()> m_onBlockDone;
+		std::thread m_thread;
+		std::atomic<bool> m_bRunning{ false };
+		std::mutex m_mux;
+		unsigned int m_nQueued = 0;
+
+		void run() {
+			typedef std::chrono::steady_clock clock;
+			clock::duration tPeriod = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(m_config.block_seconds()));
+
+			// ticks are scheduled off the start time, not the last wake up, so oversleeping doesn't drift
+			clock::time_point tNext = clock::now() + tPeriod;
+			while (m_bRunning) {
+				std::this_thread::sleep_until(tNext);
+				tNext += tPeriod;
+
+				bool bPlayed = false;
+				{
+					std::lock_guard<std::mutex> lm(m_mux);
+					if (m_nQueued > 0) {
+						m_nQueued--;
+						bPlayed = true;
+					}
+				}
+				if (bPlayed)
+					m_onBlockDone();
+			}
+		}
+	};
+
+#ifdef _WIN32
+	// The original olcNoiseMaker output: WinMM waveOut with one WAVEHDR per block
+	class winmm_backend : public audio_backend {
+	public:
+		~winmm_backend() {
+			close();
+		}
+
+		const char* name() const override { return "winmm"; }
+
+		std::vector<std::wstring> devices() override {
+			int nDeviceCount = waveOutGetNumDevs();
+			std::vector<std::wstring> sDevices;
+			WAVEOUTCAPS woc;
+			for (int n = 0; n < nDeviceCount; n++)
+				if (waveOutGetDevCaps(n, &woc, sizeof(WAVEOUTCAPS)) == S_OK)
+					sDevices.push_back(woc.szPname);
+			return sDevices;
+		}
+
+		bool open(std::wstring const& sDevice, audio_config const& config, std::function<void()> onBlockDone) override {
+			close();
+
+			// Validate device
+			std::vector<std::wstring> devices = this->devices();
+			auto d = std::find(devices.begin(), devices.end(), sDevice);
+			if (d == devices.end())
+				return false;
+
+			m_onBlockDone = onBlockDone;
+
+			WAVEFORMATEX waveFormat;
+			waveFormat.wFormatTag = config.eFormat == sample_format::float32 ? 3 : WAVE_FORMAT_PCM; // 3 = WAVE_FORMAT_IEEE_FLOAT
+			waveFormat.nSamplesPerSec = config.nSampleRate;
+			waveFormat.wBitsPerSample = (WORD)(config.bytes_per_sample() * 8);
+			waveFormat.nChannels = (WORD)config.nChannels;
+			waveFormat.nBlockAlign = (waveFormat.wBitsPerSample / 8) * waveFormat.nChannels;
+			waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec * waveFormat.nBlockAlign;
+			waveFormat.cbSize = 0;
+
+			UINT nDeviceID = (UINT)std::distance(devices.begin(), d);
+			if (waveOutOpen(&m_hwDevice, nDeviceID, &waveFormat, (DWORD_PTR)waveOutProcWrap, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK) {
+				m_hwDevice = nullptr;
+				return false;
+			}
+
+			m_vecHeaders.assign(config.nBlocks, WAVEHDR());
+			return true;
+		}
+
+		void write(unsigned int nBlock, const void* pData, size_t nBytes) override {
+			WAVEHDR& header = m_vecHeaders[nBlock];
+			if (header.dwFlags & WHDR_PREPARED)
+				waveOutUnprepareHeader(m_hwDevice, &header, sizeof(WAVEHDR));
+
+			header.lpData = (LPSTR)pData;
+			header.dwBufferLength = (DWORD)nBytes;
+			header.dwFlags = 0;
+			waveOutPrepareHeader(m_hwDevice, &header, sizeof(WAVEHDR));
+			waveOutWrite(m_hwDevice, &header, sizeof(WAVEHDR));
+		}
+
+		void close() override {
+			if (m_hwDevice == nullptr)
+				return;
+
+			waveOutReset(m_hwDevice); // hands back everything still queued
+			for (auto& header : m_vecHeaders)
+				if (header.dwFlags & WHDR_PREPARED)
+					waveOutUnprepareHeader(m_hwDevice, &header, sizeof(WAVEHDR));
+			waveOutClose(m_hwDevice);
+			m_hwDevice = nullptr;
+		}
+
+	private:
+		HWAVEOUT m_hwDevice = nullptr;
+		std::vector<WAVEHDR> m_vecHeaders;
+		std::function<void()> m_onBlockDone;
+
+		// Handler for soundcard request for more data
+		static void CALLBACK waveOutProcWrap(HWAVEOUT /*hWaveOut*/, UINT uMsg, DWORD_PTR dwInstance, DWORD_PTR /*dwParam1*/, DWORD_PTR /*dwParam2*/) {
+			if (uMsg == WOM_DONE)
+				((winmm_backend*)dwInstance)->m_onBlockDone();
+		}
+	};
+#endif
+
+#ifdef SYNTH_WITH_ALSA
+	// Linux sound cards through ALSA. snd_pcm_writei blocks, so a writer thread
+	// feeds the device and reports a block done as soon as ALSA has copied it.
+	// What ALSA still holds at that point comes back through device_latency().
+	class alsa_backend : public audio_backend {
+	public:
+		~alsa_backend() {
+			close();
+		}
+
+		const char* name() const override { return "alsa"; }
+
+		// "default" always comes first, so taking the first device means what the
+		// system is set up to play on; the hint list tends to start with "null"
+		std::vector<std::wstring> devices() override {
+			std::vector<std::wstring> sDevices = { L"default" };
+			void** hints = nullptr;
+			if (snd_device_name_hint(-1, "pcm", &hints) < 0)
+				return { L"default" };
+
+			for (void** h = hints; *h != nullptr; h++) {
+				char* sName = snd_device_name_get_hint(*h, "NAME");
+				if (sName == nullptr)
+					continue;
+				std::string s(sName);
+				if (s != "default")
+					sDevices.push_back(std::wstring(s.begin(), s.end()));
+				free(sName);
+			}
+			snd_device_name_free_hint(hints);
+			return sDevices;
+		}
+
+		bool open(std::wstring const& sDevice, audio_config const& config, std::function<void()> onBlockDone) override {
+			close();
+
+			snd_pcm_format_t eFormat = SND_PCM_FORMAT_S16_LE;
+			if (config.eFormat == sample_format::pcm24)
+				eFormat = SND_PCM_FORMAT_S24_3LE;
+			else if (config.eFormat == sample_format::pcm32)
+				eFormat = SND_PCM_FORMAT_S32_LE;
+			else if (config.eFormat == sample_format::float32)
+				eFormat = SND_PCM_FORMAT_FLOAT_LE;
+
+			std::string sName = sDevice.empty() ? "default" : std::string(sDevice.begin(), sDevice.end());
+			if (snd_pcm_open(&m_pcm, sName.c_str(), SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+				m_pcm = nullptr;
+				return false;
+			}
+
+			// the block ring already does the buffering, ALSA only needs enough to double buffer one block
+			unsigned int nLatencyUs = (unsigned int)(2.0 * config.block_seconds() * 1000000.0);
+			if (snd_pcm_set_params(m_pcm, eFormat, SND_PCM_ACCESS_RW_INTERLEAVED, config.nChannels, config.nSampleRate, 1, nLatencyUs) < 0) {
+				snd_pcm_close(m_pcm);
+				m_pcm = nullptr;
+				return false;
+			}
+
+			m_config = config;
+			m_onBlockDone = onBlockDone;
+			m_dDelay = 0.0;
+			m_bRunning = true;
+			m_thread = std::thread(&alsa_backend::run, this);
+			return true;
+		}
+
+		void write(unsigned int /*nBlock*/, const void* pData, size_t nBytes) override {
+			std::lock_guard<std::mutex> lm(m_mux);
+			m_queue.push_back(std::make_pair((const char*)pData, nBytes));
+			m_cv.notify_one();
+		}
+
+		void close() override {
+			{
+				std::lock_guard<std::mutex> lm(m_mux);
+				m_bRunning = false;
+				m_cv.notify_one();
+			}
+			if (m_thread.joinable())
+				m_thread.join();
+
+			if (m_pcm != nullptr) {
+				snd_pcm_drop(m_pcm);
+				snd_pcm_close(m_pcm);
+				m_pcm = nullptr;
+			}
+			m_queue.clear();
+		}
+
+		double device_latency() const override { return m_dDelay; }
+
+	private:
+		snd_pcm_t* m_pcm = nullptr;
+		audio_config m_config;
+		std::function<void()> m_onBlockDone;
+		std::thread m_thread;
+		bool m_bRunning = false;
+		std::mutex m_mux;
+		std::condition_variable m_cv;
+		std::deque<std::pair<const char*, size_t>> m_queue;
+		std::atomic<double> m_dDelay{ 0.0 };
+
+		void run() {
+			size_t nFrameBytes = (size_t)m_config.bytes_per_sample() * m_config.nChannels;
+			while (true) {
+				std::pair<const char*, size_t> block;
+				{
+					std::unique_lock<std::mutex> lm(m_mux);
+					m_cv.wait(lm, [this] { return !m_bRunning || !m_queue.empty(); });
+					if (!m_bRunning)
+						return;
+					block = m_queue.front();
+					m_queue.pop_front();
+				}
+
+				const char* p = block.first;
+				snd_pcm_uframes_t nFrames = block.second / nFrameBytes;
+				while (nFrames > 0) {
+					snd_pcm_sframes_t n = snd_pcm_writei(m_pcm, p, nFrames);
+					if (n < 0)
+						n = snd_pcm_recover(m_pcm, (int)n, 1); // underrun or suspend, pick up again
+					if (n < 0)
+						break;
+					p += n * nFrameBytes;
+					nFrames -= n;
+				}
+
+				snd_pcm_sframes_t nDelay = 0;
+				if (snd_pcm_delay(m_pcm, &nDelay) == 0)
+					m_dDelay = (double)nDelay / (double)m_config.nSampleRate;
+
+				m_onBlockDone();
+			}
+		}
+	};
+#endif
+
+	// "winmm", "alsa" or "null", nullptr if that one isn't built in
+	inline std::unique_ptr<audio_backend> make_backend(std::string const& sName) {
+#ifdef _WIN32
+		if (sName == "winmm")
+			return std::unique_ptr<audio_backend>(new winmm_backend());
+#endif
+#ifdef SYNTH_WITH_ALSA
+		if (sName == "alsa")
+			return std::unique_ptr<audio_backend>(new alsa_backend());
+#endif
+		if (sName == "null")
+			return std::unique_ptr<audio_backend>(new null_backend());
+		return nullptr;
+	}
+
+	// the platform's sound card if one is built in, otherwise the null sink
+	inline std::unique_ptr<audio_backend> make_default_backend() {
+#if defined(_WIN32)
+		return make_backend("winmm");
+#elif defined(SYNTH_WITH_ALSA)
+		return make_backend("alsa");
+#else
+		return make_backend("null");
+#endif
+	}
+}
@@ -0,0 +1,249 @@
+#pragma once
+#include "effects.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace synth {
+	// Both dynamics stages work out their gain once per chunk of
+	// dynamics_chunk samples, not per sample: the level detection, the dB maths
+	// and the attack/release smoothing all run at chunk rate, and in between the
+	// gain is a straight line from the last chunk's value to the new one. The
+	// per-sample loops are then only multiplies and adds, which the compiler
+	// vectorizes. Blocks don't have to be a multiple of the chunk, a chunk just
+	// carries on into the next block.
+	static const size_t dynamics_chunk = 32;
+
+	inline double decibels_to_gain(double dDecibels) { return pow(10.0, dDecibels / 20.0); }
+
+	// Feed-forward RMS compressor. The mean square of each chunk, over all
+	// channels together so the stereo image doesn't wander, feeds an envelope
+	// with separate attack and release times; above the threshold the level is
+	// pulled down by the ratio, with a soft knee of dKnee dB around it, and the
+	// makeup gain goes on top. The gain for a chunk comes from the chunks
+	// before it, so there's no latency.
+	class compressor : public effect {
+	public:
+		// all of these are safe from the control thread while audio runs
+		void set_threshold(double dDecibels) { m_dThreshold = std::min(0.0, dDecibels); }
+		void set_ratio(double dRatio) { m_dRatio = std::max(1.0, dRatio); }
+		void set_attack(double dSeconds) { m_dAttack = std::max(0.0001, dSeconds); }
+		void set_release(double dSeconds) { m_dRelease = std::max(0.001, dSeconds); }
+		void set_knee(double dDecibels) { m_dKnee = std::max(0.0, dDecibels); }
+		void set_makeup(double dDecibels) { m_dMakeup = dDecibels; }
+
+		// how far the last chunk was turned down, in dB (0 or less, makeup not counted)
+		float reduction() const { return m_fReduction; }
+
+		void prepare(double dSampleRate, size_t /*nMaxFrames*/, size_t nChannels) override {
+			m_dSampleRate = dSampleRate;
+			m_nChannels = nChannels;
+			m_nPos = 0;
+			m_dSquares = 0.0;
+			m_dEnvelope = 0.0;
+			m_fGain = m_fGainFrom = (float)decibels_to_gain(m_dMakeup);
+			m_fGainStep = 0.0f;
+		}
+
+		void process(float* const* pChannels, size_t nFrames) override {
+			for (size_t i = 0; i < nFrames; ) {
+				size_t n = std::min(dynamics_chunk - m_nPos, nFrames - i);
+				float fFrom = m_fGainFrom + m_fGainStep * (float)(m_nPos + 1);
+				for (size_t c = 0; c < m_nChannels; c++) {
+					float* p = pChannels[c] + i;
+
+					double dSquares = 0.0;
+					for (size_t k = 0; k < n; k++)
+						dSquares += (double)p[k] * p[k];
+					m_dSquares += dSquares;
+
+					for (size_t k = 0; k < n; k++)
+						p[k] *= fFrom + m_fGainStep * (float)k;
+				}
+
+				m_nPos += n;
+				i += n;
+				if (m_nPos == dynamics_chunk)
+					next_chunk();
+			}
+		}
+
+	private:
+		double m_dSampleRate = 44100.0;
+		std::atomic<double> m_dThreshold{ -18.0 };
+		std::atomic<double> m_dRatio{ 3.0 };
+		std::atomic<double> m_dAttack{ 0.01 };
+		std::atomic<double> m_dRelease{ 0.15 };
+		std::atomic<double> m_dKnee{ 6.0 };
+		std::atomic<double> m_dMakeup{ 0.0 };
+		std::atomic<float> m_fReduction{ 0.0f };
+
+		size_t m_nChannels = 1;
+		size_t m_nPos = 0;        // samples into the current chunk
+		double m_dSquares = 0.0;  // summed over the current chunk so far
+		double m_dEnvelope = 0.0; // smoothed mean square
+		float m_fGain = 1.0f, m_fGainFrom = 1.0f, m_fGainStep = 0.0f;
+
+		void next_chunk() {
+			double dMeanSquare = m_dSquares / (double)(dynamics_chunk * m_nChannels);
+			double dTime = dMeanSquare > m_dEnvelope ? m_dAttack.load() : m_dRelease.load();
+			m_dEnvelope += (dMeanSquare - m_dEnvelope) * (1.0 - exp(-(double)dynamics_chunk / (dTime * m_dSampleRate)));
+			if (m_dEnvelope < 1e-20)
+				m_dEnvelope = 0.0; // no denormals once it's gone quiet
+
+			// static curve: dOver is how far the level is past the threshold
+			double dOver = 10.0 * log10(m_dEnvelope + 1e-20) - m_dThreshold;
+			double dKnee = m_dKnee, dSlope = 1.0 / m_dRatio - 1.0, dChange = 0.0;
+			if (2.0 * dOver > dKnee)
+				dChange = dSlope * dOver;
+			else if (2.0 * dOver > -dKnee)
+				dChange = dSlope * (dOver + dKnee / 2.0) * (dOver + dKnee / 2.0) / (2.0 * dKnee);
+			m_fReduction = (float)dChange;
+
+			m_fGainFrom = m_fGain;
+			m_fGain = (float)decibels_to_gain(dChange + m_dMakeup);
+			m_fGainStep = (m_fGain - m_fGainFrom) / (float)dynamics_chunk;
+			m_dSquares = 0.0;
+			m_nPos = 0;
+		}
+	};
+
+	// Look-ahead peak limiter, the last thing before the output. All channels
+	// share one gain, set by the loudest of them. The signal is held back by
+	// the look-ahead, so the gain is already down by the time a
+	// peak comes out and nothing ever gets past the ceiling; the gain then
+	// recovers over the release time. The loudest sample of each chunk goes
+	// into a sliding window maximum over the look-ahead, kept in a monotonic
+	// deque (peaks only ever decrease from front to back), so finding the
+	// loudest peak ahead costs the same however long the window is.
+	class lookahead_limiter : public effect {
+	public:
+		lookahead_limiter(double dLookahead = 0.003) : m_dLookahead(dLookahead) {}
+
+		// both safe from the control thread while audio runs
+		void set_ceiling(double dDecibels) { m_dCeiling = std::min(0.0, dDecibels); }
+		void set_release(double dSeconds) { m_dRelease = std::max(0.001, dSeconds); }
+
+		// how far the signal is currently turned down, in dB (0 or less)
+		float reduction() const { return m_fReduction; }
+
+		// samples the output lags behind the input
+		size_t latency() const { return m_nChunks * dynamics_chunk; }
+
+		void prepare(double dSampleRate, size_t /*nMaxFrames*/, size_t nChannels) override {
+			m_dSampleRate = dSampleRate;
+			m_nChannels = nChannels;
+			// at least two chunks: the window has to cover the chunk coming out and the one after it
+			m_nChunks = std::max((size_t)2, (size_t)(m_dLookahead * dSampleRate / dynamics_chunk + 0.5));
+			m_vecLine.assign((m_nChunks + 1) * dynamics_chunk * nChannels, 0.0f);
+			m_vecPeaks.assign(m_nChunks + 2, peak{ 0, 0.0f });
+			m_nFront = m_nBack = 0;
+			m_nChunk = 0;
+			m_nPos = 0;
+			m_fPeak = 0.0f;
+			m_fGain = m_fGainFrom = 1.0f;
+			m_fGainStep = 0.0f;
+			m_nQuiet = 0;
+		}
+
+		void process(float* const* pChannels, size_t nFrames) override {
+			bool bQuiet = true;
+			for (size_t i = 0; i < nFrames; ) {
+				if (m_nPos == 0)
+					next_chunk();
+
+				size_t n = std::min(dynamics_chunk - m_nPos, nFrames - i);
+				size_t nSlots = m_nChunks + 1;
+				float fFrom = m_fGainFrom + m_fGainStep * (float)(m_nPos + 1);
+				float fPeak = m_fPeak;
+				for (size_t c = 0; c < m_nChannels; c++) {
+					float* p = pChannels[c] + i;
+					// chunks are whole in the line, so neither side ever wraps
+					float* pLine = m_vecLine.data() + c * nSlots * dynamics_chunk;
+					float* pIn = pLine + (m_nChunk % nSlots) * dynamics_chunk + m_nPos;
+					const float* pOut = pLine + ((m_nChunk + 1) % nSlots) * dynamics_chunk + m_nPos;
+
+					for (size_t k = 0; k < n; k++)
+						fPeak = std::max(fPeak, fabsf(p[k]));
+
+					for (size_t k = 0; k < n; k++) {
+						float fIn = p[k];
+						p[k] = pOut[k] * (fFrom + m_fGainStep * (float)k);
+						pIn[k] = fIn;
+					}
+				}
+				m_fPeak = fPeak;
+				bQuiet = bQuiet && fPeak < 1e-6f;
+
+				m_nPos += n;
+				i += n;
+				if (m_nPos == dynamics_chunk)
+					end_chunk();
+			}
+
+			// quiet for the whole look-ahead means the line only holds silence
+			m_nQuiet = bQuiet ? m_nQuiet + nFrames : 0;
+		}
+
+		bool silent() const override { return m_nQuiet > latency() + dynamics_chunk; }
+
+	private:
+		struct peak { uint64_t nChunk; float fLevel; };
+
+		double m_dLookahead;
+		double m_dSampleRate = 44100.0;
+		std::atomic<double> m_dCeiling{ -1.0 };
+		std::atomic<double> m_dRelease{ 0.08 };
+		std::atomic<float> m_fReduction{ 0.0f };
+
+		size_t m_nChannels = 1;
+		size_t m_nChunks = 2;         // look-ahead in chunks
+		std::vector<float> m_vecLine; // per channel m_nChunks + 1 chunk slots, one being written while the oldest is read
+		uint64_t m_nChunk = 0;        // chunk being written; the one m_nChunks before it is coming out
+		size_t m_nPos = 0;
+		float m_fPeak = 0.0f;         // loudest so far in the chunk being written
+
+		// the monotonic deque, a fixed ring; m_nFront and m_nBack only ever grow
+		std::vector<peak> m_vecPeaks;
+		size_t m_nFront = 0, m_nBack = 0;
+
+		float m_fGain = 1.0f, m_fGainFrom = 1.0f, m_fGainStep = 0.0f;
+		uint64_t m_nQuiet = 0;
+
+		peak& at(size_t n) { return m_vecPeaks[n % m_vecPeaks.size()]; }
+
+		// the chunk just written goes into the window; anything it's at least as
+		// loud as can never be the maximum again
+		void end_chunk() {
+			while (m_nBack > m_nFront && at(m_nBack - 1).fLevel <= m_fPeak)
+				m_nBack--;
+			at(m_nBack++) = peak{ m_nChunk, m_fPeak };
+			m_fPeak = 0.0f;
+			m_nChunk++;
+			m_nPos = 0;
+		}
+
+		// Gain for the chunk about to come out. The window covers every finished
+		// chunk from that one on; the ramp through the next chunk starts from here
+		// too, and that one is in the window as well, so no ramp ever overshoots
+		void next_chunk() {
+			uint64_t nOldest = m_nChunk >= m_nChunks ? m_nChunk - m_nChunks : 0;
+			while (m_nBack > m_nFront && at(m_nFront).nChunk < nOldest)
+				m_nFront++;
+			float fLoudest = m_nBack > m_nFront ? at(m_nFront).fLevel : 0.0f;
+
+			float fCeiling = (float)decibels_to_gain(m_dCeiling);
+			float fNeeded = fLoudest > fCeiling ? fCeiling / fLoudest : 1.0f;
+			m_fGainFrom = m_fGain;
+			if (fNeeded < m_fGain)
+				m_fGain = fNeeded;
+			else
+				m_fGain += (fNeeded - m_fGain) * (float)(1.0 - exp(-(double)dynamics_chunk / (m_dRelease * m_dSampleRate)));
+			m_fGainStep = (m_fGain - m_fGainFrom) / (float)dynamics_chunk;
+			m_fReduction = (float)(20.0 * log10(m_fGain));
+		}
+	};
+}
@@ -0,0 +1,261 @@
+#pragma once
+#include "events.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace synth {
+	// One processing module on the mix. Everything it needs is allocated in
+	// prepare(), on the control thread before audio starts; process() runs on
+	// the audio thread, works on a whole block in place and never allocates or
+	// locks. The block comes as one buffer per channel, as many as prepare()
+	// was told. Settings are changed from the control thread through the
+	// module's own setters, which only store atomics the next block picks up.
+	class effect {
+	public:
+		virtual ~effect() {}
+
+		virtual void prepare(double /*dSampleRate*/, size_t /*nMaxFrames*/, size_t /*nChannels*/) {}
+		virtual void process(float* const* pChannels, size_t nFrames) = 0;
+
+		// true once it only gives out silence for silence in, so a render knows when it's over
+		virtual bool silent() const { return true; }
+	};
+
+	// Effects run one after the other in the order they were added
+	class effect_chain {
+	public:
+		// control thread, before audio starts; prepared right away if the chain already is
+		effect& add(std::unique_ptr<effect> pEffect) {
+			if (m_nMaxFrames > 0)
+				pEffect->prepare(m_dSampleRate, m_nMaxFrames, m_nChannels);
+			m_vecEffects.push_back(std::move(pEffect));
+			return *m_vecEffects.back();
+		}
+
+		void prepare(double dSampleRate, size_t nMaxFrames, size_t nChannels) {
+			m_dSampleRate = dSampleRate;
+			m_nMaxFrames = nMaxFrames;
+			m_nChannels = nChannels;
+			for (auto& pEffect : m_vecEffects)
+				pEffect->prepare(dSampleRate, nMaxFrames, nChannels);
+		}
+
+		void process(float* const* pChannels, size_t nFrames) {
+			for (auto& pEffect : m_vecEffects)
+				pEffect->process(pChannels, nFrames);
+		}
+
+		bool silent() const {
+			for (auto const& pEffect : m_vecEffects)
+				if (!pEffect->silent())
+					return false;
+			return true;
+		}
+
+		bool empty() const { return m_vecEffects.empty(); }
+
+	private:
+		std::vector<std::unique_ptr<effect>> m_vecEffects;
+		double m_dSampleRate = 44100.0;
+		size_t m_nMaxFrames = 0;
+		size_t m_nChannels = 1;
+	};
+
+	// A side chain fed with a share of the mix: the send level scales what goes
+	// in, the chain's output is added back to the mix. Effects on a send only
+	// give out their wet signal (a reverb, say), the dry mix already carries on
+	// past the bus.
+	class send_bus {
+	public:
+		send_bus(double dLevel) : m_dLevel(dLevel), m_dTarget(dLevel) {}
+
+		effect_chain& chain() { return m_chain; }
+
+		void prepare(double dSampleRate, size_t nMaxFrames, size_t nChannels) {
+			m_vecBuffer.assign(nMaxFrames * nChannels, 0.0f);
+			m_vecChannels.resize(nChannels);
+			for (size_t c = 0; c < nChannels; c++)
+				m_vecChannels[c] = m_vecBuffer.data() + c * nMaxFrames;
+			m_chain.prepare(dSampleRate, nMaxFrames, nChannels);
+		}
+
+		// audio thread; the level glides there over the next param_glide_frames
+		void set_level(double dLevel) {
+			m_dTarget = std::min(1.0, std::max(0.0, dLevel));
+			m_dStep = (m_dTarget - m_dLevel) / (double)param_glide_frames;
+			m_nGlide = param_glide_frames;
+		}
+
+		void process(float* const* pMix, size_t nFrames) {
+			size_t nGlide = std::min(nFrames, m_nGlide);
+			double dLevelEnd = m_dLevel;
+			for (size_t c = 0; c < m_vecChannels.size(); c++) {
+				double dLevel = m_dLevel;
+				float* pSend = m_vecChannels[c];
+				for (size_t i = 0; i < nGlide; i++) {
+					dLevel += m_dStep;
+					pSend[i] = pMix[c][i] * (float)dLevel;
+				}
+				dLevelEnd = dLevel;
+
+				// only reached once the glide is over
+				float fLevel = (float)m_dTarget;
+				for (size_t i = nGlide; i < nFrames; i++)
+					pSend[i] = pMix[c][i] * fLevel;
+			}
+			m_dLevel = dLevelEnd;
+			m_nGlide -= nGlide;
+			if (m_nGlide == 0)
+				m_dLevel = m_dTarget;
+
+			m_chain.process(m_vecChannels.data(), nFrames);
+			for (size_t c = 0; c < m_vecChannels.size(); c++)
+				for (size_t i = 0; i < nFrames; i++)
+					pMix[c][i] += m_vecChannels[c][i];
+		}
+
+		bool silent() const { return m_chain.silent(); }
+
+	private:
+		effect_chain m_chain;
+		std::vector<float> m_vecBuffer;    // the channels one after the other
+		std::vector<float*> m_vecChannels; // where each one starts
+		double m_dLevel, m_dTarget;
+		double m_dStep = 0.0;
+		size_t m_nGlide = 0; // frames of the glide still to go
+	};
+
+	// Note lengths for tempo sync, in beats (quarter notes): "1/4" is 1,
+	// "1/8" 0.5, "3/16" 0.75; a trailing 'd' makes it dotted, 't' a triplet
+	inline bool parse_note_length(std::string const& s, double& dBeats) {
+		size_t nSlash = s.find('/');
+		if (nSlash == std::string::npos || nSlash == 0)
+			return false;
+
+		std::string sDenominator = s.substr(nSlash + 1);
+		double dScale = 1.0;
+		if (!sDenominator.empty() && (sDenominator.back() == 'd' || sDenominator.back() == 't')) {
+			dScale = sDenominator.back() == 'd' ? 1.5 : 2.0 / 3.0;
+			sDenominator.pop_back();
+		}
+
+		try {
+			size_t nUsed;
+			double dNumerator = std::stod(s.substr(0, nSlash), &nUsed);
+			if (nUsed != nSlash)
+				return false;
+			double dDenominator = std::stod(sDenominator, &nUsed);
+			if (nUsed != sDenominator.size() || dNumerator <= 0.0 || dDenominator <= 0.0)
+				return false;
+			dBeats = 4.0 * dNumerator / dDenominator * dScale;
+			return true;
+		}
+		catch (...) {
+			return false;
+		}
+	}
+
+	// Feedback delay / echo, one line per channel. The lines are power-of-two
+	// rings, so wrapping is a mask, read at a fractional position with 4-point
+	// Hermite interpolation.
+	// A new delay time isn't jumped to: the read position glides there over
+	// about 50 ms, which bends the pitch of what's in the line like tape
+	// instead of clicking. Each repeat goes through a one-pole lowpass, so
+	// echoes get darker as they fade.
+	class delay_effect : public effect {
+	public:
+		delay_effect(double dMaxSeconds = 4.0) : m_dMaxSeconds(dMaxSeconds) {}
+
+		// all of these are safe from the control thread while audio runs
+		void set_time(double dSeconds) { m_dSeconds = std::min(m_dMaxSeconds, std::max(0.0, dSeconds)); }
+		void set_sync(double dBeats, double dBPM) { set_time(dBeats * 60.0 / std::max(1.0, dBPM)); }
+		void set_feedback(double dFeedback) { m_dFeedback = std::min(0.98, std::max(0.0, dFeedback)); }
+		void set_mix(double dMix) { m_dMix = std::min(1.0, std::max(0.0, dMix)); }
+		void set_damping(double dCutoff) { m_dDamping = std::max(20.0, dCutoff); }
+
+		void prepare(double dSampleRate, size_t /*nMaxFrames*/, size_t nChannels) override {
+			m_dSampleRate = dSampleRate;
+			size_t nSize = 1;
+			while (nSize < (size_t)(m_dMaxSeconds * dSampleRate) + 4)
+				nSize <<= 1;
+			m_vecLine.assign(nSize * nChannels, 0.0f);
+			m_vecDamped.assign(nChannels, 0.0f);
+			m_nMask = nSize - 1;
+			m_nWrite = 0;
+			m_dDelay = delay_samples();
+		}
+
+		void process(float* const* pChannels, size_t nFrames) override {
+			double dTarget = delay_samples();
+			float fFeedback = (float)m_dFeedback.load();
+			float fMix = (float)m_dMix.load();
+			float fDamp = (float)(1.0 - exp(-2.0 * 3.14159265358979323846 * m_dDamping.load() / m_dSampleRate));
+			double dGlide = 1.0 - exp(-1.0 / (0.05 * m_dSampleRate));
+			size_t nChannels = m_vecDamped.size();
+
+			bool bQuiet = true;
+			for (size_t i = 0; i < nFrames; i++) {
+				m_dDelay += (dTarget - m_dDelay) * dGlide;
+
+				// x1 sits dDelay behind the write position, x0 before it, x2 and x3 after
+				double dRead = (double)m_nWrite - m_dDelay;
+				double dWhole = floor(dRead);
+				float t = (float)(dRead - dWhole);
+				size_t n = (size_t)(int64_t)dWhole;
+
+				// every channel reads at the same place, only the line differs
+				for (size_t c = 0; c < nChannels; c++) {
+					const float* pLine = m_vecLine.data() + c * (m_nMask + 1);
+					float x0 = pLine[(n - 1) & m_nMask], x1 = pLine[n & m_nMask];
+					float x2 = pLine[(n + 1) & m_nMask], x3 = pLine[(n + 2) & m_nMask];
+					float c1 = 0.5f * (x2 - x0);
+					float c2 = x0 - 2.5f * x1 + 2.0f * x2 - 0.5f * x3;
+					float c3 = 0.5f * (x3 - x0) + 1.5f * (x1 - x2);
+					float fEcho = ((c3 * t + c2) * t + c1) * t + x1;
+
+					float& fDamped = m_vecDamped[c];
+					fDamped += fDamp * (fEcho - fDamped);
+					if (fabsf(fDamped) < 1e-20f)
+						fDamped = 0.0f; // no denormals in a fading line
+					float& fIn = pChannels[c][i];
+					m_vecLine[c * (m_nMask + 1) + (m_nWrite & m_nMask)] = fIn + fDamped * fFeedback;
+
+					bQuiet = bQuiet && fabsf(fIn) < 1e-6f && fabsf(fEcho) < 1e-6f;
+					fIn += fEcho * fMix;
+				}
+				m_nWrite++;
+			}
+
+			// quiet for a whole trip round the line means the repeats have died out
+			m_nQuiet = bQuiet ? m_nQuiet + nFrames : 0;
+		}
+
+		bool silent() const override { return m_nQuiet > (uint64_t)m_dDelay + 4; }
+
+	private:
+		double m_dMaxSeconds;
+		double m_dSampleRate = 44100.0;
+		std::atomic<double> m_dSeconds{ 0.375 };
+		std::atomic<double> m_dFeedback{ 0.4 };
+		std::atomic<double> m_dMix{ 0.35 };
+		std::atomic<double> m_dDamping{ 4000.0 };
+
+		std::vector<float> m_vecLine;   // the channels' lines one after the other
+		std::vector<float> m_vecDamped; // each line's feedback lowpass
+		size_t m_nMask = 0;
+		size_t m_nWrite = 0;
+		double m_dDelay = 0.0; // in samples, gliding towards the set time
+		uint64_t m_nQuiet = 0;
+
+		// at least 4 samples, so the interpolation never reads what isn't written yet
+		double delay_samples() const {
+			return std::min((double)m_nMask - 4.0, std::max(4.0, m_dSeconds.load() * m_dSampleRate));
+		}
+	};
+}
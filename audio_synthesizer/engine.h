@@ -0,0 +1,378 @@
+#pragma once
+#include "synth.h"
+#include "events.h"
+#include "voicebank.h"
+#include "job_pool.h"
+#include "voice_pool.h"
+#include "instrument_registry.h"
+#include "effects.h"
+#include "dynamics.h"
+#include "telemetry.h"
+
+#include <chrono>
+
+namespace synth {
+	// Everything that turns note events into sound. The live device and the
+	// offline renderer both drive the same process() call. The control thread
+	// only ever talks to it through post(), everything else belongs to the audio
+	// thread.
+	class engine {
+	public:
+		// nThreads renders voices on that many cores (0 = all of them)
+		engine(double dSampleRate = 44100.0, unsigned int nThreads = 0) : m_pool(nThreads)
+		{
+			m_dSampleRate = dSampleRate;
+			m_dCutoff = 100.0;  // Adjust this cutoff frequency as needed
+			m_nNextVoiceSeed = 0;
+			m_nActiveNotes = 0;
+			m_vecPending.reserve(1024);
+			register_default_instruments(m_instruments);
+		}
+
+		double sample_rate() const { return m_dSampleRate; }
+
+		// control thread: hand an event to the audio thread, false if the queue is full
+		bool post(note_event const& e) { return m_queueEvents.push(e); }
+
+		// control thread, before audio starts: how many threads render voices
+		void set_threads(unsigned int nThreads) { m_pool.start(nThreads); }
+		unsigned int threads() const { return m_pool.threads(); }
+
+		// control thread, before audio starts: how many voices the pool can ever
+		// hold (256 unless told otherwise); polyphony can't go past it
+		void set_max_voices(size_t nVoices) { m_voices.reserve(std::max((size_t)1, nVoices)); }
+
+		// both safe to change while audio runs
+		void set_polyphony(size_t nVoices) { m_voices.set_polyphony(nVoices); }
+		void set_steal_policy(steal_policy ePolicy) { m_voices.set_policy(ePolicy); }
+
+		// voices cut off so far because the polyphony limit was reached
+		uint64_t stolen_voices() const { return m_voices.stolen(); }
+
+		// how many notes were sounding at the end of the last block
+		size_t active_notes() const { return m_nActiveNotes; }
+
+		// true once nothing is sounding any more, effect tails included
+		bool idle() const { return m_bIdle; }
+
+		// Control thread, before audio starts: allocates every buffer process()
+		// needs for blocks of up to nMaxFrames in nChannels, effects included, so
+		// the audio thread never has to
+		void prepare(size_t nMaxFrames, size_t nChannels = 1) {
+			m_nMaxFrames = nMaxFrames;
+			m_nChannels = nChannels;
+			m_fMasterGain = (float)m_dMasterGain.load(); // starts right at the setting, no glide up from the default
+			m_vecMix.reserve(nMaxFrames * nChannels);
+			m_vecMixChannels.resize(nChannels);
+			m_vecEnv.reserve(std::min(m_voices.capacity(), (size_t)voice_bank::nMaxVoices) * nMaxFrames);
+			m_vecVoice.reserve((m_voices.capacity() + nChannels) * nMaxFrames);
+			m_vecVoiceChannels.resize(nChannels);
+			m_vecJobNotes.reserve(m_voices.capacity());
+			m_vecFinished.reserve(m_voices.capacity());
+
+			tone_filter filterTone;
+			filterTone.set(m_dCutoff, m_dSampleRate);
+			m_vecTone.resize(nChannels, filterTone);
+
+			m_chainInserts.prepare(m_dSampleRate, nMaxFrames, nChannels);
+			for (auto& pBus : m_vecSends)
+				pBus->prepare(m_dSampleRate, nMaxFrames, nChannels);
+			m_compressor.prepare(m_dSampleRate, nMaxFrames, nChannels);
+			m_limiter.prepare(m_dSampleRate, nMaxFrames, nChannels);
+		}
+
+		// Control thread, before audio starts: the mix goes through the inserts
+		// in order, then a share of it goes to each send bus and what comes back
+		// is added in. param_send events change a send's level while playing
+		effect_chain& inserts() { return m_chainInserts; }
+
+		size_t add_send(double dLevel) {
+			m_vecSends.emplace_back(new send_bus(dLevel));
+			if (m_nMaxFrames > 0)
+				m_vecSends.back()->prepare(m_dSampleRate, m_nMaxFrames, m_nChannels);
+			return m_vecSends.size() - 1;
+		}
+
+		effect_chain& send(size_t nBus) { return m_vecSends[nBus]->chain(); }
+
+		// The master section comes after all of that: the mix is scaled by the
+		// master gain, the compressor evens out its level and the limiter keeps
+		// the peaks under its ceiling. Gain and settings can change while audio
+		// runs; the dynamics are switched on or off before it starts
+		void set_master_gain(double dGain) { m_dMasterGain = std::max(0.0, dGain); }
+		void set_dynamics(bool bOn) { m_bDynamics = bOn; }
+		compressor& master_compressor() { return m_compressor; }
+		lookahead_limiter& master_limiter() { return m_limiter; }
+
+		// per-block render timing and voice counts, readable from any thread
+		render_telemetry& telemetry() { return m_telemetry; }
+
+		// which instrument plays which note id; register new ones or install patches here
+		instrument_registry& instruments() { return m_instruments; }
+
+		// Fills a whole block of interleaved frames (-1.0 to +1.0), starting at
+		// frame nStartFrame, nothing here ever locks. Control events are taken
+		// off the queue at the start of the block and each one lands on the
+		// frame it carries: the block is rendered in pieces split at those
+		// frames, so timing doesn't depend on the block size. Events for frames
+		// already gone land at the start of the block, ones past its end wait
+		// for a later one
+		void process(float* pOut, size_t nFrames, size_t nChannels, uint64_t nStartFrame)
+		{
+			auto tStart = std::chrono::steady_clock::now();
+
+			// the instrument ids stay as they are for the whole block, patch reloads land in between
+			m_pInstruments = m_instruments.begin_block();
+
+			// in frame order, and in the order they were posted within a frame
+			note_event e;
+			while (m_vecPending.size() < m_vecPending.capacity() && m_queueEvents.pop(e)) {
+				auto it = std::upper_bound(m_vecPending.begin(), m_vecPending.end(), e,
+					[](note_event const& a, note_event const& b) { return a.nFrame < b.nFrame; });
+				m_vecPending.insert(it, e);
+			}
+
+			// a bigger block or other channels than prepare() was told about is the only time anything allocates
+			if (nFrames > m_nMaxFrames || nChannels != m_nChannels)
+				prepare(std::max(nFrames, m_nMaxFrames), nChannels);
+
+			size_t nApplied = 0;
+			for (size_t nDone = 0; nDone < nFrames; ) {
+				uint64_t nFrame = nStartFrame + nDone;
+				while (nApplied < m_vecPending.size() && m_vecPending[nApplied].nFrame <= nFrame)
+					apply(m_vecPending[nApplied++], nFrame);
+
+				size_t nEnd = nFrames;
+				if (nApplied < m_vecPending.size() && m_vecPending[nApplied].nFrame < nStartFrame + nFrames)
+					nEnd = (size_t)(m_vecPending[nApplied].nFrame - nStartFrame);
+				render(pOut + nDone * nChannels, nEnd - nDone, nChannels);
+				nDone = nEnd;
+			}
+			m_vecPending.erase(m_vecPending.begin(), m_vecPending.begin() + nApplied);
+			if (!m_vecPending.empty())
+				m_bIdle = false;
+			m_instruments.end_block();
+
+			double dRender = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+			m_telemetry.record_block(dRender, (double)nFrames / m_dSampleRate, m_nActiveNotes);
+		}
+
+	private:
+		// One stretch of a block with no events in it, start to finish. Every
+		// voice is rendered once, in mono, and panned into the channels; from
+		// there on the mix is one buffer per channel, interleaved only at the
+		// very end
+		void render(float* pOut, size_t nFrames, size_t nChannels)
+		{
+			m_vecMix.assign(nFrames * nChannels, 0.0f);
+			for (size_t c = 0; c < nChannels; c++)
+				m_vecMixChannels[c] = m_vecMix.data() + c * nFrames;
+			m_vecEnv.resize(std::min(m_voices.size(), (size_t)voice_bank::nMaxVoices) * nFrames);
+			float fPan[voice_bank::nMaxChannels];
+			bool bBank = nChannels <= (size_t)voice_bank::nMaxChannels;
+
+			m_bankVoices.clear();
+			m_vecJobNotes.clear();
+			for (size_t v = 0; v < m_voices.size(); v++) {
+				note& n = m_voices[v];
+
+				// voices the bank can take are only queued here and rendered together below
+				if (bBank && n.filter.eType == filter_types::none && m_bankVoices.accepts(n)) {
+					// every frame's gain, exactly as the voice would get it rendering on its own
+					float* pEnv = m_vecEnv.data() + m_bankVoices.voices() * nFrames;
+					n.env.process(pEnv, nFrames);
+					pan_gains(n.dPan, nChannels, fPan);
+					m_bankVoices.add(n, n.dVolume, pEnv, fPan);
+					if (n.env.finished())
+						n.active = false;
+					continue;
+				}
+
+				m_vecJobNotes.push_back(v);
+			}
+
+			// one job per remaining voice plus one for the whole bank, each into its
+			// own buffer: mono for a voice, already panned into every channel for the bank
+			size_t nVoiceJobs = m_vecJobNotes.size();
+			size_t nJobs = nVoiceJobs + (m_bankVoices.voices() > 0 ? 1 : 0);
+			if (m_vecVoice.size() < (nVoiceJobs + nChannels) * nFrames)
+				m_vecVoice.resize((nVoiceJobs + nChannels) * nFrames);
+			for (size_t c = 0; c < nChannels; c++)
+				m_vecVoiceChannels[c] = m_vecVoice.data() + (nVoiceJobs + c) * nFrames;
+			m_vecFinished.assign(nVoiceJobs, 0);
+
+			auto renderJob = [&](size_t j) {
+				if (j == nVoiceJobs) {
+					std::fill(m_vecVoiceChannels[0], m_vecVoiceChannels[0] + nChannels * nFrames, 0.0f);
+					m_bankVoices.render(m_vecVoiceChannels.data(), nChannels, nFrames);
+					return;
+				}
+
+				float* pVoice = m_vecVoice.data() + j * nFrames;
+				std::fill(pVoice, pVoice + nFrames, 0.0f);
+
+				note& n = m_voices[m_vecJobNotes[j]];
+				render_voice(n, pVoice, nFrames);
+				m_vecFinished[j] = n.env.finished();
+			};
+			m_pool.run(nJobs, renderJob);
+
+			// summed back in note order whatever thread rendered what, so the output
+			// is bit-exact for any thread count; this is where a voice gets panned
+			for (size_t j = 0; j < nVoiceJobs; j++) {
+				const float* pVoice = m_vecVoice.data() + j * nFrames;
+				note& n = m_voices[m_vecJobNotes[j]];
+				pan_gains(n.dPan, nChannels, fPan);
+				for (size_t c = 0; c < nChannels; c++) {
+					float* pMix = m_vecMixChannels[c];
+					float fGain = fPan[c];
+					for (size_t i = 0; i < nFrames; i++)
+						pMix[i] += pVoice[i] * fGain;
+				}
+				if (m_vecFinished[j])
+					n.active = false;
+			}
+			if (nJobs > nVoiceJobs)
+				for (size_t c = 0; c < nChannels; c++)
+					for (size_t i = 0; i < nFrames; i++)
+						m_vecMixChannels[c][i] += m_vecVoiceChannels[c][i];
+
+			// The tone control is linear, so running it once over the sum sounds the
+			// same as running it on every voice, without the voices sharing its state
+			for (size_t c = 0; c < nChannels; c++)
+				m_vecTone[c].process(m_vecMixChannels[c], nFrames);
+
+			// sends are fed after the inserts, so an echo also gets the reverb
+			m_chainInserts.process(m_vecMixChannels.data(), nFrames);
+			bool bEffectsSilent = m_chainInserts.silent();
+			for (auto& pBus : m_vecSends) {
+				pBus->process(m_vecMixChannels.data(), nFrames);
+				bEffectsSilent = bEffectsSilent && pBus->silent();
+			}
+
+			// master gain glides to a new setting over the block
+			float fGain = m_fMasterGain, fTarget = (float)m_dMasterGain.load();
+			float fStep = (fTarget - fGain) / (float)nFrames;
+			for (size_t c = 0; c < nChannels; c++)
+				for (size_t i = 0; i < nFrames; i++)
+					m_vecMixChannels[c][i] *= fGain + fStep * (float)(i + 1);
+			m_fMasterGain = fTarget;
+
+			if (m_bDynamics) {
+				m_compressor.process(m_vecMixChannels.data(), nFrames);
+				m_limiter.process(m_vecMixChannels.data(), nFrames);
+				bEffectsSilent = bEffectsSilent && m_limiter.silent();
+			}
+
+			m_voices.retire_inactive();
+			m_nActiveNotes = m_voices.size();
+			m_bIdle = m_nActiveNotes == 0 && bEffectsSilent;
+
+			interleave(pOut, nFrames, nChannels);
+		}
+
+		// One pass from the channel buffers to interleaved frames. Mono and stereo,
+		// nearly always what's asked for, get loops of their own the compiler can
+		// vectorize; anything wider goes channel by channel
+		void interleave(float* pOut, size_t nFrames, size_t nChannels) const {
+			const float* pLeft = m_vecMixChannels[0];
+			if (nChannels == 1) {
+				std::copy(pLeft, pLeft + nFrames, pOut);
+			}
+			else if (nChannels == 2) {
+				const float* pRight = m_vecMixChannels[1];
+				for (size_t i = 0; i < nFrames; i++) {
+					pOut[2 * i] = pLeft[i];
+					pOut[2 * i + 1] = pRight[i];
+				}
+			}
+			else {
+				for (size_t c = 0; c < nChannels; c++) {
+					const float* pChannel = m_vecMixChannels[c];
+					for (size_t i = 0; i < nFrames; i++)
+						pOut[i * nChannels + c] = pChannel[i];
+				}
+			}
+		}
+
+		// Applies one control event to the audio thread's private note state; nFrame is where it actually lands
+		void apply(note_event const& e, uint64_t nFrame)
+		{
+			if (e.type == event_type::parameter) {
+				if (e.id == param_cutoff) {
+					m_dCutoff = e.value;
+					for (auto& filterTone : m_vecTone)
+						filterTone.set_cutoff(e.value); // glides there
+				}
+				else if (e.id == param_send && e.nBus >= 0 && (size_t)e.nBus < m_vecSends.size())
+					m_vecSends[e.nBus]->set_level(e.value);
+				return;
+			}
+
+			note* noteFound = m_voices.find(e.id);
+			if (e.type == event_type::note_on) {
+				instrument_def const* pInstrument = m_pInstruments->find(e.nInstrument >= 0 ? e.nInstrument : e.id);
+				if (noteFound == nullptr && pInstrument != nullptr) { // note not sounding yet
+					// create note, taking over another voice if the pool is full
+					note& n = m_voices.activate();
+					n.id = e.id;
+					n.pressed = nFrame;
+					n.channel = 1;
+					n.active = true;
+					n.nSeed = m_nNextVoiceSeed++;
+
+					note_on(*pInstrument, n, m_dSampleRate, e.dFrequency);
+				}
+				else if (noteFound != nullptr && noteFound->released > noteFound->pressed) { // key has been pressed again during release phase
+					noteFound->pressed = nFrame;
+					noteFound->active = true;
+					noteFound->env.note_on();
+				}
+			}
+			else if (noteFound != nullptr) { // key has been released, so switch off
+				if (noteFound->released <= noteFound->pressed) { // <= so a note pressed at frame 0 can still be released
+					noteFound->released = nFrame;
+					noteFound->env.note_off();
+				}
+			}
+		}
+
+		double m_dSampleRate;
+		double m_dCutoff;
+		std::vector<tone_filter> m_vecTone; // one per channel
+
+		// notes are owned by the audio thread, the control thread only talks to it through m_queueEvents
+		voice_pool m_voices;
+		spsc_ring<note_event, 256> m_queueEvents;
+		std::vector<note_event> m_vecPending; // off the queue, waiting for their frame; never grows past its reserve
+		std::atomic<size_t> m_nActiveNotes;
+		std::atomic<bool> m_bIdle{ true };
+		uint64_t m_nNextVoiceSeed; // voices are seeded in the order they start, so renders repeat exactly
+
+		// sine/triangle voices are rendered together here, several at a time
+		voice_bank m_bankVoices;
+		std::vector<float> m_vecMix, m_vecVoice, m_vecEnv;
+		std::vector<float*> m_vecMixChannels, m_vecVoiceChannels; // each channel's buffer in m_vecMix, and the bank's in m_vecVoice
+		size_t m_nMaxFrames = 0;
+		size_t m_nChannels = 1;
+
+		effect_chain m_chainInserts;
+		std::vector<std::unique_ptr<send_bus>> m_vecSends;
+
+		std::atomic<double> m_dMasterGain{ 0.5 };
+		float m_fMasterGain = 0.5f; // where the glide towards m_dMasterGain has got to
+		bool m_bDynamics = true;
+		compressor m_compressor;
+		lookahead_limiter m_limiter;
+
+		// voices rendered as separate jobs this block, and whether each one finished
+		job_pool m_pool;
+		std::vector<size_t> m_vecJobNotes;
+		std::vector<char> m_vecFinished;
+
+		render_telemetry m_telemetry;
+
+		instrument_registry m_instruments;
+		instrument_registry::table const* m_pInstruments = nullptr; // this block's view of m_instruments
+	};
+}
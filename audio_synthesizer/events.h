@@ -0,0 +1,71 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace synth {
+	enum class event_type {
+		note_on, note_off, parameter
+	};
+
+	enum parameter_id {
+		param_cutoff,
+		param_send // level of send bus nBus, 0..1
+	};
+
+	// parameter events glide to the new value over this many frames, however the blocks fall
+	const size_t param_glide_frames = 256;
+
+	// something the control thread wants the audio thread to do
+	struct note_event {
+		event_type type = event_type::note_on;
+		int id = -1; // note id for note on/off, parameter_id for parameters
+		uint64_t nFrame = 0; // frame it takes effect on
+		double value = 0.0; // new value for parameter events
+		int nBus = 0; // which send bus, for param_send
+		int nInstrument = -1; // note on: the id whose instrument plays it, -1 for id's own
+		double dFrequency = 0.0; // note on: pitch of its first partial in Hz, 0 plays the instrument as written
+	};
+
+	// Wait-free single producer / single consumer ring. One thread may push and
+	// one (other) thread may pop, neither ever blocks or allocates. nCapacity
+	// must be a power of two; one slot is always kept free
+	template<class T, size_t nCapacity>
+	class spsc_ring {
+		static_assert((nCapacity & (nCapacity - 1)) == 0, "spsc_ring capacity must be a power of two");
+
+	public:
+		// producer side, returns false if the ring is full
+		bool push(T const& item) {
+			size_t nHead = m_nHead.load(std::memory_order_relaxed);
+			size_t nNext = (nHead + 1) & (nCapacity - 1);
+			if (nNext == m_nTail.load(std::memory_order_acquire))
+				return false;
+
+			m_items[nHead] = item;
+			m_nHead.store(nNext, std::memory_order_release);
+			return true;
+		}
+
+		// consumer side, returns false if there is nothing to take
+		bool pop(T& item) {
+			size_t nTail = m_nTail.load(std::memory_order_relaxed);
+			if (nTail == m_nHead.load(std::memory_order_acquire))
+				return false;
+
+			item = m_items[nTail];
+			m_nTail.store((nTail + 1) & (nCapacity - 1), std::memory_order_release);
+			return true;
+		}
+
+		bool empty() const {
+			return m_nTail.load(std::memory_order_acquire) == m_nHead.load(std::memory_order_acquire);
+		}
+
+	private:
+		// head and tail on their own cache lines so the two threads don't fight over them
+		alignas(64) std::atomic<size_t> m_nHead{ 0 };
+		alignas(64) std::atomic<size_t> m_nTail{ 0 };
+		alignas(64) T m_items[nCapacity];
+	};
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+// The Windows build links fftw3.lib already; elsewhere everything FFT based
+// (the analyzer, the convolution reverb) is opt in: build with
+// -DSYNTH_WITH_FFTW and link -lfftw3
+#ifdef _WIN32
+#include <api/fftw3.h>
+#ifndef SYNTH_WITH_FFTW
+#define SYNTH_WITH_FFTW
+#endif
+#elif defined(SYNTH_WITH_FFTW)
+#include <fftw3.h>
+#endif
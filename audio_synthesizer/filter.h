@@ -0,0 +1,239 @@
+#pragma once
+#include "events.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+namespace synth {
+	enum class filter_types {
+		none, lowpass, highpass, bandpass, notch
+	};
+
+	enum class filter_topologies {
+		svf,   // state variable, stays well behaved while the cutoff moves
+		biquad // RBJ cookbook biquad, transposed direct form II
+	};
+
+	// Per-voice two-pole filter. Coefficients are worked out once per block:
+	// set_cutoff()/set_resonance() only store a target, and the next process()
+	// ramps every coefficient linearly from where it was to the target across
+	// that block, so sweeps don't zipper and the per-sample loop is nothing but
+	// multiply-adds. The mode is folded into the coefficients too (the SVF's
+	// output is a mix of its three taps), so the loop has no branches.
+	class voice_filter {
+	public:
+		filter_types eType = filter_types::none;
+
+		// snaps straight to the settings and clears the state, for a new note
+		void set(filter_types eFilterType, double dCutoff, double dResonance, double dSampleRate, filter_topologies eTopology = filter_topologies::svf) {
+			eType = eFilterType;
+			m_eTopology = eTopology;
+			m_dSampleRate = dSampleRate;
+			m_dCutoff = dCutoff;
+			m_dResonance = dResonance;
+			design(m_fCoef);
+			m_bDirty = false;
+			m_fState[0] = m_fState[1] = 0.0f;
+		}
+
+		// reached over the next block
+		void set_cutoff(double dCutoff) {
+			m_dCutoff = dCutoff;
+			m_bDirty = true;
+		}
+
+		void set_resonance(double dResonance) {
+			m_dResonance = dResonance;
+			m_bDirty = true;
+		}
+
+		void process(float* pBuffer, size_t nFrames) {
+			if (eType == filter_types::none || nFrames == 0)
+				return;
+
+			float fStep[nCoefs];
+			bool bRamp = m_bDirty;
+			if (bRamp) {
+				float fTarget[nCoefs];
+				design(fTarget);
+				for (int c = 0; c < nCoefs; c++)
+					fStep[c] = (fTarget[c] - m_fCoef[c]) / (float)nFrames;
+				m_bDirty = false;
+			}
+
+			if (m_eTopology == filter_topologies::svf)
+				bRamp ? run_svf<true>(pBuffer, nFrames, fStep) : run_svf<false>(pBuffer, nFrames, fStep);
+			else
+				bRamp ? run_biquad<true>(pBuffer, nFrames, fStep) : run_biquad<false>(pBuffer, nFrames, fStep);
+
+			// a decayed tail would otherwise sit in denormals and crawl
+			for (float& f : m_fState)
+				if (fabsf(f) < 1e-20f)
+					f = 0.0f;
+		}
+
+	private:
+		static const int nCoefs = 6;
+
+		filter_topologies m_eTopology = filter_topologies::svf;
+		double m_dSampleRate = 44100.0;
+		double m_dCutoff = 1000.0;
+		double m_dResonance = 0.707;
+		bool m_bDirty = false;
+
+		// svf: a1 a2 a3 and the output mix m0 m1 m2; biquad: b0 b1 b2 a1 a2
+		float m_fCoef[nCoefs] = {};
+		float m_fState[2] = {};
+
+		void design(float* fCoef) const {
+			const double dPi = 3.14159265358979323846;
+			double dCutoff = fmin(fmax(m_dCutoff, 10.0), 0.49 * m_dSampleRate);
+			double dQ = fmax(m_dResonance, 0.1);
+
+			if (m_eTopology == filter_topologies::svf) {
+				// Andrew Simper's trapezoidal SVF
+				double g = tan(dPi * dCutoff / m_dSampleRate);
+				double k = 1.0 / dQ;
+				double a1 = 1.0 / (1.0 + g * (g + k));
+				fCoef[0] = (float)a1;
+				fCoef[1] = (float)(g * a1);
+				fCoef[2] = (float)(g * g * a1);
+
+				// out = m0 * input + m1 * band + m2 * low
+				double m0 = 0.0, m1 = 0.0, m2 = 0.0;
+				switch (eType) {
+				case filter_types::lowpass: m2 = 1.0; break;
+				case filter_types::highpass: m0 = 1.0; m1 = -k; m2 = -1.0; break;
+				case filter_types::bandpass: m1 = k; break; // 0 dB at the centre, like the biquad
+				case filter_types::notch: m0 = 1.0; m1 = -k; break;
+				default: m0 = 1.0; break;
+				}
+				fCoef[3] = (float)m0;
+				fCoef[4] = (float)m1;
+				fCoef[5] = (float)m2;
+				return;
+			}
+
+			double w0 = 2.0 * dPi * dCutoff / m_dSampleRate;
+			double dCos = cos(w0);
+			double dAlpha = sin(w0) / (2.0 * dQ);
+			double b0 = 1.0, b1 = 0.0, b2 = 0.0;
+			switch (eType) {
+			case filter_types::lowpass: b0 = (1.0 - dCos) / 2.0; b1 = 1.0 - dCos; b2 = b0; break;
+			case filter_types::highpass: b0 = (1.0 + dCos) / 2.0; b1 = -(1.0 + dCos); b2 = b0; break;
+			case filter_types::bandpass: b0 = dAlpha; b1 = 0.0; b2 = -dAlpha; break;
+			case filter_types::notch: b0 = 1.0; b1 = -2.0 * dCos; b2 = 1.0; break;
+			default: break;
+			}
+			double a0 = 1.0 + dAlpha;
+			fCoef[0] = (float)(b0 / a0);
+			fCoef[1] = (float)(b1 / a0);
+			fCoef[2] = (float)(b2 / a0);
+			fCoef[3] = (float)(-2.0 * dCos / a0);
+			fCoef[4] = (float)((1.0 - dAlpha) / a0);
+			fCoef[5] = 0.0f;
+		}
+
+		template<bool bRamp>
+		void run_svf(float* pBuffer, size_t nFrames, const float* fStep) {
+			float a1 = m_fCoef[0], a2 = m_fCoef[1], a3 = m_fCoef[2];
+			float m0 = m_fCoef[3], m1 = m_fCoef[4], m2 = m_fCoef[5];
+			float ic1 = m_fState[0], ic2 = m_fState[1];
+			for (size_t i = 0; i < nFrames; i++) {
+				if (bRamp) {
+					a1 += fStep[0]; a2 += fStep[1]; a3 += fStep[2];
+					m0 += fStep[3]; m1 += fStep[4]; m2 += fStep[5];
+				}
+				float v0 = pBuffer[i];
+				float v3 = v0 - ic2;
+				float v1 = a1 * ic1 + a2 * v3;
+				float v2 = ic2 + a2 * ic1 + a3 * v3;
+				ic1 = 2.0f * v1 - ic1;
+				ic2 = 2.0f * v2 - ic2;
+				pBuffer[i] = m0 * v0 + m1 * v1 + m2 * v2;
+			}
+			if (bRamp) {
+				m_fCoef[0] = a1; m_fCoef[1] = a2; m_fCoef[2] = a3;
+				m_fCoef[3] = m0; m_fCoef[4] = m1; m_fCoef[5] = m2;
+			}
+			m_fState[0] = ic1;
+			m_fState[1] = ic2;
+		}
+
+		template<bool bRamp>
+		void run_biquad(float* pBuffer, size_t nFrames, const float* fStep) {
+			float b0 = m_fCoef[0], b1 = m_fCoef[1], b2 = m_fCoef[2];
+			float a1 = m_fCoef[3], a2 = m_fCoef[4];
+			float s1 = m_fState[0], s2 = m_fState[1];
+			for (size_t i = 0; i < nFrames; i++) {
+				if (bRamp) {
+					b0 += fStep[0]; b1 += fStep[1]; b2 += fStep[2];
+					a1 += fStep[3]; a2 += fStep[4];
+				}
+				float x = pBuffer[i];
+				float y = b0 * x + s1;
+				s1 = b1 * x - a1 * y + s2;
+				s2 = b2 * x - a2 * y;
+				pBuffer[i] = y;
+			}
+			if (bRamp) {
+				m_fCoef[0] = b0; m_fCoef[1] = b1; m_fCoef[2] = b2;
+				m_fCoef[3] = a1; m_fCoef[4] = a2;
+			}
+			m_fState[0] = s1;
+			m_fState[1] = s2;
+		}
+	};
+
+	// The engine's tone control: a one-pole lowpass over the whole mix. The
+	// cutoff can be moved any time; the coefficient glides to it across the
+	// next block instead of jumping.
+	class tone_filter {
+	public:
+		void set(double dCutoff, double dSampleRate) {
+			m_dSampleRate = dSampleRate;
+			m_dCoef = m_dTarget = coef(dCutoff);
+			m_nGlide = 0;
+		}
+
+		// glides there over the next param_glide_frames
+		void set_cutoff(double dCutoff) {
+			m_dTarget = coef(dCutoff);
+			m_dStep = (m_dTarget - m_dCoef) / (double)param_glide_frames;
+			m_nGlide = param_glide_frames;
+		}
+
+		void process(float* pBuffer, size_t nFrames) {
+			size_t nGlide = std::min(nFrames, m_nGlide);
+			for (size_t i = 0; i < nGlide; i++) {
+				m_dCoef += m_dStep;
+				m_dState += m_dCoef * (pBuffer[i] - m_dState);
+				pBuffer[i] = (float)m_dState;
+			}
+			m_nGlide -= nGlide;
+			if (m_nGlide == 0)
+				m_dCoef = m_dTarget; // no drift from summing the steps
+
+			for (size_t i = nGlide; i < nFrames; i++) {
+				m_dState += m_dCoef * (pBuffer[i] - m_dState);
+				pBuffer[i] = (float)m_dState;
+			}
+		}
+
+	private:
+		double m_dSampleRate = 44100.0;
+		double m_dCoef = 1.0;
+		double m_dTarget = 1.0;
+		double m_dStep = 0.0;
+		size_t m_nGlide = 0; // frames of the glide still to go
+		double m_dState = 0.0;
+
+		// same response the old RC filter had: dt / (RC + dt)
+		double coef(double dCutoff) const {
+			double RC = 1.0 / (2.0 * 3.14159265358979323846 * fmax(dCutoff, 1.0));
+			double dt = 1.0 / m_dSampleRate;
+			return dt / (RC + dt);
+		}
+	};
+}
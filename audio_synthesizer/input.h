@@ -0,0 +1,496 @@
+#pragma once
+#include "events.h"
+#include "midi.h"
+#include "offline.h"
+
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+namespace synth {
+	enum class input_kind {
+		event,       // e goes to the engine as it is
+		cutoff_step, // the cutoff moves by dStep Hz from wherever the control thread has it
+		quit
+	};
+
+	// something a source wants done; e.nFrame is the engine frame it happened on
+	struct input_event {
+		input_kind eKind = input_kind::event;
+		note_event e;
+		double dStep = 0.0;
+	};
+
+	class input_hub;
+
+	// Somewhere control input comes from. Each source gets a thread of its own
+	// and blocks on its input there, so it costs nothing while nothing happens
+	class input_source {
+	public:
+		virtual ~input_source() {}
+
+		// the source's thread: hands everything to hub.push(), returns once the
+		// input has run out or stop() was called
+		virtual void run(input_hub& hub) = 0;
+
+		// any thread: makes run() return soon
+		virtual void stop() = 0;
+	};
+
+	// Collects the input of every source into one queue the control thread
+	// sleeps on. Nothing here is real time; the engine only ever sees what the
+	// control thread posts to it afterwards
+	class input_hub {
+	public:
+		// fnClock is the engine frame that something happening now should land on
+		input_hub(std::function<uint64_t()> fnClock) : m_fnClock(fnClock) {}
+		~input_hub() { stop(); }
+
+		// before start()
+		void add(std::unique_ptr<input_source> pSource) { m_vecSources.push_back(std::move(pSource)); }
+
+		void start() {
+			for (auto& pSource : m_vecSources) {
+				input_source* p = pSource.get();
+				m_vecThreads.emplace_back([this, p]() {
+					p->run(*this);
+					std::lock_guard<std::mutex> lock(m_mux);
+					m_nFinished++;
+				});
+			}
+		}
+
+		void stop() {
+			for (auto& pSource : m_vecSources)
+				pSource->stop();
+			for (auto& thread : m_vecThreads)
+				thread.join();
+			m_vecThreads.clear();
+		}
+
+		uint64_t now() const { return m_fnClock(); }
+
+		// source threads
+		void push(input_event const& in) {
+			{
+				std::lock_guard<std::mutex> lock(m_mux);
+				m_queue.push_back(in);
+			}
+			m_cv.notify_one();
+		}
+
+		// Control thread: sleeps until there is an event to hand out or
+		// tDeadline, false for the deadline
+		bool wait(input_event& in, std::chrono::steady_clock::time_point tDeadline) {
+			std::unique_lock<std::mutex> lock(m_mux);
+			if (!m_cv.wait_until(lock, tDeadline, [this]() { return !m_queue.empty(); }))
+				return false;
+			in = m_queue.front();
+			m_queue.pop_front();
+			return true;
+		}
+
+		// there were sources and every one of them has run out of input
+		bool finished() {
+			std::lock_guard<std::mutex> lock(m_mux);
+			return !m_vecSources.empty() && m_nFinished == m_vecSources.size() && m_queue.empty();
+		}
+
+	private:
+		std::function<uint64_t()> m_fnClock;
+		std::vector<std::unique_ptr<input_source>> m_vecSources;
+		std::vector<std::thread> m_vecThreads;
+
+		std::mutex m_mux;
+		std::condition_variable m_cv;
+		std::deque<input_event> m_queue;
+		size_t m_nFinished = 0;
+	};
+
+#ifndef _WIN32
+	// A pipe to ourselves, so a thread blocked in poll() can be woken from
+	// another one. Once woken it stays readable, which is all stop() needs
+	class wake_pipe {
+	public:
+		wake_pipe() {
+			if (pipe(m_fd) != 0)
+				m_fd[0] = m_fd[1] = -1;
+		}
+
+		~wake_pipe() {
+			if (m_fd[0] >= 0) {
+				close(m_fd[0]);
+				close(m_fd[1]);
+			}
+		}
+
+		void wake() {
+			char c = 0;
+			ssize_t nWritten = write(m_fd[1], &c, 1); // fails only when already full, so already awake
+			(void)nWritten;
+		}
+
+		// blocks until fd can be read without blocking (true) or wake() (false)
+		bool wait_readable(int fd) const {
+			pollfd fds[2] = { { fd, POLLIN, 0 }, { m_fd[0], POLLIN, 0 } };
+			while (poll(fds, 2, -1) < 0)
+				if (errno != EINTR)
+					return false;
+			return fds[1].revents == 0;
+		}
+
+	private:
+		int m_fd[2];
+	};
+#endif
+
+	// The keys the synth always had: A S D F E play ids 0 to 4, up and down
+	// move the cutoff 10 Hz, Q quits. The Windows console reports keys going
+	// down and up, so a note holds for as long as its key does. A terminal only
+	// ever says a key was typed, so there one press starts the note and the next
+	// releases it; the terminal is put in raw mode for as long as this runs,
+	// where Ctrl+C quits too
+	class keyboard_source : public input_source {
+	public:
+		keyboard_source() {
+#ifdef _WIN32
+			m_hStop = CreateEventA(NULL, TRUE, FALSE, NULL);
+#endif
+		}
+
+		~keyboard_source() {
+#ifdef _WIN32
+			CloseHandle(m_hStop);
+#endif
+		}
+
+		void run(input_hub& hub) override {
+#ifdef _WIN32
+			HANDLE hInput = GetStdHandle(STD_INPUT_HANDLE);
+			HANDLE hWait[2] = { m_hStop, hInput };
+			while (WaitForMultipleObjects(2, hWait, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+				INPUT_RECORD records[16];
+				DWORD nRead = 0;
+				if (!ReadConsoleInputW(hInput, records, 16, &nRead))
+					return;
+
+				for (DWORD i = 0; i < nRead; i++) {
+					if (records[i].EventType != KEY_EVENT)
+						continue;
+					KEY_EVENT_RECORD const& key = records[i].Event.KeyEvent;
+					if (key.bKeyDown && (key.wVirtualKeyCode == VK_UP || key.wVirtualKeyCode == VK_DOWN))
+						step(hub, key.wVirtualKeyCode == VK_UP ? 10.0 : -10.0);
+					else if (key.bKeyDown && key.wVirtualKeyCode == 'Q') {
+						quit(hub);
+						return;
+					}
+					else {
+						// held keys repeat their key down, only the changes are notes
+						int id = key_id(key.wVirtualKeyCode);
+						if (id >= 0 && (key.bKeyDown != 0) != m_bOn[id])
+							note(hub, id, key.bKeyDown != 0);
+					}
+				}
+			}
+#else
+			bool bTerminal = isatty(STDIN_FILENO) != 0;
+			termios termSaved;
+			if (bTerminal && tcgetattr(STDIN_FILENO, &termSaved) == 0) {
+				termios termRaw = termSaved;
+				termRaw.c_lflag &= ~(ICANON | ECHO | ISIG);
+				termRaw.c_cc[VMIN] = 1;
+				termRaw.c_cc[VTIME] = 0;
+				tcsetattr(STDIN_FILENO, TCSANOW, &termRaw);
+			}
+			else
+				bTerminal = false;
+
+			int nEscape = 0; // how far into an arrow key's ESC [ A
+			bool bRunning = true;
+			while (bRunning && m_wake.wait_readable(STDIN_FILENO)) {
+				char buf[64];
+				ssize_t nRead = read(STDIN_FILENO, buf, sizeof(buf));
+				if (nRead <= 0)
+					break; // end of input
+
+				for (ssize_t i = 0; i < nRead && bRunning; i++) {
+					char c = buf[i];
+					if (nEscape == 1)
+						nEscape = c == '[' ? 2 : 0;
+					else if (nEscape == 2) {
+						nEscape = 0;
+						if (c == 'A' || c == 'B')
+							step(hub, c == 'A' ? 10.0 : -10.0);
+					}
+					else if (c == 27)
+						nEscape = 1;
+					else if (c == 'q' || c == 'Q' || c == 3) {
+						quit(hub);
+						bRunning = false;
+					}
+					else {
+						int id = key_id(c);
+						if (id >= 0)
+							note(hub, id, !m_bOn[id]);
+					}
+				}
+			}
+
+			if (bTerminal)
+				tcsetattr(STDIN_FILENO, TCSANOW, &termSaved);
+#endif
+		}
+
+		void stop() override {
+#ifdef _WIN32
+			SetEvent(m_hStop);
+#else
+			m_wake.wake();
+#endif
+		}
+
+	private:
+		bool m_bOn[5] = {};
+#ifdef _WIN32
+		HANDLE m_hStop;
+#else
+		wake_pipe m_wake;
+#endif
+
+		// ids 0..4 for A S D F E, either case, -1 for anything else
+		static int key_id(int c) {
+			const char* sKeys = "ASDFE";
+			const char* p = c > 0 && c < 128 ? strchr(sKeys, toupper(c)) : nullptr;
+			return p != nullptr ? (int)(p - sKeys) : -1;
+		}
+
+		void note(input_hub& hub, int id, bool bOn) {
+			m_bOn[id] = bOn;
+			input_event in;
+			in.e.type = bOn ? event_type::note_on : event_type::note_off;
+			in.e.id = id;
+			in.e.nFrame = hub.now();
+			hub.push(in);
+		}
+
+		void step(input_hub& hub, double dStep) {
+			input_event in;
+			in.eKind = input_kind::cutoff_step;
+			in.dStep = dStep;
+			in.e.nFrame = hub.now();
+			hub.push(in);
+		}
+
+		void quit(input_hub& hub) {
+			input_event in;
+			in.eKind = input_kind::quit;
+			in.e.nFrame = hub.now();
+			hub.push(in);
+		}
+	};
+
+	// A named pipe carrying raw MIDI, standing in for a MIDI port: a bridge from
+	// a real port, a script or plain `printf '\x90\x45\x40' > pipe` can all play.
+	// Messages turn into events just as a MIDI file's do (midi_to_event), the
+	// channels mapped to instruments by the same map. On Windows the name is
+	// a pipe under \\.\pipe\, elsewhere a fifo, made if it isn't there yet. When
+	// a writer goes away the pipe waits for the next one
+	class midi_pipe_source : public input_source {
+	public:
+		midi_pipe_source(std::string const& sPath, midi_channel_map const& map = midi_channel_map()) : m_sPath(sPath), m_map(map) {
+#ifdef _WIN32
+			if (m_sPath.compare(0, 2, "\\\\") != 0)
+				m_sPath = "\\\\.\\pipe\\" + m_sPath;
+			m_hStop = CreateEventA(NULL, TRUE, FALSE, NULL);
+#endif
+		}
+
+		~midi_pipe_source() {
+#ifdef _WIN32
+			if (m_hPipe != INVALID_HANDLE_VALUE)
+				CloseHandle(m_hPipe);
+			CloseHandle(m_hStop);
+#endif
+		}
+
+		// control thread, before the hub starts
+		bool open(std::string& sError) {
+#ifdef _WIN32
+			m_hPipe = CreateNamedPipeA(m_sPath.c_str(), PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED, PIPE_TYPE_BYTE | PIPE_WAIT, 1, 0, 4096, 0, NULL);
+			if (m_hPipe == INVALID_HANDLE_VALUE) {
+				sError = "can't create the pipe " + m_sPath;
+				return false;
+			}
+#else
+			struct stat st;
+			if (stat(m_sPath.c_str(), &st) != 0 && mkfifo(m_sPath.c_str(), 0600) != 0) {
+				sError = "can't make the fifo " + m_sPath;
+				return false;
+			}
+			if (stat(m_sPath.c_str(), &st) != 0 || !S_ISFIFO(st.st_mode)) {
+				sError = m_sPath + " isn't a fifo";
+				return false;
+			}
+#endif
+			return true;
+		}
+
+		void run(input_hub& hub) override {
+#ifdef _WIN32
+			OVERLAPPED ov = {};
+			ov.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+			while (!m_bStop) {
+				DWORD nBytes = 0;
+				if (!ConnectNamedPipe(m_hPipe, &ov)) {
+					DWORD nError = GetLastError();
+					if (nError == ERROR_IO_PENDING) {
+						if (!finish(ov, nBytes))
+							break;
+					}
+					else if (nError != ERROR_PIPE_CONNECTED)
+						break;
+				}
+
+				uint8_t buf[256];
+				while (true) {
+					if (!ReadFile(m_hPipe, buf, sizeof(buf), &nBytes, &ov) && (GetLastError() != ERROR_IO_PENDING || !finish(ov, nBytes)))
+						break; // the writer went away, or stop()
+					received(hub, buf, nBytes);
+				}
+				DisconnectNamedPipe(m_hPipe);
+			}
+			CloseHandle(ov.hEvent);
+#else
+			while (!m_bStop) {
+				// non-blocking so opening doesn't wait for a writer, the poll does
+				int fd = ::open(m_sPath.c_str(), O_RDONLY | O_NONBLOCK);
+				if (fd < 0)
+					return;
+
+				while (m_wake.wait_readable(fd)) {
+					uint8_t buf[256];
+					ssize_t nRead = read(fd, buf, sizeof(buf));
+					if (nRead < 0 && errno == EAGAIN)
+						continue;
+					if (nRead <= 0)
+						break; // the writer went away
+					received(hub, buf, (size_t)nRead);
+				}
+				close(fd);
+			}
+#endif
+		}
+
+		void stop() override {
+			m_bStop = true;
+#ifdef _WIN32
+			SetEvent(m_hStop);
+#else
+			m_wake.wake();
+#endif
+		}
+
+	private:
+		std::string m_sPath;
+		midi_channel_map m_map;
+		std::atomic<bool> m_bStop{ false };
+		midi_parser m_parser;
+#ifdef _WIN32
+		HANDLE m_hPipe = INVALID_HANDLE_VALUE;
+		HANDLE m_hStop;
+
+		// waits out an overlapped call that went pending, false if it failed or stop() came first
+		bool finish(OVERLAPPED& ov, DWORD& nBytes) {
+			HANDLE hWait[2] = { m_hStop, ov.hEvent };
+			if (WaitForMultipleObjects(2, hWait, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+				CancelIo(m_hPipe);
+				GetOverlappedResult(m_hPipe, &ov, &nBytes, TRUE);
+				return false;
+			}
+			return GetOverlappedResult(m_hPipe, &ov, &nBytes, FALSE) != 0;
+		}
+#else
+		wake_pipe m_wake;
+#endif
+
+		void received(input_hub& hub, const uint8_t* pBytes, size_t nBytes) {
+			uint64_t nFrame = hub.now();
+			for (size_t i = 0; i < nBytes; i++) {
+				input_event in;
+				if (!m_parser.feed(pBytes[i]) || !midi_to_event(m_parser.status(), m_parser.data1(), m_parser.data2(), m_map, in.e))
+					continue;
+				in.e.nFrame = nFrame;
+				hub.push(in);
+			}
+		}
+	};
+
+	// Plays a list of events, an event script or a sequenced MIDI file, in real
+	// time, counting frames from when the source starts. Each event goes out
+	// nLookAhead frames before its own; the engine holds on to it until then, so
+	// it still lands on its exact frame however late this thread wakes up
+	class script_source : public input_source {
+	public:
+		script_source(std::vector<note_event> const& vecEvents, double dSampleRate, uint64_t nLookAhead = 0)
+			: m_vecEvents(vecEvents), m_dSampleRate(dSampleRate), m_nLookAhead(nLookAhead) {}
+
+		void run(input_hub& hub) override {
+			uint64_t nStart = hub.now() + m_nLookAhead;
+			std::unique_lock<std::mutex> lock(m_mux);
+			for (auto const& e : m_vecEvents) {
+				uint64_t nDue = nStart + e.nFrame;
+				// sleeps on the wall clock for what's left and looks again; at least
+				// a millisecond, the engine's frames only move a block at a time
+				for (uint64_t nNow = hub.now(); !m_bStop && nNow + m_nLookAhead < nDue; nNow = hub.now())
+					m_cv.wait_for(lock, std::chrono::duration<double>(std::max((double)(nDue - m_nLookAhead - nNow) / m_dSampleRate, 0.001)));
+				if (m_bStop)
+					return;
+
+				input_event in;
+				in.e = e;
+				in.e.nFrame = nDue;
+				hub.push(in);
+			}
+		}
+
+		void stop() override {
+			{
+				std::lock_guard<std::mutex> lock(m_mux);
+				m_bStop = true;
+			}
+			m_cv.notify_all();
+		}
+
+	private:
+		std::vector<note_event> m_vecEvents;
+		double m_dSampleRate;
+		uint64_t m_nLookAhead;
+		std::mutex m_mux;
+		std::condition_variable m_cv;
+		bool m_bStop = false;
+	};
+}
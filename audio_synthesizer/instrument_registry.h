@@ -0,0 +1,142 @@
+#pragma once
+#include "synth.h"
+
+#include <cstring>
+#include <memory>
+
+namespace synth {
+	// Which instrument plays which note id. Lookup is one array index, so the
+	// audio thread never branches on ids; new instruments are registered here
+	// instead of being wired into the engine.
+	//
+	// The whole id table is swapped through one atomic pointer, and the audio
+	// thread picks the table up once at the start of a block, so a batch of
+	// changes (a patch reload) lands all at once between two blocks. Old tables,
+	// and the patches only they used, are freed once the audio thread has been
+	// through a block without them.
+	class instrument_registry {
+	public:
+		static const int nMaxIds = 512;
+
+		struct table {
+			instrument_def const* pById[nMaxIds] = {};
+			std::vector<instrument_def const*> vecKnown;
+			std::vector<std::pair<instrument_def const*, std::shared_ptr<const void>>> vecOwned; // keeps loaded patches alive
+
+			instrument_def const* find(int id) const {
+				return id >= 0 && id < nMaxIds ? pById[id] : nullptr;
+			}
+
+			// A def with a name that's already known replaces the old one, ids
+			// included. pDef must live as long as pOwner, or forever when there's no owner
+			void add(instrument_def const* pDef, std::shared_ptr<const void> const& pOwner) {
+				if (pOwner != nullptr)
+					vecOwned.push_back(std::make_pair(pDef, pOwner));
+
+				for (int id = 0; id < nMaxIds; id++)
+					if (pById[id] != nullptr && strcmp(pById[id]->sName, pDef->sName) == 0)
+						pById[id] = pDef;
+
+				for (auto& pKnown : vecKnown) {
+					if (strcmp(pKnown->sName, pDef->sName) == 0) {
+						pKnown = pDef;
+						return;
+					}
+				}
+				vecKnown.push_back(pDef);
+			}
+		};
+
+		instrument_registry() : m_pCurrent(new table()) {}
+
+		~instrument_registry() {
+			delete m_pCurrent.load();
+		}
+
+		// Everything below is for the control thread, safe while audio runs.
+
+		// makes an instrument findable by name, see table::add
+		void add(instrument_def const* pDef, std::shared_ptr<const void> pOwner = nullptr) {
+			update([&](table& t) { t.add(pDef, pOwner); });
+		}
+
+		// plays note id with pDef from now on (nullptr = silence)
+		bool assign(int id, instrument_def const* pDef, std::shared_ptr<const void> pOwner = nullptr) {
+			if (id < 0 || id >= nMaxIds)
+				return false;
+			update([&](table& t) {
+				if (pDef != nullptr)
+					t.add(pDef, pOwner);
+				t.pById[id] = pDef;
+			});
+			return true;
+		}
+
+		// Applies change to a copy of the current table and publishes the copy
+		template<class F>
+		void update(F change) {
+			std::unique_ptr<table> pNew(new table(*m_pCurrent.load()));
+			change(*pNew);
+
+			// a patch only stays alive while one of its defs can still be found
+			auto itKeep = std::remove_if(pNew->vecOwned.begin(), pNew->vecOwned.end(), [&](std::pair<instrument_def const*, std::shared_ptr<const void>> const& owned) {
+				bool bUsed = std::find(pNew->vecKnown.begin(), pNew->vecKnown.end(), owned.first) != pNew->vecKnown.end();
+				for (int id = 0; id < nMaxIds && !bUsed; id++)
+					bUsed = pNew->pById[id] == owned.first;
+				return !bUsed;
+			});
+			pNew->vecOwned.erase(itKeep, pNew->vecOwned.end());
+
+			table* pOld = m_pCurrent.exchange(pNew.release());
+			m_vecRetired.push_back(std::make_pair(m_nBlocks.load(), std::unique_ptr<table>(pOld)));
+			collect();
+		}
+
+		instrument_def const* find(int id) const {
+			return m_pCurrent.load()->find(id);
+		}
+
+		instrument_def const* find(const char* sName) const {
+			for (auto pDef : m_pCurrent.load()->vecKnown)
+				if (strcmp(pDef->sName, sName) == 0)
+					return pDef;
+			return nullptr;
+		}
+
+		// frees the tables the audio thread can no longer be looking at
+		void collect() {
+			uint64_t nBlocks = m_nBlocks.load();
+			auto it = m_vecRetired.begin();
+			while (it != m_vecRetired.end() && nBlocks > it->first)
+				++it;
+			m_vecRetired.erase(m_vecRetired.begin(), it);
+		}
+
+		// Audio thread: the table to use for this whole block, then end_block() once it's done
+		table const* begin_block() const { return m_pCurrent.load(); }
+		void end_block() { m_nBlocks++; }
+
+	private:
+		std::atomic<table*> m_pCurrent;
+		std::atomic<uint64_t> m_nBlocks{ 0 };
+		std::vector<std::pair<uint64_t, std::unique_ptr<table>>> m_vecRetired;
+
+	};
+
+	// every built in instrument, with the original keyboard layout on ids 0..4
+	inline void register_default_instruments(instrument_registry& registry) {
+		registry.update([](instrument_registry::table& t) {
+			t.pById[0] = &instruments::synth1;
+			t.pById[1] = &instruments::analog_pad;
+			t.pById[2] = &instruments::ethereal_pad;
+			t.pById[3] = &instruments::celestial_pad;
+			t.pById[4] = &instruments::epic_choir;
+
+			t.vecKnown = {
+				&instruments::harmonica, &instruments::synth1, &instruments::synth2, &instruments::synth3,
+				&instruments::ethereal_pad, &instruments::celestial_pad, &instruments::classic_piano,
+				&instruments::epic_choir, &instruments::analog_pad
+			};
+		});
+	}
+}
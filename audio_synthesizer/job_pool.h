@@ -0,0 +1,213 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX // std::min/max, and the simd traits have min/max members
+#endif
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace synth {
+	// Asks the OS to treat the calling thread like an audio thread. On Linux
+	// SCHED_FIFO needs rtprio rights; without them the thread just keeps its
+	// normal priority.
+	inline void set_realtime_priority() {
+#ifdef _WIN32
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+#else
+		sched_param param;
+		param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 1;
+		pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+#endif
+	}
+
+	// The opposite, for work that may fall behind but must never get in the
+	// audio thread's way (analysis, logging)
+	inline void set_background_priority() {
+#ifdef _WIN32
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(SCHED_IDLE)
+		sched_param param;
+		param.sched_priority = 0;
+		pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+	}
+
+	// Fixed set of worker threads that run a batch of jobs 0..nJobs-1 and come
+	// back when every one of them is done. Each thread (the caller is slot 0)
+	// starts with a contiguous share of the job indices and takes from the
+	// front of it; once that's empty it steals from the back of someone else's.
+	// A share is one atomic word holding [begin, end), so taking a job is a
+	// single compare-exchange and nothing locks while a batch runs.
+	//
+	// Which thread runs which job is not fixed, so jobs must only write their
+	// own output; callers combine the outputs afterwards in job order.
+	class job_pool {
+	public:
+		job_pool(unsigned int nThreads = 0) {
+			start(nThreads);
+		}
+
+		~job_pool() {
+			stop();
+		}
+
+		// nThreads counts the caller too; 0 means one per core. Not while run() is going
+		void start(unsigned int nThreads) {
+			stop();
+			if (nThreads == 0)
+				nThreads = std::max(1u, std::thread::hardware_concurrency());
+
+			m_nThreads = nThreads;
+
+			// a realtime thread spinning on a shared core starves whoever it is waiting for
+			m_nSpin = m_nThreads <= std::thread::hardware_concurrency() ? 2000 : 0;
+
+			m_pSlots.reset(new slot[m_nThreads]);
+			m_bQuit = false;
+			for (unsigned int t = 1; t < m_nThreads; t++)
+				m_vecWorkers.emplace_back(&job_pool::worker, this, t);
+		}
+
+		void stop() {
+			{
+				std::lock_guard<std::mutex> lm(m_mux);
+				m_bQuit = true;
+				m_cv.notify_all();
+			}
+			for (auto& t : m_vecWorkers)
+				t.join();
+			m_vecWorkers.clear();
+		}
+
+		unsigned int threads() const { return m_nThreads; }
+
+		// Runs job(j) for every j in 0..nJobs-1 across the pool and waits for all of them
+		template<class F>
+		void run(size_t nJobs, F& job) {
+			if (nJobs == 0)
+				return;
+
+			if (nJobs == 1 || m_nThreads == 1) {
+				for (size_t j = 0; j < nJobs; j++)
+					job(j);
+				return;
+			}
+
+			m_pfnJob = [](void* pContext, size_t j) { (*(F*)pContext)(j); };
+			m_pContext = &job;
+			m_nRemaining.store(nJobs, std::memory_order_relaxed);
+
+			// the shares are published last, a worker that can see one can see the job too
+			size_t nBegin = 0;
+			for (unsigned int t = 0; t < m_nThreads; t++) {
+				size_t nEnd = nJobs * (t + 1) / m_nThreads;
+				m_pSlots[t].range.store(pack(nBegin, nEnd), std::memory_order_release);
+				nBegin = nEnd;
+			}
+
+			{
+				std::lock_guard<std::mutex> lm(m_mux);
+				m_nGeneration++;
+				m_cv.notify_all();
+			}
+
+			work(0);
+
+			// whatever is left is already running on another thread
+			while (m_nRemaining.load(std::memory_order_acquire) != 0)
+				std::this_thread::yield();
+		}
+
+	private:
+		struct slot {
+			alignas(64) std::atomic<uint64_t> range{ 0 };
+		};
+
+		unsigned int m_nThreads = 1;
+		int m_nSpin = 0;
+		std::unique_ptr<slot[]> m_pSlots;
+		std::vector<std::thread> m_vecWorkers;
+
+		void(*m_pfnJob)(void*, size_t) = nullptr;
+		void* m_pContext = nullptr;
+		alignas(64) std::atomic<size_t> m_nRemaining{ 0 };
+
+		std::mutex m_mux;
+		std::condition_variable m_cv;
+		std::atomic<uint64_t> m_nGeneration{ 0 };
+		bool m_bQuit = false;
+
+		static uint64_t pack(size_t nBegin, size_t nEnd) { return (uint64_t)nBegin | ((uint64_t)nEnd << 32); }
+		static size_t begin_of(uint64_t n) { return (size_t)(n & 0xffffffffu); }
+		static size_t end_of(uint64_t n) { return (size_t)(n >> 32); }
+
+		// owner takes from the front of its own share
+		bool pop(unsigned int t, size_t& j) {
+			std::atomic<uint64_t>& range = m_pSlots[t].range;
+			uint64_t n = range.load(std::memory_order_acquire);
+			while (begin_of(n) < end_of(n)) {
+				if (range.compare_exchange_weak(n, pack(begin_of(n) + 1, end_of(n)), std::memory_order_acq_rel, std::memory_order_acquire)) {
+					j = begin_of(n);
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// thieves take from the back of everyone else's, starting with the next thread along
+		bool steal(unsigned int t, size_t& j) {
+			for (unsigned int o = 1; o < m_nThreads; o++) {
+				std::atomic<uint64_t>& range = m_pSlots[(t + o) % m_nThreads].range;
+				uint64_t n = range.load(std::memory_order_acquire);
+				while (begin_of(n) < end_of(n)) {
+					if (range.compare_exchange_weak(n, pack(begin_of(n), end_of(n) - 1), std::memory_order_acq_rel, std::memory_order_acquire)) {
+						j = end_of(n) - 1;
+						return true;
+					}
+				}
+			}
+			return false;
+		}
+
+		void work(unsigned int t) {
+			size_t j;
+			while (pop(t, j) || steal(t, j)) {
+				m_pfnJob(m_pContext, j);
+				m_nRemaining.fetch_sub(1, std::memory_order_acq_rel);
+			}
+		}
+
+		void worker(unsigned int t) {
+			set_realtime_priority();
+
+			uint64_t nSeen = 0;
+			while (true) {
+				// a batch usually follows the last one within a block period, so spin a little before sleeping
+				for (int i = 0; i < m_nSpin && m_nGeneration.load(std::memory_order_acquire) == nSeen; i++)
+					std::this_thread::yield();
+
+				{
+					std::unique_lock<std::mutex> lm(m_mux);
+					m_cv.wait(lm, [&] { return m_bQuit || m_nGeneration.load() != nSeen; });
+					if (m_bQuit)
+						return;
+					nSeen = m_nGeneration.load();
+				}
+
+				work(t);
+			}
+		}
+	};
+}
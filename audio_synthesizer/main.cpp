@@ -1,149 +1,633 @@
-#include "synth.h"
+#include "engine.h"
+#include "offline.h"
+#include "patch.h"
+#include "analyzer.h"
+#include "reverb.h"
+#include "input.h"
+#include "midi.h"
 
-#include <api/fftw3.h>
 
+const double dSampleRate = 44100.0;
 
-std::vector<synth::note> vecNotes;
-std::mutex muxNotes;
+// how far ahead of the engine a script or MIDI file is played live, so every event lands on its frame
+const double dSequenceLookAhead = 0.1;
 
-synth::instrument_harmonica instHarm;
-synth::instrument_synth1 instSynth1;
-synth::instrument_synth2 instSynth2;
-synth::instrument_synth3 instSynth3;
+synth::engine engine(dSampleRate);
 
-synth::instrument_ethereal_pad instEtherealPad;
-synth::instrument_celestial_pad instCelestialPad;
-synth::instrument_classic_piano instClassicPiano;
-synth::instrument_epic_choir instEpicChoir;
+#ifdef SYNTH_WITH_FFTW
+synth::spectrum_analyzer analyzer(dSampleRate);
+synth::convolution_reverb* pReverb = nullptr; // owned by the engine's send bus, kept for its stats
+#endif
 
-synth::instrument_analog_pad instAnalogPad;
-
-// thx olc :)
-typedef bool(*lambda)(synth::note const& item);
-template<class T>
-void safe_remove(T& v, lambda f)
+// Called once the device is set up, before the first MakeNoise
+void PrepareNoise(unsigned int /*nSampleRate*/, size_t nFrames, size_t nChannels)
 {
-	auto n = v.begin();
-	while (n != v.end())
-		if (!f(*n))
-			n = v.erase(n);
-		else
-			++n;
+	engine.prepare(nFrames, nChannels);
 }
 
-// Filter coefficients (customize for your desired cutoff frequency)
-/*const std::vector<double> filterCoeff = {
-	-0.1, -0.2, 0.8, -0.2, -0.1, // First high-pass filter
-	0.2, 0.4, -1.6, 0.4, 0.2    // Second high-pass filter
-};*/
-
 // Function used by olcNoiseMaker to generate sound waves
-// Returns amplitude (-1.0 to +1.0) as a function of time
-	double cutoffFreq = 100.0;  // Adjust this cutoff frequency as needed
-double MakeNoise(int nChannel, double dTime)
+void MakeNoise(float* pOut, size_t nFrames, size_t nChannels, uint64_t nStartFrame)
 {
-	std::unique_lock<mutex> lm(muxNotes);
-	double dMixedOutput = 0.0;
+	engine.process(pOut, nFrames, nChannels, nStartFrame);
+#ifdef SYNTH_WITH_FFTW
+	analyzer.push(pOut, nFrames, nChannels);
+#endif
+}
 
-	// Filter parameters
-	double RC = 1.0 / (2.0 * PI * cutoffFreq);
-	double dt = 1.0 / 44100.0;  // Sample rate
-	double alpha = RC / (RC + dt);
+// --steal option -> policy, false if it's not one we know
+bool ParseStealPolicy(string const& s, synth::steal_policy& ePolicy)
+{
+	if (s == "oldest")
+		ePolicy = synth::steal_policy::oldest;
+	else if (s == "quietest")
+		ePolicy = synth::steal_policy::quietest;
+	else if (s == "released")
+		ePolicy = synth::steal_policy::released_first;
+	else
+		return false;
+	return true;
+}
 
-	static double prevSample = 0.0;
+// 16, 24 and 32 bit integer or 32f for float
+bool ParseSampleFormat(string const& s, synth::sample_format& eFormat)
+{
+	if (s == "16")
+		eFormat = synth::sample_format::pcm16;
+	else if (s == "24")
+		eFormat = synth::sample_format::pcm24;
+	else if (s == "32")
+		eFormat = synth::sample_format::pcm32;
+	else if (s == "32f")
+		eFormat = synth::sample_format::float32;
+	else
+		return false;
+	return true;
+}
 
-	for (auto& n : vecNotes) {
-		bool bNoteFinished = false;
-		double dSound = 0;
-		if (n.id == 0)
-			dSound = instSynth1.sound(dTime, n, bNoteFinished);
-		if (n.id == 1)
-			dSound = instAnalogPad.sound(dTime, n, bNoteFinished);
-		if (n.id == 2)
-			dSound = instEtherealPad.sound(dTime, n, bNoteFinished);
-		if (n.id == 3)
-			dSound = instCelestialPad.sound(dTime, n, bNoteFinished);
-		if (n.id == 4)
-			dSound = instEpicChoir.sound(dTime, n, bNoteFinished);
+// --telemetry file: one snapshot per line, JSON Lines if the name ends in .json, CSV otherwise
+bool OpenTelemetryLog(string const& sPath, ofstream& file, bool& bJson)
+{
+	file.open(sPath);
+	if (!file.is_open()) {
+		cerr << "can't write " << sPath << endl;
+		return false;
+	}
+	bJson = sPath.size() >= 5 && sPath.compare(sPath.size() - 5, 5, ".json") == 0;
+	if (!bJson)
+		synth::telemetry_snapshot::write_csv_header(file);
+	return true;
+}
 
+void WriteTelemetry(ofstream& file, bool bJson, synth::telemetry_snapshot const& s)
+{
+	if (bJson)
+		s.write_json(file);
+	else
+		s.write_csv(file);
+	file.flush(); // live, the loop only ends when the program is killed
+}
 
-		// Apply the high-pass filter
-		dSound -= alpha * (dSound - prevSample);
-		prevSample = dSound;
+// the effect options live and offline share
+struct effect_options {
+	string sReverb;
+	double dReverbMix = 0.3;
+	string sDelay; // seconds, or a note length like 1/8d synced to dTempo
+	double dTempo = 120.0;
+	double dDelayFeedback = 0.4;
+	double dDelayMix = 0.35;
+	double dMasterGain = 0.5;
+	bool bDynamics = true;
+	double dThreshold = -18.0; // compressor, dBFS
+	double dRatio = 3.0;
+	double dCeiling = -1.0;    // limiter, dBFS
+};
+
+// [--reverb ir.wav] [--reverb-mix 0..1] [--delay seconds|1/8d] [--tempo bpm] [--delay-feedback 0..1] [--delay-mix 0..1]
+// [--gain linear] [--dynamics on|off] [--threshold dB] [--ratio n] [--ceiling dB]
+// false if sOpt isn't one of them; a value that isn't a number throws like stod()
+bool ParseEffectOption(string const& sOpt, string const& sVal, effect_options& fx)
+{
+	if (sOpt == "--reverb")
+		fx.sReverb = sVal;
+	else if (sOpt == "--reverb-mix")
+		fx.dReverbMix = stod(sVal);
+	else if (sOpt == "--delay") {
+		double dBeats;
+		if (!synth::parse_note_length(sVal, dBeats))
+			stod(sVal); // throws here, with the other options, rather than in SetupEffects
+		fx.sDelay = sVal;
+	}
+	else if (sOpt == "--tempo")
+		fx.dTempo = stod(sVal);
+	else if (sOpt == "--delay-feedback")
+		fx.dDelayFeedback = stod(sVal);
+	else if (sOpt == "--delay-mix")
+		fx.dDelayMix = stod(sVal);
+	else if (sOpt == "--gain")
+		fx.dMasterGain = stod(sVal);
+	else if (sOpt == "--dynamics")
+		fx.bDynamics = sVal != "off";
+	else if (sOpt == "--threshold")
+		fx.dThreshold = stod(sVal);
+	else if (sOpt == "--ratio")
+		fx.dRatio = stod(sVal);
+	else if (sOpt == "--ceiling")
+		fx.dCeiling = stod(sVal);
+	else
+		return false;
+	return true;
+}
 
+// The delay goes on as an insert, the reverb on send bus 0, the compressor
+// and limiter on the master
+bool SetupEffects(synth::engine& eng, effect_options const& fx, bool bRealtime)
+{
+	eng.set_master_gain(fx.dMasterGain);
+	eng.set_dynamics(fx.bDynamics);
+	eng.master_compressor().set_threshold(fx.dThreshold);
+	eng.master_compressor().set_ratio(fx.dRatio);
+	eng.master_limiter().set_ceiling(fx.dCeiling);
+
+	if (!fx.sDelay.empty()) {
+		unique_ptr<synth::delay_effect> pDelay(new synth::delay_effect());
+		double dBeats;
+		if (synth::parse_note_length(fx.sDelay, dBeats))
+			pDelay->set_sync(dBeats, fx.dTempo);
+		else
+			pDelay->set_time(stod(fx.sDelay));
+		pDelay->set_feedback(fx.dDelayFeedback);
+		pDelay->set_mix(fx.dDelayMix);
+		eng.inserts().add(std::move(pDelay));
+	}
 
-		dMixedOutput += dSound;
+	if (!fx.sReverb.empty()) {
+#ifdef SYNTH_WITH_FFTW
+		string sError;
+		unique_ptr<synth::convolution_reverb> pLoaded = synth::convolution_reverb::load(fx.sReverb, eng.sample_rate(), sError, 256, bRealtime);
+		if (pLoaded == nullptr) {
+			cerr << sError << endl;
+			return false;
+		}
+		pReverb = pLoaded.get();
+		eng.send(eng.add_send(fx.dReverbMix)).add(std::move(pLoaded));
+#else
+		(void)bRealtime;
+		cerr << "built without FFTW, --reverb isn't available" << endl;
+		return false;
+#endif
+	}
+	return true;
+}
 
-		if (bNoteFinished && n.released > n.pressed)
-			n.active = false;
+// Loads the events of an event script or, if that's what it is, a MIDI file
+bool LoadSequence(string const& sPath, double dRate, synth::midi_channel_map const& map, vector<synth::note_event>& vecEvents, string& sError)
+{
+	if (synth::midi_file::is_midi(sPath)) {
+		synth::midi_file file;
+		if (!file.load(sPath, sError))
+			return false;
+		vecEvents = file.sequence(dRate, map);
+		return true;
 	}
 
-	// wow ! modern c++ overload!! !!
-	safe_remove<std::vector<synth::note>>(vecNotes, [](synth::note const& item) {return item.active; });
+	synth::event_script script;
+	if (!script.load(sPath, dRate, sError))
+		return false;
+	vecEvents = script.events();
+	return true;
+}
 
-	return dMixedOutput * 0.2;
+void PrintRenderUsage(const char* sName)
+{
+	cerr << "usage: " << sName << " --render <script|song.mid> <out.wav> [--format 16|24|32|32f] [--dither on|off] [--rate hz] [--channels n] [--block frames] [--threads n] [--polyphony n] [--steal oldest|quietest|released] [--patches file] [--telemetry file.csv|json] [--midi-channels ids] [--reverb ir.wav] [--reverb-mix 0..1] [--delay seconds|1/8d] [--tempo bpm] [--delay-feedback 0..1] [--delay-mix 0..1] [--gain linear] [--dynamics on|off] [--threshold dB] [--ratio n] [--ceiling dB]" << endl;
 }
 
+void PrintLiveUsage(const char* sName)
+{
+	cerr << "usage: " << sName << " [--backend winmm|alsa|null] [--device name] [--format 16|24|32|32f] [--channels n] [--blocks n] [--block-samples n] [--threads n] [--polyphony n] [--steal oldest|quietest|released] [--patches file] [--spectrum-log file.csv] [--telemetry file.csv|json] [--dither on|off] [--keys on|off] [--midi-pipe name] [--input-script file|song.mid] [--midi-channels ids] [--status-rate hz] [--reverb ir.wav] [--reverb-mix 0..1] [--delay seconds|1/8d] [--tempo bpm] [--delay-feedback 0..1] [--delay-mix 0..1] [--gain linear] [--dynamics on|off] [--threshold dB] [--ratio n] [--ceiling dB]" << endl;
+}
 
-int main() {
-	// Get all sound hardware
-	vector<wstring> devices = olcNoiseMaker<short>::Enumerate();
+// audio_synthesizer --render <script|song.mid> <out.wav> [--format 16|24|32|32f] [--dither on|off] [--rate hz] [--channels n] [--block frames] [--threads n] [--polyphony n] [--steal oldest|quietest|released] [--patches file] [--telemetry file.csv|json] [--midi-channels ids] [effect options]
+// Renders an event script or a MIDI file straight to disk as fast as the CPU goes, no sound card needed
+int RenderOffline(int argc, char** argv)
+{
+	if (argc < 4) {
+		PrintRenderUsage(argv[0]);
+		return 1;
+	}
 
-	// Display findings
-	for (auto d : devices) wcout << "Found Output Device: " << d << endl;
-	wcout << "Using Device: " << devices[0] << endl;
+	string sScript = argv[2], sOut = argv[3];
+	synth::sample_format eFormat = synth::sample_format::pcm16;
+	bool bDither = false;
+	unsigned int nRate = (unsigned int)dSampleRate, nChannels = 1, nBlock = 512, nThreads = 0, nPolyphony = 64;
+	synth::steal_policy ePolicy = synth::steal_policy::oldest;
+	string sPatches, sTelemetry, sError;
+	synth::midi_channel_map mapChannels;
+	effect_options fx;
+	for (int i = 4; i + 1 < argc; i += 2) {
+		string sOpt = argv[i], sVal = argv[i + 1];
+		try {
+			if (sOpt == "--format") {
+				if (!ParseSampleFormat(sVal, eFormat)) {
+					cerr << "--format wants 16, 24, 32 or 32f, not " << sVal << endl;
+					return 1;
+				}
+			}
+			else if (sOpt == "--dither")
+				bDither = sVal != "off";
+			else if (sOpt == "--rate") {
+				nRate = (unsigned int)stoul(sVal);
+				if (nRate < 8000 || nRate > 192000) {
+					cerr << "--rate wants 8000 to 192000 Hz, not " << sVal << endl;
+					return 1;
+				}
+			}
+			else if (sOpt == "--channels")
+				nChannels = max(1u, (unsigned int)stoul(sVal));
+			else if (sOpt == "--block") {
+				nBlock = (unsigned int)stoul(sVal);
+				if (nBlock == 0) {
+					cerr << "--block wants at least 1 frame" << endl;
+					return 1;
+				}
+			}
+			else if (sOpt == "--threads")
+				nThreads = (unsigned int)stoul(sVal);
+			else if (sOpt == "--polyphony")
+				nPolyphony = (unsigned int)stoul(sVal);
+			else if (sOpt == "--steal") {
+				if (!ParseStealPolicy(sVal, ePolicy)) {
+					cerr << "--steal wants oldest, quietest or released, not " << sVal << endl;
+					return 1;
+				}
+			}
+			else if (sOpt == "--patches")
+				sPatches = sVal;
+			else if (sOpt == "--telemetry")
+				sTelemetry = sVal;
+			else if (sOpt == "--midi-channels") {
+				if (!mapChannels.parse(sVal, sError)) {
+					cerr << sError << endl;
+					return 1;
+				}
+			}
+			else if (ParseEffectOption(sOpt, sVal, fx))
+				;
+			else {
+				cerr << "unknown option " << sOpt << endl;
+				return 1;
+			}
+		}
+		catch (logic_error const&) { // stoul/stod: invalid_argument or out_of_range
+			cerr << sOpt << " wants a number, not " << sVal << endl;
+			PrintRenderUsage(argv[0]);
+			return 1;
+		}
+	}
 
+	vector<synth::note_event> vecEvents;
+	if (!LoadSequence(sScript, nRate, mapChannels, vecEvents, sError)) {
+		cerr << sError << endl;
+		return 1;
+	}
+
+	synth::wav_writer wav;
+	if (!wav.open(sOut, nRate, nChannels, eFormat, bDither)) {
+		cerr << "can't write " << sOut << endl;
+		return 1;
+	}
+
+	synth::wavetables::get();
+	unique_ptr<synth::engine> offline(new synth::engine(nRate, nThreads));
+	offline->set_polyphony(nPolyphony);
+	offline->set_steal_policy(ePolicy);
+	if (!sPatches.empty()) {
+		shared_ptr<synth::patch_set> pPatches(new synth::patch_set());
+		if (!pPatches->load(sPatches, sError)) {
+			cerr << sError << endl;
+			return 1;
+		}
+		synth::patch_set::install(pPatches, offline->instruments());
+	}
+	if (!SetupEffects(*offline, fx, false))
+		return 1;
+	synth::render_stats stats = synth::render_offline(*offline, vecEvents, wav, nChannels, nBlock);
+	wav.close();
+
+	cout << "rendered " << stats.dAudioSeconds << " s of audio in " << stats.dWallSeconds << " s ("
+		<< stats.realtime() << "x realtime) to " << sOut << endl;
+	if (offline->stolen_voices() > 0)
+		cout << offline->stolen_voices() << " voices stolen at polyphony " << nPolyphony << endl;
+
+	synth::telemetry_snapshot telemetry = offline->telemetry().snapshot();
+	cout << "block render p50 " << telemetry.dRenderP50 << " us, p99 " << telemetry.dRenderP99 << " us, max " << telemetry.dRenderMax
+		<< " us; load p99 " << telemetry.dLoadP99 * 100.0 << "%; up to " << telemetry.dVoicesMax << " voices" << endl;
+	if (!sTelemetry.empty()) {
+		ofstream fileTelemetry;
+		bool bJson;
+		if (!OpenTelemetryLog(sTelemetry, fileTelemetry, bJson))
+			return 1;
+		WriteTelemetry(fileTelemetry, bJson, telemetry);
+	}
+	return 0;
+}
+
+
+// everything the live device and its control loop are set up with, bar the effects
+struct live_options {
+	wstring sDevice;
+	synth::sample_format eFormat = synth::sample_format::pcm16;
+	bool bDither = false;
+	unsigned int nChannels = 1, nBlocks = 8, nBlockSamples = 512;
+	unique_ptr<synth::patch_watcher> pPatches;
+	string sSpectrumLog, sTelemetry;
+	bool bKeys = true;
+	string sMidiPipe, sInputScript;
+	synth::midi_channel_map mapChannels;
+	double dStatusRate = 10.0;
+};
+
+// Opens the device with samples of type T, one of the sample_format types,
+// and runs the control loop until it's time to quit
+template<class T>
+int PlayLive(live_options& opt, unique_ptr<synth::audio_backend> pBackend)
+{
 	// Create sound machine!!
-	olcNoiseMaker<short> sound(devices[0], 44100, 1, 8, 512);
+	// --block-samples counts per channel, the device wants them all together
+	olcNoiseMaker<T> sound(opt.sDevice, (unsigned int)dSampleRate, opt.nChannels, opt.nBlocks, opt.nBlockSamples * opt.nChannels, std::move(pBackend));
+	if (!sound.IsReady()) {
+		cerr << "can't open the output device" << endl;
+		return 1;
+	}
 
 	// Link noise function with sound machine
-	sound.SetUserFunction(MakeNoise);
-
-	while (true) {
-		if (GetAsyncKeyState(VK_UP) & 1) cutoffFreq += 10;
-		if (GetAsyncKeyState(VK_DOWN) & 1) cutoffFreq -= 10;
-
-		for (int i = 0; i < 5; i++) {
-			short nKeyState = GetAsyncKeyState((unsigned char)("ASDFE"[i]));
-			double dTimeNow = sound.GetTime();
-
-			muxNotes.lock();
-			auto noteFound = find_if(vecNotes.begin(), vecNotes.end(), [&i](synth::note const& item) { return item.id == i; });
-			if (noteFound == vecNotes.end()) { // note not found in vector
-				if (nKeyState & 0x8000) {
-					// create note
-					synth::note n;
-					n.id = i;
-					n.pressed = dTimeNow;
-					n.channel = 1;
-					n.active = true;
-
-					// add note to vector
-					vecNotes.emplace_back(n);
+	sound.SetDither(opt.bDither);
+	sound.SetTelemetry(&engine.telemetry());
+	sound.SetBlockFunction(MakeNoise, PrepareNoise);
+
+#ifdef SYNTH_WITH_FFTW
+	// a csv row whenever there is a new analysis frame: levels, then the loudest bin of each octave band
+	const double dOctaves[] = { 31.25, 62.5, 125, 250, 500, 1000, 2000, 4000, 8000, 16000 };
+	ofstream fileSpectrum;
+	if (!opt.sSpectrumLog.empty()) {
+		fileSpectrum.open(opt.sSpectrumLog);
+		if (!fileSpectrum.is_open()) {
+			cerr << "can't write " << opt.sSpectrumLog << endl;
+			return 1;
+		}
+		fileSpectrum << "time,rms_db,peak_db,peak_hz";
+		for (double dCentre : dOctaves)
+			fileSpectrum << ",band_" << dCentre;
+		fileSpectrum << endl;
+	}
+	analyzer.start();
+	uint64_t nSpectrumFrame = 0;
+#else
+	if (!opt.sSpectrumLog.empty()) {
+		cerr << "built without FFTW, --spectrum-log isn't available" << endl;
+		return 1;
+	}
+#endif
+
+	// a telemetry snapshot a second, everything since the start
+	ofstream fileTelemetry;
+	bool bTelemetryJson = false;
+	if (!opt.sTelemetry.empty() && !OpenTelemetryLog(opt.sTelemetry, fileTelemetry, bTelemetryJson))
+		return 1;
+	auto tTelemetry = chrono::steady_clock::now() + chrono::seconds(1);
+
+	// Control input, each source blocking on its own thread: the keyboard unless
+	// told otherwise, a MIDI pipe and a script or MIDI file when asked for
+	synth::input_hub input([&sound]() { return sound.GetEventFrame(); });
+	if (opt.bKeys)
+		input.add(unique_ptr<synth::input_source>(new synth::keyboard_source()));
+	if (!opt.sMidiPipe.empty()) {
+		unique_ptr<synth::midi_pipe_source> pPipe(new synth::midi_pipe_source(opt.sMidiPipe, opt.mapChannels));
+		string sError;
+		if (!pPipe->open(sError)) {
+			cerr << sError << endl;
+			return 1;
+		}
+		input.add(std::move(pPipe));
+	}
+	if (!opt.sInputScript.empty()) {
+		vector<synth::note_event> vecEvents;
+		string sError;
+		if (!LoadSequence(opt.sInputScript, dSampleRate, opt.mapChannels, vecEvents, sError)) {
+			cerr << sError << endl;
+			return 1;
+		}
+		input.add(unique_ptr<synth::input_source>(new synth::script_source(vecEvents, dSampleRate, (uint64_t)(dSequenceLookAhead * dSampleRate))));
+	}
+	input.start();
+
+	// The control thread sleeps on the input; the only other wake-ups are the
+	// status line, at most dStatusRate times a second, the telemetry log and
+	// the patch check. It keeps its own copy of everything it sends
+	double dCutoff = 100.0;
+	deque<synth::note_event> queuePending; // what the engine's ring had no room for yet
+	auto tPatchCheck = chrono::steady_clock::now();
+	auto tStatus = tPatchCheck;
+	auto tStatusInterval = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0 / opt.dStatusRate));
+	bool bQuit = false;
+
+	while (!bQuit) {
+		auto tNext = tStatus;
+		if (opt.pPatches)
+			tNext = min(tNext, tPatchCheck);
+		if (fileTelemetry.is_open())
+			tNext = min(tNext, tTelemetry);
+		if (!queuePending.empty())
+			tNext = min(tNext, chrono::steady_clock::now() + chrono::milliseconds(5));
+
+		synth::input_event in;
+		while (!bQuit && chrono::steady_clock::now() < tNext && input.wait(in, tNext)) {
+			if (in.eKind == synth::input_kind::quit)
+				bQuit = true;
+			else if (in.eKind == synth::input_kind::cutoff_step) {
+				dCutoff += in.dStep;
+				synth::note_event e;
+				e.type = synth::event_type::parameter;
+				e.id = synth::param_cutoff;
+				e.nFrame = in.e.nFrame;
+				e.value = dCutoff;
+				queuePending.push_back(e);
+			}
+			else {
+				if (in.e.type == synth::event_type::parameter && in.e.id == synth::param_cutoff)
+					dCutoff = in.e.value;
+				queuePending.push_back(in.e);
+			}
+
+			// in order; if the ring is full the rest wait for the next wake-up
+			while (!queuePending.empty() && engine.post(queuePending.front()))
+				queuePending.pop_front();
+		}
+		while (!queuePending.empty() && engine.post(queuePending.front()))
+			queuePending.pop_front();
+
+		if (input.finished() && queuePending.empty() && engine.idle())
+			bQuit = true;
+
+		// edits to the patch file are picked up while playing
+		if (opt.pPatches && chrono::steady_clock::now() >= tPatchCheck) {
+			tPatchCheck = chrono::steady_clock::now() + chrono::milliseconds(500);
+			string sError;
+			if (opt.pPatches->poll(engine.instruments(), sError))
+				wcout << endl << "patches loaded" << endl;
+			else if (!sError.empty())
+				cerr << endl << sError << endl;
+		}
+
+		if (fileTelemetry.is_open() && chrono::steady_clock::now() >= tTelemetry) {
+			tTelemetry += chrono::seconds(1);
+			WriteTelemetry(fileTelemetry, bTelemetryJson, engine.telemetry().snapshot());
+		}
+
+		if (chrono::steady_clock::now() < tStatus)
+			continue;
+		tStatus = chrono::steady_clock::now() + tStatusInterval;
+
+		synth::latency_stats stats = sound.GetLatencyStats();
+		synth::telemetry_snapshot telemetry = engine.telemetry().snapshot();
+		wcout << "\rNotes: " << engine.active_notes() << "          cut off frequency: " << dCutoff
+			<< "    latency: " << stats.dLatencyMean * 1000.0 << " ms (max " << stats.dLatencyMax * 1000.0 << ")"
+			<< "  jitter: " << stats.dJitterMean * 1000.0 << " ms  underruns: " << stats.nUnderruns
+			<< "  load p99: " << (int)(telemetry.dLoadP99 * 100.0) << "%  late: " << telemetry.nLate
+			<< "  gain reduction: " << (int)(engine.master_compressor().reduction() + engine.master_limiter().reduction()) << " dB";
+
+#ifdef SYNTH_WITH_FFTW
+		synth::spectrum const& spectrum = analyzer.latest();
+		wcout << "  level: " << (int)spectrum.fRMS << " dB (peak " << (int)spectrum.fPeak << ") @ " << (int)spectrum.dPeakFrequency << " Hz";
+		if (pReverb != nullptr && pReverb->late_partitions() > 0)
+			wcout << "  reverb late: " << pReverb->late_partitions();
+		if (fileSpectrum.is_open() && spectrum.nFrame != nSpectrumFrame) {
+			nSpectrumFrame = spectrum.nFrame;
+			fileSpectrum << sound.GetTime() << "," << spectrum.fRMS << "," << spectrum.fPeak << "," << spectrum.dPeakFrequency;
+			for (double dCentre : dOctaves)
+				fileSpectrum << "," << spectrum.band(dCentre / sqrt(2.0), dCentre * sqrt(2.0));
+			fileSpectrum << endl; // flushed as it goes, the program may well be killed
+		}
+#endif
+		wcout << "    ";
+	}
+
+	wcout << endl;
+	return 0;
+}
+
+
+int main(int argc, char** argv) {
+	if (argc > 1 && string(argv[1]) == "--render")
+		return RenderOffline(argc, argv);
+
+	// live options: [--backend winmm|alsa|null] [--device name] [--format 16|24|32|32f] [--channels n] [--blocks n] [--block-samples n] [--threads n] [--polyphony n] [--steal oldest|quietest|released] [--patches file] [--spectrum-log file.csv] [--telemetry file.csv|json] [--dither on|off] [--keys on|off] [--midi-pipe name] [--input-script file|song.mid] [--midi-channels ids] [--status-rate hz] [effect options]
+	// fewer/smaller blocks means less latency, but less slack before the device runs dry.
+	// Runs until Q, or until every input has run out (end of stdin, the end of
+	// the script) and nothing is sounding any more
+	string sBackend;
+	synth::steal_policy ePolicy;
+	effect_options fx;
+	live_options opt;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		string sOpt = argv[i], sVal = argv[i + 1];
+		try {
+			if (sOpt == "--backend")
+				sBackend = sVal;
+			else if (sOpt == "--device")
+				opt.sDevice = wstring(sVal.begin(), sVal.end());
+			else if (sOpt == "--format") {
+				if (!ParseSampleFormat(sVal, opt.eFormat)) {
+					cerr << "--format wants 16, 24, 32 or 32f, not " << sVal << endl;
+					return 1;
 				}
 			}
-			else { // note is in vector
-				if (nKeyState & 0x8000) { // key is being held
-					if (noteFound->released > noteFound->pressed) { // key has been pressed again during release phase
-						noteFound->pressed = dTimeNow;
-						noteFound->active = true;
-					}
+			else if (sOpt == "--channels")
+				opt.nChannels = max(1u, (unsigned int)stoul(sVal));
+			else if (sOpt == "--blocks")
+				opt.nBlocks = (unsigned int)stoul(sVal);
+			else if (sOpt == "--block-samples")
+				opt.nBlockSamples = (unsigned int)stoul(sVal);
+			else if (sOpt == "--threads")
+				engine.set_threads((unsigned int)stoul(sVal));
+			else if (sOpt == "--polyphony")
+				engine.set_polyphony((size_t)stoul(sVal));
+			else if (sOpt == "--steal") {
+				if (!ParseStealPolicy(sVal, ePolicy)) {
+					cerr << "--steal wants oldest, quietest or released, not " << sVal << endl;
+					return 1;
 				}
-				else { // key has been released, so switch off
-					if (noteFound->released < noteFound->pressed)
-						noteFound->released = dTimeNow;
+				engine.set_steal_policy(ePolicy);
+			}
+			else if (sOpt == "--patches")
+				opt.pPatches.reset(new synth::patch_watcher(sVal));
+			else if (sOpt == "--spectrum-log")
+				opt.sSpectrumLog = sVal;
+			else if (sOpt == "--telemetry")
+				opt.sTelemetry = sVal;
+			else if (sOpt == "--dither")
+				opt.bDither = sVal != "off";
+			else if (sOpt == "--keys")
+				opt.bKeys = sVal != "off";
+			else if (sOpt == "--midi-pipe")
+				opt.sMidiPipe = sVal;
+			else if (sOpt == "--input-script")
+				opt.sInputScript = sVal;
+			else if (sOpt == "--midi-channels") {
+				string sError;
+				if (!opt.mapChannels.parse(sVal, sError)) {
+					cerr << sError << endl;
+					return 1;
 				}
 			}
-			muxNotes.unlock();
+			else if (sOpt == "--status-rate")
+				opt.dStatusRate = max(0.1, stod(sVal));
+			else if (ParseEffectOption(sOpt, sVal, fx))
+				;
+			else {
+				cerr << "unknown option " << sOpt << endl;
+				return 1;
+			}
+		}
+		catch (logic_error const&) { // stoul/stod: invalid_argument or out_of_range
+			cerr << sOpt << " wants a number, not " << sVal << endl;
+			PrintLiveUsage(argv[0]);
+			return 1;
 		}
-
-		wcout << "\rNotes: " << vecNotes.size() << "          cut off frequency: " << cutoffFreq << "    ";
 	}
 
+	unique_ptr<synth::audio_backend> pBackend = sBackend.empty() ? synth::make_default_backend() : synth::make_backend(sBackend);
+	if (pBackend == nullptr) {
+		cerr << "backend " << sBackend << " isn't built in" << endl;
+		return 1;
+	}
 
+	// Get all sound hardware
+	vector<wstring> devices = pBackend->devices();
 
-	std::cin.get();
-	return 0;
+	// Display findings
+	for (auto d : devices) wcout << "Found Output Device: " << d << endl;
+	if (opt.sDevice.empty()) {
+		if (devices.empty()) {
+			cerr << "no output devices" << endl;
+			return 1;
+		}
+		opt.sDevice = devices[0];
+	}
+	wcout << "Using Device: " << opt.sDevice << endl;
+
+	// Build the band-limited oscillator tables before the audio thread needs them
+	synth::wavetables::get();
+	if (!SetupEffects(engine, fx, true))
+		return 1;
+
+	// the device gets samples in the format asked for, converted once per block
+	switch (opt.eFormat) {
+	case synth::sample_format::pcm24: return PlayLive<synth::int24_packed>(opt, std::move(pBackend));
+	case synth::sample_format::pcm32: return PlayLive<int32_t>(opt, std::move(pBackend));
+	case synth::sample_format::float32: return PlayLive<float>(opt, std::move(pBackend));
+	default: return PlayLive<int16_t>(opt, std::move(pBackend));
+	}
 }
 
 
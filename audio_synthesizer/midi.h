@@ -0,0 +1,394 @@
+#pragma once
+#include "events.h"
+#include "instrument_registry.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace synth {
+	// Byte at a time MIDI to whole channel messages, running status included.
+	// Real time bytes are dropped wherever they turn up, system messages and
+	// sysex up to the next status byte
+	class midi_parser {
+	public:
+		// true when b completes a message, which is then in status(), data1(), data2()
+		bool feed(uint8_t b) {
+			if (b >= 0xf8)
+				return false;
+			if (b >= 0xf0) {
+				m_nStatus = 0;
+				return false;
+			}
+			if (b & 0x80) {
+				m_nStatus = b;
+				m_nCount = 0;
+				return false;
+			}
+			if (m_nStatus == 0)
+				return false;
+
+			m_nData[m_nCount++] = b;
+			if (m_nCount < data_bytes(m_nStatus))
+				return false;
+			m_nCount = 0; // the next data byte starts another message with the same status
+			return true;
+		}
+
+		uint8_t status() const { return m_nStatus; }
+		uint8_t data1() const { return m_nData[0]; }
+		uint8_t data2() const { return data_bytes(m_nStatus) > 1 ? m_nData[1] : 0; }
+
+		// program change and channel pressure have one, everything else two
+		static int data_bytes(uint8_t nStatus) {
+			uint8_t nType = nStatus & 0xf0;
+			return nType == 0xc0 || nType == 0xd0 ? 1 : 2;
+		}
+
+	private:
+		uint8_t m_nStatus = 0;
+		uint8_t m_nData[2] = {};
+		int m_nCount = 0;
+	};
+
+	// controller 74 (brightness) sweeps the cutoff from 20 Hz to 20 kHz
+	inline double midi_brightness_cutoff(uint8_t nValue) {
+		return 20.0 * pow(1000.0, nValue / 127.0);
+	}
+
+	// Equal tempered pitch of every MIDI note, A4 (note 69) at 440 Hz
+	class note_frequencies {
+	public:
+		// works the table out on the first call
+		static note_frequencies const& get() {
+			static note_frequencies table;
+			return table;
+		}
+
+		double operator[](int nKey) const { return m_dHz[nKey & 127]; }
+
+	private:
+		double m_dHz[128];
+
+		note_frequencies() {
+			for (int k = 0; k < 128; k++)
+				m_dHz[k] = 440.0 * pow(2.0, (k - 69) / 12.0);
+		}
+	};
+
+	// Notes from a MIDI file sound on ids from here up, channel * 128 + note
+	// number, well clear of the keyboard and patch ids; which instrument plays
+	// them comes from the channel
+	const int midi_first_note_id = 4096;
+
+	// Which note id's instrument plays each of the 16 MIDI channels, -1 for
+	// none. Out of the box the channels go round the five keyboard instruments
+	// and channel 10, drums in General MIDI, is left out
+	struct midi_channel_map {
+		int nInstrument[16];
+
+		midi_channel_map() {
+			for (int c = 0; c < 16; c++)
+				nInstrument[c] = c % 5;
+			nInstrument[9] = -1;
+		}
+
+		// "0,3,-1,2": an id per channel from channel 1 on, channels not mentioned keep theirs
+		bool parse(std::string const& s, std::string& sError) {
+			std::istringstream ss(s);
+			std::string sId;
+			for (int c = 0; std::getline(ss, sId, ','); c++) {
+				int id;
+				if (c >= 16 || !(std::istringstream(sId) >> id) || id < -1 || id >= instrument_registry::nMaxIds) {
+					sError = "--midi-channels wants up to 16 note ids from -1 to " + std::to_string(instrument_registry::nMaxIds - 1);
+					return false;
+				}
+				nInstrument[c] = id;
+			}
+			return true;
+		}
+	};
+
+	// The engine event for one channel message, the same for a file and a live
+	// port: notes on their own id with the channel's instrument and their pitch,
+	// controller 74 as the cutoff. False for anything the synth doesn't play,
+	// notes on channels mapped to -1 included
+	inline bool midi_to_event(uint8_t nStatus, uint8_t nData1, uint8_t nData2, midi_channel_map const& map, note_event& e) {
+		int nChannel = nStatus & 0x0f;
+		uint8_t nType = nStatus & 0xf0;
+		if (nType == 0xb0 && nData1 == 74) {
+			e.type = event_type::parameter;
+			e.id = param_cutoff;
+			e.value = midi_brightness_cutoff(nData2);
+			return true;
+		}
+		if ((nType != 0x90 && nType != 0x80) || map.nInstrument[nChannel] < 0)
+			return false;
+
+		e.id = midi_first_note_id + nChannel * 128 + (nData1 & 127);
+		if (nType == 0x90 && nData2 > 0) { // note on at velocity 0 is a note off
+			e.type = event_type::note_on;
+			e.nInstrument = map.nInstrument[nChannel];
+			e.dFrequency = note_frequencies::get()[nData1];
+		}
+		else
+			e.type = event_type::note_off;
+		return true;
+	}
+
+	// A Standard MIDI File, format 0 or 1. Everything is read up front: the
+	// channel messages the synth plays from every track go into one array in
+	// tick order, the tempo changes into another, and sequence() turns the two
+	// into engine events on exact frames. Nothing is left to parse while audio
+	// runs.
+	class midi_file {
+	public:
+		// whether sPath starts like a MIDI file, to tell it from an event script
+		static bool is_midi(std::string const& sPath) {
+			std::ifstream file(sPath, std::ios::binary);
+			char sMagic[4] = {};
+			return file.read(sMagic, 4) && memcmp(sMagic, "MThd", 4) == 0;
+		}
+
+		bool load(std::string const& sPath, std::string& sError) {
+			std::ifstream file(sPath, std::ios::binary);
+			if (!file.is_open()) {
+				sError = "can't open " + sPath;
+				return false;
+			}
+			std::vector<uint8_t> vecBytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+			if (!parse(vecBytes.data(), vecBytes.size(), sError)) {
+				sError = sPath + ": " + sError;
+				return false;
+			}
+			return true;
+		}
+
+		bool parse(const uint8_t* pBytes, size_t nBytes, std::string& sError) {
+			m_vecMessages.clear();
+			m_vecTempo.clear();
+			m_nTracks = 0;
+			m_nEndTick = 0;
+
+			if (nBytes < 14 || memcmp(pBytes, "MThd", 4) != 0 || be32(pBytes + 4) < 6) {
+				sError = "not a MIDI file";
+				return false;
+			}
+			uint16_t nFormat = be16(pBytes + 8);
+			uint16_t nTracks = be16(pBytes + 10);
+			m_nDivision = be16(pBytes + 12);
+			if (nFormat > 1) {
+				sError = "only format 0 and 1 files are supported";
+				return false;
+			}
+			if (m_nDivision == 0 || ((m_nDivision & 0x8000) && (m_nDivision & 0xff) == 0)) {
+				sError = "bad time division";
+				return false;
+			}
+
+			// chunks that aren't tracks are skipped, as the format asks
+			size_t nPos = 8 + be32(pBytes + 4);
+			while (nPos + 8 <= nBytes && m_nTracks < nTracks) {
+				uint32_t nSize = be32(pBytes + nPos + 4);
+				if (nSize > nBytes - nPos - 8) {
+					sError = "chunk runs past the end of the file";
+					return false;
+				}
+				if (memcmp(pBytes + nPos, "MTrk", 4) == 0 && !parse_track(pBytes + nPos + 8, nSize, m_nTracks++, sError))
+					return false;
+				nPos += 8 + nSize;
+			}
+			if (m_nTracks < nTracks) {
+				sError = "header says " + std::to_string(nTracks) + " tracks, found " + std::to_string(m_nTracks);
+				return false;
+			}
+
+			// stable, so messages on the same tick keep their track and file order
+			auto byTick = [](midi_message const& a, midi_message const& b) { return a.nTick < b.nTick; };
+			std::stable_sort(m_vecMessages.begin(), m_vecMessages.end(), byTick);
+			std::stable_sort(m_vecTempo.begin(), m_vecTempo.end(), [](tempo_change const& a, tempo_change const& b) { return a.nTick < b.nTick; });
+			return true;
+		}
+
+		size_t tracks() const { return m_nTracks; }
+		size_t messages() const { return m_vecMessages.size(); }
+
+		// where the last track ends, in seconds
+		double seconds() const { return tick_seconds(m_nEndTick); }
+
+		// Every note and brightness change as engine events, in frame order, the
+		// tempo map worked into the frames. Notes still held when the file ends
+		// are let go there, so a bounce always finishes
+		std::vector<note_event> sequence(double dSampleRate, midi_channel_map const& map = midi_channel_map()) const {
+			std::vector<note_event> vecEvents;
+			vecEvents.reserve(m_vecMessages.size() + 16);
+			std::vector<uint8_t> vecHeld(16 * 128, 0);
+
+			tempo_walker tempo(*this);
+			for (auto const& m : m_vecMessages) {
+				note_event e;
+				if (!midi_to_event(m.nStatus, m.nData1, m.nData2, map, e))
+					continue;
+				e.nFrame = (uint64_t)llround(tempo.seconds(m.nTick) * dSampleRate);
+				if (e.type != event_type::parameter)
+					vecHeld[e.id - midi_first_note_id] = e.type == event_type::note_on;
+				vecEvents.push_back(e);
+			}
+
+			uint64_t nEnd = (uint64_t)llround(seconds() * dSampleRate);
+			for (size_t k = 0; k < vecHeld.size(); k++) {
+				if (!vecHeld[k])
+					continue;
+				note_event e;
+				e.type = event_type::note_off;
+				e.id = midi_first_note_id + (int)k;
+				e.nFrame = nEnd;
+				vecEvents.push_back(e);
+			}
+			return vecEvents;
+		}
+
+	private:
+		// just what the synth plays: note on/off and controller 74, 16 bytes each
+		struct midi_message {
+			uint64_t nTick;
+			uint8_t nStatus, nData1, nData2;
+		};
+
+		struct tempo_change {
+			uint64_t nTick;
+			uint32_t nMicrosPerQuarter;
+		};
+
+		std::vector<midi_message> m_vecMessages; // every track's, in tick order
+		std::vector<tempo_change> m_vecTempo;    // in tick order
+		uint16_t m_nDivision = 480;
+		size_t m_nTracks = 0;
+		uint64_t m_nEndTick = 0;
+
+		// Ticks to seconds for ticks that only ever go up, so the tempo map is
+		// walked once for a whole sequence instead of from the start each time.
+		// Time code divisions have fixed ticks per second and no tempo at all
+		class tempo_walker {
+		public:
+			tempo_walker(midi_file const& file) : m_file(file) {
+				if (file.m_nDivision & 0x8000) {
+					// frames per second as a negative byte, 29 meaning 29.97 drop frame
+					int nFps = -(int8_t)(file.m_nDivision >> 8);
+					double dFps = nFps == 29 ? 30000.0 / 1001.0 : (double)nFps;
+					m_dSecondsPerTick = 1.0 / (dFps * (file.m_nDivision & 0xff));
+					m_bTimeCode = true;
+				}
+				else
+					m_dSecondsPerTick = 0.5 / file.m_nDivision; // 120 bpm until told otherwise
+			}
+
+			double seconds(uint64_t nTick) {
+				while (!m_bTimeCode && m_nNext < m_file.m_vecTempo.size() && m_file.m_vecTempo[m_nNext].nTick <= nTick) {
+					tempo_change const& t = m_file.m_vecTempo[m_nNext++];
+					m_dSeconds += (double)(t.nTick - m_nTick) * m_dSecondsPerTick;
+					m_nTick = t.nTick;
+					m_dSecondsPerTick = t.nMicrosPerQuarter * 1e-6 / m_file.m_nDivision;
+				}
+				return m_dSeconds + (double)(nTick - m_nTick) * m_dSecondsPerTick;
+			}
+
+		private:
+			midi_file const& m_file;
+			bool m_bTimeCode = false;
+			double m_dSecondsPerTick;
+			double m_dSeconds = 0.0; // at m_nTick, the last tempo change passed
+			uint64_t m_nTick = 0;
+			size_t m_nNext = 0;
+		};
+
+		double tick_seconds(uint64_t nTick) const {
+			tempo_walker tempo(*this);
+			return tempo.seconds(nTick);
+		}
+
+		static uint16_t be16(const uint8_t* p) { return (uint16_t)(p[0] << 8 | p[1]); }
+		static uint32_t be32(const uint8_t* p) { return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]; }
+
+		// variable length quantity, at most four bytes
+		static bool read_vlq(const uint8_t* p, size_t nSize, size_t& nPos, uint32_t& nValue) {
+			nValue = 0;
+			for (int i = 0; i < 4 && nPos < nSize; i++) {
+				uint8_t b = p[nPos++];
+				nValue = (nValue << 7) | (b & 0x7f);
+				if (!(b & 0x80))
+					return true;
+			}
+			return false;
+		}
+
+		bool parse_track(const uint8_t* p, size_t nSize, size_t nTrack, std::string& sError) {
+			auto fail = [&](const char* sWhat) {
+				sError = "track " + std::to_string(nTrack + 1) + ": " + sWhat;
+				return false;
+			};
+
+			uint64_t nTick = 0;
+			uint8_t nStatus = 0;
+			size_t nPos = 0;
+			while (nPos < nSize) {
+				uint32_t nDelta;
+				if (!read_vlq(p, nSize, nPos, nDelta) || nPos >= nSize)
+					return fail("ends in the middle of an event");
+				nTick += nDelta;
+
+				uint8_t b = p[nPos];
+				if (b == 0xff || b == 0xf0 || b == 0xf7) {
+					// meta and sysex: a length, then that many bytes. Running status is
+					// kept across them, plenty of files count on it although the spec doesn't
+					uint8_t nMeta = 0;
+					nPos++;
+					if (b == 0xff) {
+						if (nPos >= nSize)
+							return fail("ends in the middle of an event");
+						nMeta = p[nPos++];
+					}
+					uint32_t nLength;
+					if (!read_vlq(p, nSize, nPos, nLength) || nLength > nSize - nPos)
+						return fail("ends in the middle of an event");
+
+					if (b == 0xff && nMeta == 0x51 && nLength == 3)
+						m_vecTempo.push_back({ nTick, (uint32_t)p[nPos] << 16 | (uint32_t)p[nPos + 1] << 8 | p[nPos + 2] });
+					nPos += nLength;
+					if (b == 0xff && nMeta == 0x2f)
+						break; // end of track
+					continue;
+				}
+
+				if (b & 0x80) {
+					if (b > 0xf0)
+						return fail("system message in a track");
+					nStatus = b;
+					nPos++;
+				}
+				else if (nStatus == 0)
+					return fail("data byte with no status before it");
+
+				int nData = midi_parser::data_bytes(nStatus);
+				if (nPos + nData > nSize)
+					return fail("ends in the middle of an event");
+				uint8_t nData1 = p[nPos], nData2 = nData > 1 ? p[nPos + 1] : 0;
+				nPos += nData;
+				if ((nData1 | nData2) & 0x80)
+					return fail("data byte out of range");
+
+				uint8_t nType = nStatus & 0xf0;
+				if (nType == 0x80 || nType == 0x90 || (nType == 0xb0 && nData1 == 74))
+					m_vecMessages.push_back({ nTick, nStatus, nData1, nData2 });
+			}
+			m_nEndTick = std::max(m_nEndTick, nTick);
+			return true;
+		}
+	};
+}
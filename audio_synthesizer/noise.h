@@ -0,0 +1,147 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SYNTH_NOISE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace synth {
+	enum class noise_types {
+		white, pink, band_limited
+	};
+
+	// Per-voice noise source. Eight xorshift32 generators run side by side so a
+	// block can be filled four/eight values per instruction; the scalar path
+	// steps the same lanes in the same order, so output is bit-identical either
+	// way and depends only on the seed. No shared state, so voices can render
+	// on any thread.
+	class noise_generator {
+	public:
+		static const int nLanes = 8;
+
+		noise_types eType = noise_types::white;
+
+		noise_generator() {
+			seed(0);
+		}
+
+		// same seed, same noise
+		void seed(uint64_t nSeed) {
+			for (int l = 0; l < nLanes; l++) {
+				// splitmix64 spreads neighbouring seeds far apart
+				uint64_t z = (nSeed += 0x9e3779b97f4a7c15ull);
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+				z ^= z >> 31;
+				m_nState[l] = (uint32_t)z ? (uint32_t)z : 0x6d2b79f5u; // xorshift must not start at 0
+			}
+			m_nBuffered = 0;
+			m_fPink[0] = m_fPink[1] = m_fPink[2] = 0.0f;
+			m_fHoldPrev = m_fHoldNext = 0.0f;
+			m_dHoldPos = 1.0;
+		}
+
+		// band-limited noise picks a new random value dFrequency times a second and interpolates in between,
+		// a tenth of the sample rate until told otherwise
+		void set_rate(double dFrequency, double dSampleRate) {
+			m_dHoldStep = dFrequency / dSampleRate;
+		}
+
+		// fills pOut with nFrames of noise in -1..1 (roughly, pink can overshoot a little)
+		void fill(float* pOut, size_t nFrames) {
+			switch (eType) {
+			case noise_types::white:
+				fill_white(pOut, nFrames);
+				break;
+
+			case noise_types::pink:
+				// Paul Kellet's economy pinking filter over the white stream
+				fill_white(pOut, nFrames);
+				for (size_t i = 0; i < nFrames; i++) {
+					float w = pOut[i];
+					m_fPink[0] = 0.99765f * m_fPink[0] + w * 0.0990460f;
+					m_fPink[1] = 0.96300f * m_fPink[1] + w * 0.2965164f;
+					m_fPink[2] = 0.57000f * m_fPink[2] + w * 1.0526913f;
+					pOut[i] = (m_fPink[0] + m_fPink[1] + m_fPink[2] + w * 0.1848f) * 0.25f;
+				}
+				break;
+
+			case noise_types::band_limited:
+				for (size_t i = 0; i < nFrames; i++) {
+					m_dHoldPos += m_dHoldStep;
+					while (m_dHoldPos >= 1.0) {
+						m_dHoldPos -= 1.0;
+						m_fHoldPrev = m_fHoldNext;
+						m_fHoldNext = next_white();
+					}
+					pOut[i] = m_fHoldPrev + (m_fHoldNext - m_fHoldPrev) * (float)m_dHoldPos;
+				}
+				break;
+			}
+		}
+
+		float next() {
+			float f = 0.0f;
+			fill(&f, 1);
+			return f;
+		}
+
+	private:
+		uint32_t m_nState[nLanes];
+
+		// one step of all lanes is produced at a time; what a caller didn't take waits here
+		float m_fBuffer[nLanes];
+		int m_nBuffered;
+
+		float m_fPink[3];
+		float m_fHoldPrev, m_fHoldNext;
+		double m_dHoldPos;
+		double m_dHoldStep = 0.1;
+
+		float next_white() {
+			if (m_nBuffered == 0) {
+				step(m_fBuffer);
+				m_nBuffered = nLanes;
+			}
+			return m_fBuffer[nLanes - m_nBuffered--];
+		}
+
+		void fill_white(float* pOut, size_t nFrames) {
+			size_t i = 0;
+			while (i < nFrames && m_nBuffered > 0)
+				pOut[i++] = m_fBuffer[nLanes - m_nBuffered--];
+
+			for (; i + nLanes <= nFrames; i += nLanes)
+				step(pOut + i);
+
+			while (i < nFrames)
+				pOut[i++] = next_white();
+		}
+
+		// advances every lane once and writes one value per lane
+		void step(float* pOut) {
+			const float fScale = 1.0f / 2147483648.0f; // int32 -> -1..1
+#ifdef SYNTH_NOISE_SSE2
+			for (int l = 0; l < nLanes; l += 4) {
+				__m128i s = _mm_loadu_si128((const __m128i*)(m_nState + l));
+				s = _mm_xor_si128(s, _mm_slli_epi32(s, 13));
+				s = _mm_xor_si128(s, _mm_srli_epi32(s, 17));
+				s = _mm_xor_si128(s, _mm_slli_epi32(s, 5));
+				_mm_storeu_si128((__m128i*)(m_nState + l), s);
+				_mm_storeu_ps(pOut + l, _mm_mul_ps(_mm_cvtepi32_ps(s), _mm_set1_ps(fScale)));
+			}
+#else
+			for (int l = 0; l < nLanes; l++) {
+				uint32_t s = m_nState[l];
+				s ^= s << 13;
+				s ^= s >> 17;
+				s ^= s << 5;
+				m_nState[l] = s;
+				pOut[l] = (float)(int32_t)s * fScale;
+			}
+#endif
+		}
+	};
+}
@@ -53,33 +53,37 @@
 
 #pragma once
 
-#pragma comment(lib, "winmm.lib")
-
 #include <iostream>
 #include <cmath>
+#include <cstdint>
+#include <algorithm>
 #include <fstream>
 #include <vector>
 #include <string>
 #include <thread>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <mutex>
 using namespace std;
 
-#include <Windows.h>
-
 #ifndef FTYPE
 #define FTYPE double
 #endif
 
 const double PI = 2.0 * acos(0.0);
 
+#include "audio_backend.h"
+#include "telemetry.h"
+
 template<class T>
 class olcNoiseMaker
 {
 public:
-	olcNoiseMaker(wstring sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512)
+	// pBackend decides where the blocks go, nullptr picks the platform default (WinMM on Windows)
+	olcNoiseMaker(wstring sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512, unique_ptr<synth::audio_backend> pBackend = nullptr)
 	{
-		Create(sOutputDevice, nSampleRate, nChannels, nBlocks, nBlockSamples);
+		Create(sOutputDevice, nSampleRate, nChannels, nBlocks, nBlockSamples, std::move(pBackend));
 	}
 
 	~olcNoiseMaker()
@@ -87,7 +91,7 @@ public:
 		Destroy();
 	}
 
-	bool Create(wstring sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512)
+	bool Create(wstring sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512, unique_ptr<synth::audio_backend> pBackend = nullptr)
 	{
 		m_bReady = false;
 		m_nSampleRate = nSampleRate;
@@ -96,49 +100,42 @@ public:
 		m_nBlockSamples = nBlockSamples;
 		m_nBlockFree = m_nBlockCount;
 		m_nBlockCurrent = 0;
+		m_nBlockDone = 0;
 		m_pBlockMemory = nullptr;
-		m_pWaveHeaders = nullptr;
+		m_pMixBuffer = nullptr;
+		m_stats = synth::latency_stats();
+		m_dLatencySum = m_dJitterSum = 0.0;
+		m_nJitterCount = 0;
+		m_bStarved = true;
 
 		m_userFunction = nullptr;
+		m_blockFunction = nullptr;
 
-		// Validate device
-		vector<wstring> devices = Enumerate();
-		auto d = std::find(devices.begin(), devices.end(), sOutputDevice);
-		if (d != devices.end())
-		{
-			// Device is available
-			int nDeviceID = distance(devices.begin(), d);
-			WAVEFORMATEX waveFormat;
-			waveFormat.wFormatTag = WAVE_FORMAT_PCM;
-			waveFormat.nSamplesPerSec = m_nSampleRate;
-			waveFormat.wBitsPerSample = sizeof(T) * 8;
-			waveFormat.nChannels = m_nChannels;
-			waveFormat.nBlockAlign = (waveFormat.wBitsPerSample / 8) * waveFormat.nChannels;
-			waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec * waveFormat.nBlockAlign;
-			waveFormat.cbSize = 0;
-
-			// Open Device if valid
-			if (waveOutOpen(&m_hwDevice, nDeviceID, &waveFormat, (DWORD_PTR)waveOutProcWrap, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
-				return Destroy();
-		}
+		m_pBackend = pBackend ? std::move(pBackend) : synth::make_default_backend();
+		if (m_pBackend == nullptr)
+			return Destroy();
+
+		synth::audio_config config;
+		config.nSampleRate = m_nSampleRate;
+		config.nChannels = m_nChannels;
+		config.nBlocks = m_nBlockCount;
+		config.nBlockSamples = m_nBlockSamples;
+		config.eFormat = synth::sample_traits<T>::format;
+		m_stats.dBufferSeconds = m_nBlockCount * config.block_seconds();
 
 		// Allocate Wave|Block Memory
-		m_pBlockMemory = new T[m_nBlockCount * m_nBlockSamples];
-		if (m_pBlockMemory == nullptr)
-			return Destroy();
-		ZeroMemory(m_pBlockMemory, sizeof(T) * m_nBlockCount * m_nBlockSamples);
+		m_pBlockMemory = new T[m_nBlockCount * m_nBlockSamples]();
 
-		m_pWaveHeaders = new WAVEHDR[m_nBlockCount];
-		if (m_pWaveHeaders == nullptr)
-			return Destroy();
-		ZeroMemory(m_pWaveHeaders, sizeof(WAVEHDR) * m_nBlockCount);
+		// Scratch block the user renders into before it is converted to T
+		m_pMixBuffer = new float[m_nBlockSamples]();
 
-		// Link headers to block memory
-		for (unsigned int n = 0; n < m_nBlockCount; n++)
-		{
-			m_pWaveHeaders[n].dwBufferLength = m_nBlockSamples * sizeof(T);
-			m_pWaveHeaders[n].lpData = (LPSTR)(m_pBlockMemory + (n * m_nBlockSamples));
-		}
+		// when each block was handed to the device, for the latency numbers
+		m_vecSubmitted.assign(m_nBlockCount, chrono::steady_clock::time_point());
+		m_nSubmittedFrame = 0;
+
+		// Open device
+		if (!m_pBackend->open(sOutputDevice, config, [this]() { BlockDone(); }))
+			return Destroy();
 
 		m_bReady = true;
 
@@ -153,13 +150,32 @@ public:
 
 	bool Destroy()
 	{
+		Stop();
+
+		if (m_pBackend != nullptr)
+			m_pBackend->close();
+
+		delete[] m_pBlockMemory;
+		m_pBlockMemory = nullptr;
+		delete[] m_pMixBuffer;
+		m_pMixBuffer = nullptr;
 		return false;
 	}
 
 	void Stop()
 	{
-		m_bReady = false;
-		m_thread.join();
+		{
+			unique_lock<mutex> lm(m_muxBlockNotZero);
+			m_bReady = false;
+			m_cvBlockNotZero.notify_one();
+		}
+		if (m_thread.joinable())
+			m_thread.join();
+	}
+
+	bool IsReady()
+	{
+		return m_bReady;
 	}
 
 	// Override to process current sample
@@ -168,23 +184,67 @@ public:
 		return 0.0;
 	}
 
+	// Override to process a whole block of interleaved frames at once. The
+	// default is only a compatibility adapter which calls the per-sample
+	// function (or UserProcess) for every frame and channel
+	virtual void UserProcessBlock(float* pOut, size_t nFrames, size_t nChannels, uint64_t nStartFrame)
+	{
+		FTYPE dTimeStep = 1.0 / (FTYPE)m_nSampleRate;
+		for (size_t n = 0; n < nFrames; n++)
+		{
+			FTYPE dTime = (FTYPE)(nStartFrame + n) * dTimeStep;
+			for (size_t c = 0; c < nChannels; c++)
+			{
+				if (m_userFunction == nullptr)
+					pOut[n * nChannels + c] = (float)UserProcess((int)c, dTime);
+				else
+					pOut[n * nChannels + c] = (float)m_userFunction((int)c, dTime);
+			}
+		}
+	}
+
+	// seconds rendered so far
 	FTYPE GetTime()
 	{
-		return m_dGlobalTime;
+		return (FTYPE)m_nGlobalFrame.load() / (FTYPE)m_nSampleRate;
+	}
+
+	// The frame something happening right now should land on: counted on from
+	// the last block handed to the device by how long ago that was, so events
+	// keep their spacing to the sample, plus a block so it's never already
+	// rendered by the time it gets to the engine
+	uint64_t GetEventFrame()
+	{
+		unique_lock<mutex> lm(m_muxBlockNotZero);
+		unsigned int nBlockFrames = m_nBlockSamples / m_nChannels;
+		double dSince = chrono::duration<double>(chrono::steady_clock::now() - m_tLastSubmitted).count();
+		return m_nSubmittedFrame + nBlockFrames + (uint64_t)min(max(0.0, dSince) * m_nSampleRate, (double)nBlockFrames);
+	}
+
+	// Measured output latency and callback jitter since Create
+	synth::latency_stats GetLatencyStats()
+	{
+		unique_lock<mutex> lm(m_muxBlockNotZero);
+		synth::latency_stats stats = m_stats;
+		if (stats.nBlocksPlayed > 0)
+			stats.dLatencyMean = m_dLatencySum / stats.nBlocksPlayed;
+		if (m_nJitterCount > 0)
+			stats.dJitterMean = m_dJitterSum / m_nJitterCount;
+		return stats;
+	}
+
+	const char* GetBackendName()
+	{
+		return m_pBackend != nullptr ? m_pBackend->name() : "none";
 	}
 
 
 
 public:
+	// Devices of the platform's default backend
 	static vector<wstring> Enumerate()
 	{
-		int nDeviceCount = waveOutGetNumDevs();
-		vector<wstring> sDevices;
-		WAVEOUTCAPS woc;
-		for (int n = 0; n < nDeviceCount; n++)
-			if (waveOutGetDevCaps(n, &woc, sizeof(WAVEOUTCAPS)) == S_OK)
-				sDevices.push_back(woc.szPname);
-		return sDevices;
+		return synth::make_default_backend()->devices();
 	}
 
 	void SetUserFunction(FTYPE(*func)(int, FTYPE))
@@ -192,65 +252,114 @@ public:
 		m_userFunction = func;
 	}
 
-	FTYPE clip(FTYPE dSample, FTYPE dMax)
+	// Block callback: fill nFrames * nChannels interleaved samples starting at nStartFrame.
+	// prepare, if given, is called first with the sample rate, frames per block and
+	// channels Create set up, so everything the callback needs is allocated before
+	// the audio thread ever calls it
+	void SetBlockFunction(void(*func)(float*, size_t, size_t, uint64_t), void(*prepare)(unsigned int, size_t, size_t) = nullptr)
+	{
+		if (prepare != nullptr)
+			prepare(m_nSampleRate, m_nBlockSamples / m_nChannels, m_nChannels);
+		m_blockFunction = func;
+	}
+
+	// Device underruns are also counted into pTelemetry, if given
+	void SetTelemetry(synth::render_telemetry* pTelemetry)
+	{
+		unique_lock<mutex> lm(m_muxBlockNotZero);
+		m_pTelemetry = pTelemetry;
+	}
+
+	// TPDF dither on the way to an integer device format; set before playing
+	void SetDither(bool bDither)
 	{
-		if (dSample >= 0.0)
-			return fmin(dSample, dMax);
-		else
-			return fmax(dSample, -dMax);
+		m_converter.set_dither(bDither);
 	}
 
 
 private:
 	FTYPE(*m_userFunction)(int, FTYPE);
+	void(*m_blockFunction)(float*, size_t, size_t, uint64_t);
 
 	unsigned int m_nSampleRate;
 	unsigned int m_nChannels;
 	unsigned int m_nBlockCount;
 	unsigned int m_nBlockSamples;
 	unsigned int m_nBlockCurrent;
+	unsigned int m_nBlockDone; // next block the device will hand back
 
-	T* m_pBlockMemory;
-	WAVEHDR* m_pWaveHeaders;
-	HWAVEOUT m_hwDevice;
+	T* m_pBlockMemory = nullptr;
+	float* m_pMixBuffer = nullptr;
+	synth::sample_converter m_converter{ synth::sample_traits<T>::format };
+	unique_ptr<synth::audio_backend> m_pBackend;
 
 	thread m_thread;
-	atomic<bool> m_bReady;
+	atomic<bool> m_bReady{ false };
 	atomic<unsigned int> m_nBlockFree;
 	condition_variable m_cvBlockNotZero;
 	mutex m_muxBlockNotZero;
 
-	atomic<FTYPE> m_dGlobalTime;
+	atomic<uint64_t> m_nGlobalFrame{ 0 }; // frames rendered, only the render thread writes it
+
+	// where the last block handed to the device ended, and when; guarded by m_muxBlockNotZero
+	uint64_t m_nSubmittedFrame = 0;
+	chrono::steady_clock::time_point m_tLastSubmitted;
+
+	// latency accounting, guarded by m_muxBlockNotZero
+	vector<chrono::steady_clock::time_point> m_vecSubmitted;
+	chrono::steady_clock::time_point m_tLastDone;
+	synth::latency_stats m_stats;
+	double m_dLatencySum, m_dJitterSum;
+	uint64_t m_nJitterCount;
+	bool m_bStarved;
+	synth::render_telemetry* m_pTelemetry = nullptr;
 
-	// Handler for soundcard request for more data
-	void waveOutProc(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwParam1, DWORD dwParam2)
+	// The device has finished with the oldest block, called from the backend's thread
+	void BlockDone()
 	{
-		if (uMsg != WOM_DONE) return;
+		chrono::steady_clock::time_point tNow = chrono::steady_clock::now();
+		double dPeriod = (double)(m_nBlockSamples / m_nChannels) / (double)m_nSampleRate;
 
-		m_nBlockFree++;
 		unique_lock<mutex> lm(m_muxBlockNotZero);
-		m_cvBlockNotZero.notify_one();
-	}
 
-	// Static wrapper for sound card handler
-	static void CALLBACK waveOutProcWrap(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwInstance, DWORD dwParam1, DWORD dwParam2)
-	{
-		((olcNoiseMaker*)dwInstance)->waveOutProc(hWaveOut, uMsg, dwParam1, dwParam2);
+		// done means played to the end, so playback started a block period earlier
+		double dLatency = chrono::duration<double>(tNow - m_vecSubmitted[m_nBlockDone]).count() - dPeriod + m_pBackend->device_latency();
+		dLatency = max(0.0, dLatency);
+		m_dLatencySum += dLatency;
+		m_stats.dLatencyMax = max(m_stats.dLatencyMax, dLatency);
+
+		// the gap after an underrun is the render side's fault, not the device's timing
+		if (!m_bStarved)
+		{
+			double dJitter = fabs(chrono::duration<double>(tNow - m_tLastDone).count() - dPeriod);
+			m_dJitterSum += dJitter;
+			m_nJitterCount++;
+			m_stats.dJitterMax = max(m_stats.dJitterMax, dJitter);
+		}
+		m_tLastDone = tNow;
+
+		m_stats.nBlocksPlayed++;
+		m_nBlockDone = (m_nBlockDone + 1) % m_nBlockCount;
+
+		m_bStarved = ++m_nBlockFree == m_nBlockCount;
+		if (m_bStarved)
+		{
+			m_stats.nUnderruns++;
+			if (m_pTelemetry != nullptr)
+				m_pTelemetry->record_underrun();
+		}
+
+		m_cvBlockNotZero.notify_one();
 	}
 
 	// Main thread. This loop responds to requests from the soundcard to fill 'blocks'
 	// with audio data. If no requests are available it goes dormant until the sound
 	// card is ready for more data. The block is fille by the "user" in some manner
-	// and then issued to the soundcard.
+	// and then issued to the backend.
 	void MainThread()
 	{
-		m_dGlobalTime = 0.0;
-		FTYPE dTimeStep = 1.0 / (FTYPE)m_nSampleRate;
-
-		// Goofy hack to get maximum integer for a type at run-time
-		T nMaxSample = (T)pow(2, (sizeof(T) * 8) - 1) - 1;
-		FTYPE dMaxSample = (FTYPE)nMaxSample;
-		T nPreviousSample = 0;
+		m_nGlobalFrame = 0;
+		unsigned int nBlockFrames = m_nBlockSamples / m_nChannels;
 
 		while (m_bReady)
 		{
@@ -258,42 +367,36 @@ private:
 			if (m_nBlockFree == 0)
 			{
 				unique_lock<mutex> lm(m_muxBlockNotZero);
-				while (m_nBlockFree == 0) // sometimes, Windows signals incorrectly
+				while (m_nBlockFree == 0 && m_bReady) // sometimes, Windows signals incorrectly
 					m_cvBlockNotZero.wait(lm);
 			}
+			if (!m_bReady)
+				break;
 
 			// Block is here, so use it
 			m_nBlockFree--;
 
-			// Prepare block for processing
-			if (m_pWaveHeaders[m_nBlockCurrent].dwFlags & WHDR_PREPARED)
-				waveOutUnprepareHeader(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
-
-			T nNewSample = 0;
 			int nCurrentBlock = m_nBlockCurrent * m_nBlockSamples;
 
-			for (unsigned int n = 0; n < m_nBlockSamples; n += m_nChannels)
-			{
-				// User Process
-				for (unsigned int c = 0; c < m_nChannels; c++)
-				{
-					if (m_userFunction == nullptr)
-						nNewSample = (T)(clip(UserProcess(c, m_dGlobalTime), 1.0) * dMaxSample);
-					else
-						nNewSample = (T)(clip(m_userFunction(c, m_dGlobalTime), 1.0) * dMaxSample);
-
-					m_pBlockMemory[nCurrentBlock + n + c] = nNewSample;
-					nPreviousSample = nNewSample;
-				}
-
-				m_dGlobalTime = m_dGlobalTime + dTimeStep;
-			}
+			// User Process - one call for the whole block
+			if (m_blockFunction == nullptr)
+				UserProcessBlock(m_pMixBuffer, nBlockFrames, m_nChannels, m_nGlobalFrame);
+			else
+				m_blockFunction(m_pMixBuffer, nBlockFrames, m_nChannels, m_nGlobalFrame);
+
+			m_converter.convert(m_pMixBuffer, nBlockFrames * m_nChannels, m_pBlockMemory + nCurrentBlock);
+
+			m_nGlobalFrame += nBlockFrames;
 
 			// Send block to sound device
-			waveOutPrepareHeader(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
-			waveOutWrite(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
+			{
+				unique_lock<mutex> lm(m_muxBlockNotZero);
+				m_vecSubmitted[m_nBlockCurrent] = m_tLastSubmitted = chrono::steady_clock::now();
+				m_nSubmittedFrame = m_nGlobalFrame;
+			}
+			m_pBackend->write(m_nBlockCurrent, m_pBlockMemory + nCurrentBlock, m_nBlockSamples * sizeof(T));
 			m_nBlockCurrent++;
 			m_nBlockCurrent %= m_nBlockCount;
 		}
 	}
-};
\ No newline at end of file
+};
@@ -0,0 +1,132 @@
+#pragma once
+#include "engine.h"
+#include "wav.h"
+
+#include <chrono>
+#include <sstream>
+
+namespace synth {
+	// Plain text list of events, one per line, times in seconds:
+	//   0.0  on  2        start note id 2
+	//   4.5  off 2        release it
+	//   1.0  cutoff 300   set the filter cutoff
+	//   2.0  send 0.5     set the level of send bus 0 (the reverb)
+	//   2.0  send 0.5 1   ... or of send bus 1
+	// Anything after a '#' is a comment. Lines don't need to be in order.
+	class event_script {
+	public:
+		bool load(std::string const& sPath, double dSampleRate, std::string& sError) {
+			std::ifstream file(sPath);
+			if (!file.is_open()) {
+				sError = "can't open " + sPath;
+				return false;
+			}
+			return parse(file, dSampleRate, sError);
+		}
+
+		bool parse(std::istream& in, double dSampleRate, std::string& sError) {
+			m_vecEvents.clear();
+			std::string sLine;
+			int nLine = 0;
+			while (std::getline(in, sLine)) {
+				nLine++;
+				size_t nHash = sLine.find('#');
+				if (nHash != std::string::npos)
+					sLine.resize(nHash);
+
+				std::istringstream ss(sLine);
+				if (sLine.find_first_not_of(" \t\r") == std::string::npos)
+					continue; // blank line
+
+				double dTime;
+				std::string sWhat;
+				double dArg;
+
+				if (!(ss >> dTime >> sWhat >> dArg) || dTime < 0.0) {
+					sError = "line " + std::to_string(nLine) + ": expected '<seconds> on|off|cutoff|send <value>'";
+					return false;
+				}
+
+				note_event e;
+				e.nFrame = (uint64_t)llround(dTime * dSampleRate);
+				if (sWhat == "on" || sWhat == "off") {
+					e.type = sWhat == "on" ? event_type::note_on : event_type::note_off;
+					e.id = (int)dArg;
+				}
+				else if (sWhat == "cutoff") {
+					e.type = event_type::parameter;
+					e.id = param_cutoff;
+					e.value = dArg;
+				}
+				else if (sWhat == "send") {
+					e.type = event_type::parameter;
+					e.id = param_send;
+					e.value = dArg;
+					if (!(ss >> e.nBus))
+						e.nBus = 0;
+				}
+				else {
+					sError = "line " + std::to_string(nLine) + ": unknown event '" + sWhat + "'";
+					return false;
+				}
+				m_vecEvents.push_back(e);
+			}
+
+			// stable, so events on the same frame keep their file order
+			std::stable_sort(m_vecEvents.begin(), m_vecEvents.end(), [](note_event const& a, note_event const& b) { return a.nFrame < b.nFrame; });
+			return true;
+		}
+
+		std::vector<note_event> const& events() const { return m_vecEvents; }
+
+	private:
+		std::vector<note_event> m_vecEvents;
+	};
+
+	struct render_stats {
+		uint64_t nFrames = 0;
+		double dAudioSeconds = 0.0;
+		double dWallSeconds = 0.0;
+
+		// how many seconds of audio per second of wall clock
+		double realtime() const { return dWallSeconds > 0.0 ? dAudioSeconds / dWallSeconds : 0.0; }
+	};
+
+	// Runs the events through the engine as fast as the CPU allows and streams
+	// the result into wav. The engine puts every event on its exact sample
+	// whatever the block size, so the blocks here are all the same size. Stops
+	// once the last event has happened and every note (and the reverb after it)
+	// has died away, or dMaxTail seconds after the last event.
+	inline render_stats render_offline(engine& eng, std::vector<note_event> const& vecEvents, wav_writer& wav, size_t nChannels, size_t nBlockFrames = 512, double dMaxTail = 30.0) {
+		render_stats stats;
+		nChannels = std::max((size_t)1, nChannels);
+		nBlockFrames = std::max((size_t)1, nBlockFrames); // an empty block would never get anywhere
+		std::vector<float> vecBlock(nBlockFrames * nChannels);
+		eng.prepare(nBlockFrames, nChannels);
+
+		uint64_t nLastEvent = vecEvents.empty() ? 0 : vecEvents.back().nFrame;
+		uint64_t nStop = nLastEvent + (uint64_t)(dMaxTail * eng.sample_rate());
+		uint64_t nFrame = 0;
+		size_t nNext = 0;
+
+		auto tStart = std::chrono::steady_clock::now();
+		while (nFrame < nStop) {
+			// the engine holds on to events until their frame, so they go in as soon as there's room
+			while (nNext < vecEvents.size() && eng.post(vecEvents[nNext]))
+				nNext++;
+
+			eng.process(vecBlock.data(), nBlockFrames, nChannels, nFrame);
+			wav.write(vecBlock.data(), nBlockFrames);
+			nFrame += nBlockFrames;
+
+			if (nNext == vecEvents.size() && nFrame > nLastEvent && eng.idle())
+				break;
+		}
+		auto tEnd = std::chrono::steady_clock::now();
+
+		stats.nFrames = nFrame;
+		stats.dAudioSeconds = (double)nFrame / eng.sample_rate();
+		stats.dWallSeconds = std::chrono::duration<double>(tEnd - tStart).count();
+		return stats;
+	}
+}
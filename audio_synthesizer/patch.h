@@ -0,0 +1,364 @@
+#pragma once
+#include "instrument_registry.h"
+
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace synth {
+	// Instruments as text, so sounds can change without a rebuild:
+	//
+	//   instrument glass_pad               name, must be unique in the file
+	//     key 2                            note id(s) it plays, optional
+	//     volume 0.5
+	//     pan -0.3                         -1 first (left) channel .. +1 last, 0 centre
+	//     envelope 2.0 4.0 0.5 5.0 exponential
+	//                                      attack decay sustain release [linear|exponential]
+	//     osc sine 0.5 220                 type amplitude frequency
+	//     osc triangle 0.2 440 lfo 5 0.01  ... with vibrato, lfo frequency and depth
+	//     osc noise_band 0.05 2000         noise is white, noise_pink pink, and
+	//                                      noise_band a new value frequency times
+	//                                      a second, smoothed in between
+	//     partials saw 110 0.5 0.25        harmonic series: base frequency, then the
+	//                                      amplitude of harmonic 1, 2, ...
+	//     filter lowpass 1200 2.0 biquad   lowpass|highpass|bandpass|notch cutoff, then
+	//                                      optionally resonance (Q, 0.707 if left
+	//                                      out) and svf|biquad (svf if left out)
+	//   end
+	//
+	// Anything after a '#' is a comment. A set is checked completely before it is
+	// used; the result is the same flat instrument_def/partial tables the built
+	// in instruments are, so a loaded patch renders exactly as fast.
+	class patch_set {
+	public:
+		patch_set() {}
+		patch_set(patch_set const&) = delete; // the defs point into the set's own vectors
+		patch_set& operator=(patch_set const&) = delete;
+
+		bool load(std::string const& sPath, std::string& sError) {
+			std::ifstream file(sPath);
+			if (!file.is_open()) {
+				sError = "can't open " + sPath;
+				return false;
+			}
+			if (!parse(file, sError)) {
+				sError = sPath + ": " + sError;
+				return false;
+			}
+			return true;
+		}
+
+		bool parse(std::istream& in, std::string& sError) {
+			std::vector<pending> vecPending;
+			pending* pCurrent = nullptr;
+			std::string sLine;
+			int nLine = 0;
+
+			auto fail = [&](std::string const& sWhy) {
+				sError = "line " + std::to_string(nLine) + ": " + sWhy;
+				return false;
+			};
+
+			while (std::getline(in, sLine)) {
+				nLine++;
+				size_t nHash = sLine.find('#');
+				if (nHash != std::string::npos)
+					sLine.resize(nHash);
+
+				std::istringstream ss(sLine);
+				std::string sWord;
+				if (!(ss >> sWord))
+					continue; // blank line
+
+				if (sWord == "instrument") {
+					std::string sName;
+					if (pCurrent != nullptr)
+						return fail("'instrument' before the 'end' of " + pCurrent->sName);
+					if (!(ss >> sName))
+						return fail("instrument needs a name");
+					for (auto const& p : vecPending)
+						if (p.sName == sName)
+							return fail("instrument " + sName + " is defined twice");
+					vecPending.push_back(pending());
+					pCurrent = &vecPending.back();
+					pCurrent->sName = sName;
+					pCurrent->nLine = nLine;
+				}
+				else if (pCurrent == nullptr) {
+					return fail("'" + sWord + "' outside an instrument");
+				}
+				else if (sWord == "end") {
+					if (pCurrent->vecPartials.empty())
+						return fail(pCurrent->sName + " has no oscillators");
+					pCurrent = nullptr;
+				}
+				else if (sWord == "key") {
+					int id;
+					if (!(ss >> id) || id < 0 || id >= instrument_registry::nMaxIds)
+						return fail("key needs a note id from 0 to " + std::to_string(instrument_registry::nMaxIds - 1));
+					for (auto const& p : vecPending)
+						for (int k : p.vecKeys)
+							if (k == id)
+								return fail("key " + std::to_string(id) + " is already used by " + p.sName);
+					pCurrent->vecKeys.push_back(id);
+				}
+				else if (sWord == "volume") {
+					if (!(ss >> pCurrent->dVolume) || pCurrent->dVolume < 0.0)
+						return fail("volume needs a number >= 0");
+				}
+				else if (sWord == "pan") {
+					if (!(ss >> pCurrent->dPan) || pCurrent->dPan < -1.0 || pCurrent->dPan > 1.0)
+						return fail("pan needs a number from -1 to 1");
+				}
+				else if (sWord == "envelope") {
+					pending& p = *pCurrent;
+					if (!(ss >> p.dAttack >> p.dDecay >> p.dSustain >> p.dRelease))
+						return fail("envelope needs attack decay sustain release");
+					if (p.dAttack < 0.0 || p.dDecay < 0.0 || p.dRelease < 0.0)
+						return fail("envelope times can't be negative");
+					if (p.dSustain < 0.0 || p.dSustain > 1.0)
+						return fail("sustain must be from 0 to 1");
+
+					std::string sCurve;
+					if (ss >> sCurve) {
+						if (sCurve == "linear")
+							p.eCurve = env_curve::linear;
+						else if (sCurve == "exponential")
+							p.eCurve = env_curve::exponential;
+						else
+							return fail("unknown envelope curve '" + sCurve + "'");
+					}
+				}
+				else if (sWord == "osc") {
+					partial o = {};
+					std::string sType;
+					if (!(ss >> sType >> o.dAmplitude >> o.dFrequency))
+						return fail("osc needs type amplitude frequency");
+					if (!parse_type(sType, o.eType, o.eNoise))
+						return fail("unknown oscillator type '" + sType + "'");
+
+					std::string sLFO;
+					if (ss >> sLFO) {
+						if (sLFO != "lfo" || !(ss >> o.dLFOFrequency >> o.dLFOAmplitude))
+							return fail("expected 'lfo frequency depth' after the oscillator");
+						if (o.dLFOFrequency < 0.0)
+							return fail("lfo frequency can't be negative");
+					}
+
+					std::string sWhy;
+					if (!check(o, sWhy))
+						return fail(sWhy);
+					pCurrent->vecPartials.push_back(o);
+				}
+				else if (sWord == "partials") {
+					std::string sType;
+					double dBase;
+					if (!(ss >> sType >> dBase))
+						return fail("partials needs type base-frequency amplitudes...");
+					partial o = {};
+					if (!parse_type(sType, o.eType, o.eNoise))
+						return fail("unknown oscillator type '" + sType + "'");
+
+					int nHarmonic = 0;
+					double dAmplitude;
+					while (ss >> dAmplitude) {
+						o.dAmplitude = dAmplitude;
+						o.dFrequency = dBase * ++nHarmonic;
+
+						std::string sWhy;
+						if (!check(o, sWhy))
+							return fail(sWhy);
+						pCurrent->vecPartials.push_back(o);
+					}
+					if (nHarmonic == 0)
+						return fail("partials needs at least one amplitude");
+					ss.clear(); // stopped at the first thing that wasn't a number, checked below
+				}
+				else if (sWord == "filter") {
+					pending& p = *pCurrent;
+					std::string sType;
+					if (!(ss >> sType >> p.dCutoff))
+						return fail("filter needs type cutoff");
+					if (sType == "lowpass")
+						p.eFilter = filter_types::lowpass;
+					else if (sType == "highpass")
+						p.eFilter = filter_types::highpass;
+					else if (sType == "bandpass")
+						p.eFilter = filter_types::bandpass;
+					else if (sType == "notch")
+						p.eFilter = filter_types::notch;
+					else
+						return fail("unknown filter type '" + sType + "'");
+					if (p.dCutoff <= 0.0 || p.dCutoff > 20000.0)
+						return fail("filter cutoff must be above 0 and at most 20000 Hz");
+
+					double dResonance;
+					if (ss >> dResonance) {
+						if (dResonance < 0.1 || dResonance > 40.0)
+							return fail("filter resonance must be from 0.1 to 40");
+						p.dResonance = dResonance;
+					}
+					ss.clear(); // no resonance is fine, a topology may still follow
+
+					std::string sTopology;
+					if (ss >> sTopology) {
+						if (sTopology == "svf")
+							p.eTopology = filter_topologies::svf;
+						else if (sTopology == "biquad")
+							p.eTopology = filter_topologies::biquad;
+						else
+							return fail("unknown filter topology '" + sTopology + "'");
+					}
+				}
+				else {
+					return fail("unknown keyword '" + sWord + "'");
+				}
+
+				// the line matched, so anything left over is a typo
+				std::string sExtra;
+				if (ss >> sExtra)
+					return fail("unexpected '" + sExtra + "'");
+				if (pCurrent != nullptr && (int)pCurrent->vecPartials.size() > nMaxOscillators)
+					return fail(pCurrent->sName + " has more than " + std::to_string(nMaxOscillators) + " oscillators");
+			}
+
+			if (pCurrent != nullptr) {
+				nLine = pCurrent->nLine;
+				return fail(pCurrent->sName + " has no 'end'");
+			}
+
+			build(vecPending);
+			return true;
+		}
+
+		size_t size() const { return m_vecDefs.size(); }
+		instrument_def const& operator[](size_t i) const { return m_vecDefs[i]; }
+
+		// Publishes every instrument and key of the set in one go. Ids the set
+		// doesn't mention keep whatever they had
+		static void install(std::shared_ptr<const patch_set> const& pSet, instrument_registry& registry) {
+			registry.update([&](instrument_registry::table& t) {
+				std::shared_ptr<const void> pOwner(pSet);
+				for (auto const& def : pSet->m_vecDefs)
+					t.add(&def, pOwner);
+				for (auto const& key : pSet->m_vecKeys)
+					t.pById[key.first] = &pSet->m_vecDefs[key.second];
+			});
+		}
+
+	private:
+		// an instrument as it's being read
+		struct pending {
+			std::string sName;
+			int nLine = 0;
+			std::vector<int> vecKeys;
+			double dVolume = 1.0;
+			double dPan = 0.0;
+			double dAttack = 0.1, dDecay = 0.2, dSustain = 0.8, dRelease = 0.1;
+			env_curve eCurve = env_curve::linear;
+			std::vector<partial> vecPartials;
+			filter_types eFilter = filter_types::none;
+			double dCutoff = 0.0;
+			double dResonance = 0.707;
+			filter_topologies eTopology = filter_topologies::svf;
+		};
+
+		// everything's partials back to back, then the defs pointing into them
+		std::vector<partial> m_vecPartials;
+		std::vector<std::string> m_vecNames;
+		std::vector<instrument_def> m_vecDefs;
+		std::vector<std::pair<int, size_t>> m_vecKeys;
+
+		static bool parse_type(std::string const& s, osc_types& eType, noise_types& eNoise) {
+			const char* sNames[] = { "sine", "square", "triangle", "saw", "noise", "noise_pink", "noise_band" };
+			const osc_types eTypes[] = { osc_types::sine, osc_types::square, osc_types::triangle, osc_types::saw, osc_types::noise, osc_types::noise, osc_types::noise };
+			const noise_types eNoises[] = { noise_types::white, noise_types::white, noise_types::white, noise_types::white, noise_types::white, noise_types::pink, noise_types::band_limited };
+			for (int i = 0; i < 7; i++) {
+				if (s == sNames[i]) {
+					eType = eTypes[i];
+					eNoise = eNoises[i];
+					return true;
+				}
+			}
+			return false;
+		}
+
+		static bool check(partial const& o, std::string& sWhy) {
+			if (o.dAmplitude < 0.0) {
+				sWhy = "amplitude can't be negative";
+				return false;
+			}
+			if (o.dFrequency <= 0.0 || o.dFrequency > 20000.0) {
+				sWhy = "frequency must be above 0 and at most 20000 Hz";
+				return false;
+			}
+			return true;
+		}
+
+		// Nothing is pushed after this, so the pointers into the vectors stay put
+		void build(std::vector<pending> const& vecPending) {
+			m_vecPartials.clear();
+			m_vecNames.clear();
+			m_vecDefs.clear();
+			m_vecKeys.clear();
+
+			for (size_t i = 0; i < vecPending.size(); i++) {
+				pending const& p = vecPending[i];
+				m_vecPartials.insert(m_vecPartials.end(), p.vecPartials.begin(), p.vecPartials.end());
+				m_vecNames.push_back(p.sName);
+				for (int id : p.vecKeys)
+					m_vecKeys.push_back(std::make_pair(id, i));
+			}
+
+			size_t nFirst = 0;
+			for (size_t i = 0; i < vecPending.size(); i++) {
+				pending const& p = vecPending[i];
+				instrument_def def = { m_vecNames[i].c_str(), p.dVolume, p.dAttack, p.dDecay, p.dSustain, p.dRelease, p.eCurve,
+					m_vecPartials.data() + nFirst, (int)p.vecPartials.size(), p.eFilter, p.dCutoff, p.dResonance, p.eTopology, p.dPan };
+				m_vecDefs.push_back(def);
+				nFirst += p.vecPartials.size();
+			}
+		}
+	};
+
+	// Control thread: loads a patch file and loads it again whenever it changes
+	// on disk. A version with mistakes is reported and skipped, whatever was
+	// loaded last keeps playing.
+	class patch_watcher {
+	public:
+		patch_watcher(std::string const& sPath) : m_sPath(sPath) {}
+
+		// true if a new version was installed; false with sError set if it was broken
+		bool poll(instrument_registry& registry, std::string& sError) {
+			std::error_code ec;
+			std::filesystem::file_time_type tWrite = std::filesystem::last_write_time(m_sPath, ec);
+			if (ec) {
+				if (!m_bMissing)
+					sError = "can't open " + m_sPath;
+				m_bMissing = true;
+				return false;
+			}
+			if (!m_bMissing && m_bSeen && tWrite == m_tWrite)
+				return false;
+
+			m_bMissing = false;
+			m_bSeen = true;
+			m_tWrite = tWrite;
+
+			std::shared_ptr<patch_set> pSet(new patch_set());
+			if (!pSet->load(m_sPath, sError))
+				return false;
+			patch_set::install(pSet, registry);
+			return true;
+		}
+
+	private:
+		std::string m_sPath;
+		std::filesystem::file_time_type m_tWrite;
+		bool m_bSeen = false;
+		bool m_bMissing = false;
+	};
+}
@@ -0,0 +1,383 @@
+#pragma once
+#include "fft.h"
+#include "effects.h"
+#include "wav.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef SYNTH_WITH_FFTW
+namespace synth {
+	// Uniformly partitioned overlap-save: the impulse response is cut into
+	// nPartition-sample pieces that are each turned into a spectrum once, up
+	// front. Every partition of input is transformed once, goes into a
+	// frequency domain delay line, and is multiplied against all the pieces at
+	// the same time, so the cost per sample grows with IR length / nPartition
+	// instead of with the IR length. Everything is allocated and planned in the
+	// constructor; step() never allocates.
+	class partitioned_convolver {
+	public:
+		partitioned_convolver(const float* pIR, size_t nLength, size_t nPartition) {
+			m_nSize = nPartition;
+			m_nBins = nPartition + 1;
+			m_nParts = std::max((size_t)1, (nLength + nPartition - 1) / nPartition);
+
+			m_pTime = fftw_alloc_real(2 * m_nSize);
+			m_pSpectrum = fftw_alloc_complex(m_nBins);
+			m_pAccumulator = fftw_alloc_complex(m_nBins);
+			m_pFilters = fftw_alloc_complex(m_nParts * m_nBins);
+			m_pDelayLine = fftw_alloc_complex(m_nParts * m_nBins);
+
+			// planning scribbles over the arrays, so it comes before anything is put in them
+			m_planForward = fftw_plan_dft_r2c_1d((int)(2 * m_nSize), m_pTime, m_pSpectrum, FFTW_MEASURE);
+			m_planInverse = fftw_plan_dft_c2r_1d((int)(2 * m_nSize), m_pAccumulator, m_pTime, FFTW_MEASURE);
+
+			// the inverse transform isn't normalised, that's folded into the filters
+			double dScale = 1.0 / (2.0 * m_nSize);
+			for (size_t p = 0; p < m_nParts; p++) {
+				for (size_t i = 0; i < 2 * m_nSize; i++) {
+					size_t n = p * m_nSize + i;
+					m_pTime[i] = i < m_nSize && n < nLength ? pIR[n] * dScale : 0.0;
+				}
+				fftw_execute(m_planForward);
+				memcpy(m_pFilters + p * m_nBins, m_pSpectrum, m_nBins * sizeof(fftw_complex));
+			}
+
+			memset(m_pDelayLine, 0, m_nParts * m_nBins * sizeof(fftw_complex));
+			m_vecInput.assign(2 * m_nSize, 0.0);
+		}
+
+		~partitioned_convolver() {
+			fftw_destroy_plan(m_planForward);
+			fftw_destroy_plan(m_planInverse);
+			fftw_free(m_pTime);
+			fftw_free(m_pSpectrum);
+			fftw_free(m_pAccumulator);
+			fftw_free(m_pFilters);
+			fftw_free(m_pDelayLine);
+		}
+
+		partitioned_convolver(partitioned_convolver const&) = delete;
+		partitioned_convolver& operator=(partitioned_convolver const&) = delete;
+
+		size_t partition() const { return m_nSize; }
+
+		// exactly partition() samples in, the same number of output samples out
+		void step(const float* pIn, float* pOut) {
+			// the last two partitions of input, oldest first
+			std::copy(m_vecInput.begin() + m_nSize, m_vecInput.end(), m_vecInput.begin());
+			for (size_t i = 0; i < m_nSize; i++)
+				m_vecInput[m_nSize + i] = pIn[i];
+			std::copy(m_vecInput.begin(), m_vecInput.end(), m_pTime);
+			fftw_execute(m_planForward);
+			memcpy(m_pDelayLine + m_nCurrent * m_nBins, m_pSpectrum, m_nBins * sizeof(fftw_complex));
+
+			// newest input against the first piece of the IR, older input against later pieces
+			memset(m_pAccumulator, 0, m_nBins * sizeof(fftw_complex));
+			size_t nSlot = m_nCurrent;
+			for (size_t p = 0; p < m_nParts; p++) {
+				const fftw_complex* pX = m_pDelayLine + nSlot * m_nBins;
+				const fftw_complex* pH = m_pFilters + p * m_nBins;
+				for (size_t k = 0; k < m_nBins; k++) {
+					m_pAccumulator[k][0] += pX[k][0] * pH[k][0] - pX[k][1] * pH[k][1];
+					m_pAccumulator[k][1] += pX[k][0] * pH[k][1] + pX[k][1] * pH[k][0];
+				}
+				nSlot = nSlot == 0 ? m_nParts - 1 : nSlot - 1;
+			}
+			m_nCurrent = (m_nCurrent + 1) % m_nParts;
+
+			// the first half wrapped around, only the second half is real output
+			fftw_execute(m_planInverse);
+			for (size_t i = 0; i < m_nSize; i++)
+				pOut[i] = (float)m_pTime[m_nSize + i];
+		}
+
+	private:
+		size_t m_nSize;
+		size_t m_nBins;
+		size_t m_nParts;
+		size_t m_nCurrent = 0; // delay line slot the next input spectrum goes in
+
+		std::vector<double> m_vecInput;
+		double* m_pTime;
+		fftw_complex* m_pSpectrum;
+		fftw_complex* m_pAccumulator;
+		fftw_complex* m_pFilters;   // m_nParts spectra of m_nBins
+		fftw_complex* m_pDelayLine; // the same, a ring of past input spectra
+		fftw_plan m_planForward;
+		fftw_plan m_planInverse;
+	};
+
+	// Mono convolution reverb with exactly nBlock samples of latency, whatever
+	// the IR length. The IR is split in two: the head, IR[0, 2T), runs on the
+	// audio thread in partitions of nBlock; the tail, everything after, runs in
+	// partitions of T = 16 * nBlock on its own thread. The tail starts 2T into
+	// the IR, so after a tail partition's worth of input comes in there is a
+	// whole extra partition of time before its output is due, and the worker
+	// gets that long to do it. The audio thread never waits for it: a tail
+	// partition that isn't ready in time is left out (and counted), the head
+	// keeps playing. Offline renders want every partition however long it
+	// takes, so with bBackgroundTail off the tail runs inline instead.
+	//
+	// As an effect it replaces the block with only the reverb, so it belongs
+	// on a send bus. The IR is mono: the channels are averaged going in and
+	// every channel gets the same reverb back, so more channels cost nothing
+	// extra.
+	class convolution_reverb : public effect {
+	public:
+		convolution_reverb(std::vector<float> const& vecIR, size_t nBlock = 256, bool bBackgroundTail = true) {
+			m_nBlock = nBlock;
+			m_nTailSize = nBlock * 16;
+			m_nLength = vecIR.size();
+
+			size_t nTailStart = 2 * m_nTailSize;
+			m_pHead.reset(new partitioned_convolver(vecIR.data(), std::min(m_nLength, nTailStart), m_nBlock));
+			m_vecHeadIn.assign(m_nBlock, 0.0f);
+			m_vecHeadOut.assign(m_nBlock, 0.0f);
+
+			if (m_nLength > nTailStart) {
+				m_pTail.reset(new partitioned_convolver(vecIR.data() + nTailStart, m_nLength - nTailStart, m_nTailSize));
+				m_vecTailIn.assign(m_nTailSize, 0.0f);
+				for (auto& slot : m_slots) {
+					slot.vecIn.assign(m_nTailSize, 0.0f);
+					slot.vecOut.assign(m_nTailSize, 0.0f);
+				}
+				if (bBackgroundTail) {
+					m_bRunning = true;
+					m_thread = std::thread(&convolution_reverb::run_tail, this);
+				}
+			}
+		}
+
+		~convolution_reverb() {
+			if (m_thread.joinable()) {
+				m_bRunning = false;
+				m_cvTail.notify_one();
+				m_thread.join();
+			}
+		}
+
+		// Loads an IR from a wav: channels are averaged, it's resampled to
+		// dSampleRate if need be, silence at the end is trimmed and it's scaled
+		// to unit energy, so any IR comes out about as loud as what goes in
+		static std::unique_ptr<convolution_reverb> load(std::string const& sPath, double dSampleRate, std::string& sError, size_t nBlock = 256, bool bBackgroundTail = true) {
+			wav_reader wav;
+			if (!wav.load(sPath, sError))
+				return nullptr;
+			if (wav.frames() == 0 || wav.sample_rate() == 0) {
+				sError = sPath + ": empty impulse response";
+				return nullptr;
+			}
+
+			std::vector<float> vecMono(wav.frames());
+			for (size_t i = 0; i < vecMono.size(); i++) {
+				float fSum = 0.0f;
+				for (unsigned int c = 0; c < wav.channels(); c++)
+					fSum += wav.samples()[i * wav.channels() + c];
+				vecMono[i] = fSum / wav.channels();
+			}
+
+			// linear interpolation is plenty for a reverb tail
+			std::vector<float> vecIR;
+			double dRatio = wav.sample_rate() / dSampleRate;
+			size_t nLength = (size_t)(vecMono.size() / dRatio);
+			for (size_t i = 0; i < nLength; i++) {
+				double dPos = i * dRatio;
+				size_t n = (size_t)dPos;
+				float fNext = n + 1 < vecMono.size() ? vecMono[n + 1] : 0.0f;
+				vecIR.push_back((float)(vecMono[n] + (fNext - vecMono[n]) * (dPos - n)));
+			}
+
+			double dEnergy = 0.0, dPeak = 0.0;
+			for (float f : vecIR) {
+				dEnergy += (double)f * f;
+				dPeak = std::max(dPeak, (double)fabsf(f));
+			}
+			if (dEnergy <= 0.0) {
+				sError = sPath + ": impulse response is silent";
+				return nullptr;
+			}
+			while (!vecIR.empty() && fabsf(vecIR.back()) < dPeak * 3e-5) // -90 dB
+				vecIR.pop_back();
+
+			float fScale = (float)(1.0 / sqrt(dEnergy));
+			for (float& f : vecIR)
+				f *= fScale;
+			return std::unique_ptr<convolution_reverb>(new convolution_reverb(vecIR, nBlock, bBackgroundTail));
+		}
+
+		size_t latency() const { return m_nBlock; }
+		size_t length() const { return m_nLength; }
+
+		// tail partitions that weren't ready in time and were left out
+		uint64_t late_partitions() const { return m_nLate; }
+
+		// true once everything that went in has died away
+		bool silent() const override { return m_nQuiet >= m_nLength + m_nBlock; }
+
+		void prepare(double /*dSampleRate*/, size_t /*nMaxFrames*/, size_t nChannels) override { m_nChannels = nChannels; }
+
+		// Audio thread: any number of frames, the input is replaced by the reverb
+		void process(float* const* pChannels, size_t nFrames) override {
+			float* pMono = pChannels[0];
+			if (m_nChannels > 1) {
+				float fScale = 1.0f / (float)m_nChannels;
+				for (size_t c = 1; c < m_nChannels; c++)
+					for (size_t i = 0; i < nFrames; i++)
+						pMono[i] += pChannels[c][i];
+				for (size_t i = 0; i < nFrames; i++)
+					pMono[i] *= fScale;
+			}
+
+			process_mono(pMono, nFrames);
+			for (size_t c = 1; c < m_nChannels; c++)
+				std::copy(pMono, pMono + nFrames, pChannels[c]);
+		}
+
+	private:
+		static const size_t nSlots = 4;
+
+		void process_mono(float* pBuffer, size_t nFrames) {
+			size_t nDone = 0;
+			while (nDone < nFrames) {
+				// never past the end of a head partition; tail partitions line up with those
+				size_t nCount = std::min(nFrames - nDone, m_nBlock - m_nHeadPos);
+				float* pY = pBuffer + nDone;
+
+				// the input is taken before it's overwritten
+				if (m_pTail)
+					std::copy(pY, pY + nCount, m_vecTailIn.begin() + m_nTailPos);
+
+				bool bQuiet = true;
+				for (size_t i = 0; i < nCount; i++) {
+					bQuiet = bQuiet && pY[i] == 0.0f;
+					m_vecHeadIn[m_nHeadPos + i] = pY[i];
+					pY[i] = m_vecHeadOut[m_nHeadPos + i];
+				}
+				m_nQuiet = bQuiet ? m_nQuiet + nCount : 0;
+
+				if (m_pTail) {
+					add_tail(pY, nCount);
+					m_nTailPos += nCount;
+					if (m_nTailPos == m_nTailSize) {
+						post_tail();
+						m_nTailPos = 0;
+					}
+				}
+
+				m_nHeadPos += nCount;
+				m_nTime += nCount;
+				nDone += nCount;
+				if (m_nHeadPos == m_nBlock) {
+					m_pHead->step(m_vecHeadIn.data(), m_vecHeadOut.data());
+					m_nHeadPos = 0;
+				}
+			}
+		}
+
+		// one tail partition handed to the worker and what it made of it; nIn/nOut
+		// say which partition the buffers hold
+		struct tail_slot {
+			std::vector<float> vecIn, vecOut;
+			uint64_t nIn = UINT64_MAX;
+			uint64_t nOut = UINT64_MAX;
+		};
+
+		size_t m_nBlock;
+		size_t m_nTailSize;
+		size_t m_nLength;
+		size_t m_nChannels = 1;
+
+		std::unique_ptr<partitioned_convolver> m_pHead;
+		std::vector<float> m_vecHeadIn, m_vecHeadOut;
+		size_t m_nHeadPos = 0;
+		uint64_t m_nTime = 0;   // frames processed so far
+		uint64_t m_nQuiet = 0;  // of those, how many at the end were silence
+
+		std::unique_ptr<partitioned_convolver> m_pTail;
+		std::vector<float> m_vecTailIn;
+		size_t m_nTailPos = 0;
+		uint64_t m_nTailNext = 0;      // audio thread: index of the tail partition being filled
+		uint64_t m_nTailMissed = UINT64_MAX;
+		tail_slot m_slots[nSlots];
+		std::atomic<uint64_t> m_nTailPosted{ 0 }; // partitions [0, posted) have been handed over
+		std::atomic<uint64_t> m_nTailDone{ 0 };   // partitions [0, done) have been worked out
+		std::atomic<uint64_t> m_nLate{ 0 };
+
+		std::atomic<bool> m_bRunning{ false };
+		std::mutex m_muxTail;
+		std::condition_variable m_cvTail;
+		std::thread m_thread;
+
+		// mixes in the tail output that belongs to the next nCount frames
+		void add_tail(float* pY, size_t nCount) {
+			uint64_t nStart = m_nBlock + 2 * m_nTailSize; // when the first tail output is due
+			if (m_nTime < nStart)
+				return;
+
+			uint64_t nPos = m_nTime - nStart;
+			uint64_t k = nPos / m_nTailSize;
+			size_t nOffset = (size_t)(nPos % m_nTailSize);
+			tail_slot const& slot = m_slots[k % nSlots];
+			if (m_nTailDone.load(std::memory_order_acquire) > k && slot.nOut == k) {
+				for (size_t i = 0; i < nCount; i++)
+					pY[i] += slot.vecOut[nOffset + i];
+			}
+			else if (m_nTailMissed != k) {
+				m_nTailMissed = k;
+				m_nLate++;
+			}
+		}
+
+		// hands the partition just filled to the worker, if its slot is free by now
+		void post_tail() {
+			uint64_t k = m_nTailNext++;
+			tail_slot& slot = m_slots[k % nSlots];
+			if (!m_thread.joinable()) {
+				m_pTail->step(m_vecTailIn.data(), slot.vecOut.data());
+				slot.nOut = k;
+				m_nTailDone.store(k + 1, std::memory_order_release);
+				return;
+			}
+
+			if (m_nTailDone.load(std::memory_order_acquire) + nSlots - 1 < k)
+				return; // the worker is still on the partition that used this slot; it gets silence instead
+
+			std::copy(m_vecTailIn.begin(), m_vecTailIn.end(), slot.vecIn.begin());
+			slot.nIn = k;
+			m_nTailPosted.store(k + 1, std::memory_order_release);
+			m_cvTail.notify_one(); // no lock, the worker also wakes up on its own every few ms
+		}
+
+		void run_tail() {
+			std::vector<float> vecSilence(m_nTailSize, 0.0f);
+			uint64_t nNext = 0;
+			while (m_bRunning) {
+				{
+					std::unique_lock<std::mutex> lock(m_muxTail);
+					m_cvTail.wait_for(lock, std::chrono::milliseconds(2), [&] { return !m_bRunning || m_nTailPosted.load(std::memory_order_acquire) > nNext; });
+				}
+
+				// partitions are done in order; one that wasn't handed over counts as silence
+				uint64_t nPosted = m_nTailPosted.load(std::memory_order_acquire);
+				while (nNext < nPosted) {
+					tail_slot& slot = m_slots[nNext % nSlots];
+					m_pTail->step(slot.nIn == nNext ? slot.vecIn.data() : vecSilence.data(), slot.vecOut.data());
+					slot.nOut = nNext;
+					m_nTailDone.store(++nNext, std::memory_order_release);
+				}
+			}
+		}
+	};
+}
+#endif
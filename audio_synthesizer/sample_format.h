@@ -0,0 +1,110 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace synth {
+	// How samples are stored once they leave the float mix, for the sound card
+	// and for .wav files alike. All little endian, pcm24 packed into 3 bytes
+	enum class sample_format {
+		pcm16, pcm24, pcm32, float32
+	};
+
+	inline unsigned int bytes_per_sample(sample_format eFormat) {
+		return eFormat == sample_format::pcm16 ? 2 : (eFormat == sample_format::pcm24 ? 3 : 4);
+	}
+
+	// 24 bit samples as the device wants them, three bytes with no padding
+	struct int24_packed {
+		uint8_t b[3];
+	};
+
+	// The format behind each sample type olcNoiseMaker can be built with
+	template<class T> struct sample_traits;
+	template<> struct sample_traits<int16_t> { static const sample_format format = sample_format::pcm16; };
+	template<> struct sample_traits<int24_packed> { static const sample_format format = sample_format::pcm24; };
+	template<> struct sample_traits<int32_t> { static const sample_format format = sample_format::pcm32; };
+	template<> struct sample_traits<float> { static const sample_format format = sample_format::float32; };
+
+	// Float samples in -1..1 to any sample_format. Integer formats are rounded
+	// to the nearest step and clamped to full scale; float keeps its overs.
+	// With dither on, TPDF noise of +-1 step (two uniform randoms added, one
+	// xorshift draw split in half) goes on before rounding, so the rounding
+	// error is noise instead of distortion that follows the signal. The noise
+	// comes from a fixed seed, so renders still repeat exactly. Works through
+	// a chunk at a time: first the dither, then scaling, clamping and rounding
+	// in plain loops the compiler can vectorize, and the packing last.
+	class sample_converter {
+	public:
+		sample_converter(sample_format eFormat = sample_format::pcm16, bool bDither = false) : m_eFormat(eFormat), m_bDither(bDither) {}
+
+		sample_format format() const { return m_eFormat; }
+		unsigned int bytes_per_sample() const { return synth::bytes_per_sample(m_eFormat); }
+
+		// dither only ever applies to the integer formats
+		void set_dither(bool bDither) { m_bDither = bDither; }
+		bool dither() const { return m_bDither && m_eFormat != sample_format::float32; }
+
+		// nSamples floats from pIn to nSamples * bytes_per_sample() bytes at pOut
+		void convert(const float* pIn, size_t nSamples, void* pOut) {
+			uint8_t* p = (uint8_t*)pOut;
+			if (m_eFormat == sample_format::float32) {
+				memcpy(p, pIn, nSamples * sizeof(float));
+				return;
+			}
+
+			// the integer full scale, symmetric so +1.0 and -1.0 both fit
+			double dScale = m_eFormat == sample_format::pcm16 ? 32767.0 : (m_eFormat == sample_format::pcm24 ? 8388607.0 : 2147483647.0);
+			int32_t nChunk[nChunkSize];
+			for (size_t nDone = 0; nDone < nSamples; nDone += nChunkSize) {
+				size_t n = std::min(nChunkSize, nSamples - nDone);
+				const float* pChunk = pIn + nDone;
+
+				float fDither[nChunkSize];
+				if (dither())
+					for (size_t i = 0; i < n; i++)
+						fDither[i] = next_dither();
+				else
+					std::fill(fDither, fDither + n, 0.0f);
+
+				if (m_eFormat == sample_format::pcm16) {
+					float fScale = (float)dScale;
+					for (size_t i = 0; i < n; i++) {
+						float f = std::min(fScale, std::max(-fScale, pChunk[i] * fScale + fDither[i]));
+						nChunk[i] = (int32_t)lrintf(f);
+					}
+				}
+				else {
+					// past 16 bits a float product would round before lrint does, double is exact
+					for (size_t i = 0; i < n; i++) {
+						double d = std::min(dScale, std::max(-dScale, (double)pChunk[i] * dScale + fDither[i]));
+						nChunk[i] = (int32_t)lrint(d);
+					}
+				}
+
+				unsigned int nBytes = bytes_per_sample();
+				for (size_t i = 0; i < n; i++) {
+					uint32_t u = (uint32_t)nChunk[i];
+					for (unsigned int b = 0; b < nBytes; b++)
+						*p++ = (uint8_t)(u >> (8 * b));
+				}
+			}
+		}
+
+	private:
+		static constexpr size_t nChunkSize = 256;
+
+		sample_format m_eFormat;
+		bool m_bDither;
+		uint32_t m_nNoise = 0x9e3779b9u;
+
+		// triangular between -1 and +1 steps
+		float next_dither() {
+			m_nNoise ^= m_nNoise << 13;
+			m_nNoise ^= m_nNoise >> 17;
+			m_nNoise ^= m_nNoise << 5;
+			return (float)((int32_t)(m_nNoise & 0xffff) + (int32_t)(m_nNoise >> 16) - 65535) * (1.0f / 65536.0f);
+		}
+	};
+}
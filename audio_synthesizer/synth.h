@@ -1,46 +1,177 @@
 #pragma once
 #include "noisemaker.h"
+#include "wavetable.h"
+#include "noise.h"
+#include "filter.h"
 
 #define w(f) (f * 2 * PI)
 
 namespace synth {
-	struct note {
-		int id = -1; // position in scale
-		double pressed = 0.0; // time note was pressed
-		double released = 0.0; // time note was released
-		bool active = false;
-		int channel = -1;
-	};
-
 	enum osc_types {
 		sine, square, triangle, saw, noise
 	};
 
-	double oscillate(double dFrequency, double dTime, osc_types eType = osc_types::sine, double dLFOFrequency = 0.0, double dLFOAmplitude = 0.0) { // LFO = low frequency oscillator
+	// dSampleRate only picks the band-limited table, so it should be the rate dTime is stepped at
+	double oscillate(double dFrequency, double dTime, osc_types eType = osc_types::sine, double dLFOFrequency = 0.0, double dLFOAmplitude = 0.0, double dSampleRate = 44100.0) { // LFO = low frequency oscillator
 		double base_frequency = w(dFrequency) * dTime
 			+ dLFOAmplitude * dFrequency * sin(w(dLFOFrequency) * dTime);
 		
+		// saw, square and triangle come from the band-limited tables
+		double dPhase = base_frequency / (2.0 * PI);
+		dPhase -= floor(dPhase);
+		double dIncrement = dFrequency / dSampleRate;
+
 		switch (eType) {
 		case osc_types::sine:
 			return sin(base_frequency);
 		case osc_types::square:
-			return sin(base_frequency) > 0 ? 1 : -1;
+			return wavetables::get().lookup(wavetables::square, dPhase, dIncrement);
 		case osc_types::triangle:
-			return asin(sin(base_frequency)) * (2.0 / PI);
+			return wavetables::get().lookup(wavetables::triangle, dPhase, dIncrement);
 		case osc_types::saw:
+			return wavetables::get().lookup(wavetables::saw, dPhase, dIncrement);
+		case osc_types::noise:
 		{
-			double dOutput = 0;
-			for (double n = 1; n < 50; n++)
-				dOutput += sin(n * base_frequency) / n;
-			return dOutput * (2.0 / PI);
+			static thread_local noise_generator noiseShared;
+			return noiseShared.next();
 		}
-		case osc_types::noise:
-			return 2 * ((float)rand() / (float)RAND_MAX) - 1;
 
 		default: return 0;
 		}
 	}
 
+	// Stateful oscillator. Carries a normalised phase (0..1) and a per-sample
+	// increment instead of recomputing everything from absolute time, so the
+	// cost per sample is constant and precision doesn't drift over long sessions
+	struct oscillator {
+		osc_types eType = osc_types::sine;
+		double dAmplitude = 0.0;
+		double dPhase = 0.0; // 0..1
+		double dIncrement = 0.0; // phase advance per sample (frequency / sample rate)
+
+		// phase modulation, same meaning as the LFO arguments of oscillate()
+		double dLFOPhase = 0.0;
+		double dLFOIncrement = 0.0;
+		double dLFODepth = 0.0; // peak phase deviation in cycles
+
+		// saw and square use PolyBLEP edges instead of the wavetables when set
+		bool bPolyBLEP = false;
+
+		// this voice's own noise source for osc_types::noise, seeded by the instrument
+		noise_generator noise;
+
+		// for osc_types::noise eNoise picks the colour, and band-limited noise changes value dFrequency times a second
+		void set(osc_types type, double dAmp, double dFrequency, double dSampleRate, double dLFOFrequency = 0.0, double dLFOAmplitude = 0.0, noise_types eNoise = noise_types::white) {
+			eType = type;
+			noise.eType = eNoise;
+			dAmplitude = dAmp;
+			dPhase = 0.0;
+			dLFOPhase = 0.0;
+			set_frequency(dFrequency, dSampleRate);
+			set_lfo(dLFOFrequency, dLFOAmplitude, dFrequency, dSampleRate);
+		}
+
+		// only the increment changes, the phase carries on so there is no click
+		void set_frequency(double dFrequency, double dSampleRate) {
+			dIncrement = dFrequency / dSampleRate;
+			noise.set_rate(dFrequency, dSampleRate);
+		}
+
+		void set_lfo(double dLFOFrequency, double dLFOAmplitude, double dFrequency, double dSampleRate) {
+			dLFOIncrement = dLFOFrequency / dSampleRate;
+			dLFODepth = dLFOAmplitude * dFrequency / (2.0 * PI);
+		}
+
+		// waveform value for a phase in 0..1, band-limited for the current increment
+		double shape(double dPh) {
+			switch (eType) {
+			case osc_types::sine:
+				return wavetables::get().sine(dPh);
+			case osc_types::square:
+				if (bPolyBLEP)
+					return polyblep_square(dPh, dIncrement);
+				return wavetables::get().lookup(wavetables::square, dPh, dIncrement);
+			case osc_types::triangle:
+				return wavetables::get().lookup(wavetables::triangle, dPh, dIncrement);
+			case osc_types::saw:
+				if (bPolyBLEP)
+					return polyblep_saw(dPh, dIncrement);
+				return wavetables::get().lookup(wavetables::saw, dPh, dIncrement);
+			case osc_types::noise:
+				return noise.next();
+
+			default: return 0;
+			}
+		}
+
+		double next() {
+			double dPh = dPhase;
+			if (dLFODepth != 0.0) {
+				dPh += dLFODepth * wavetables::get().sine(dLFOPhase);
+				dPh -= floor(dPh);
+				dLFOPhase += dLFOIncrement;
+				if (dLFOPhase >= 1.0) dLFOPhase -= 1.0;
+			}
+
+			dPhase += dIncrement;
+			if (dPhase >= 1.0) dPhase -= 1.0;
+
+			return shape(dPh);
+		}
+
+		// adds nFrames of output into pOut
+		void process(float* pOut, size_t nFrames) {
+			if (dAmplitude == 0.0)
+				return;
+
+			if (eType == osc_types::sine && dLFODepth == 0.0) { // the common case, keep it tight
+				const float* pSine = wavetables::get().sine_table();
+				for (size_t i = 0; i < nFrames; i++) {
+					pOut[i] += (float)dAmplitude * wavetables::read(pSine, dPhase);
+					dPhase += dIncrement;
+					if (dPhase >= 1.0) dPhase -= 1.0;
+				}
+				return;
+			}
+
+			if (eType == osc_types::noise) {
+				float fNoise[64];
+				for (size_t nDone = 0; nDone < nFrames; nDone += 64) {
+					size_t nCount = min((size_t)64, nFrames - nDone);
+					noise.fill(fNoise, nCount);
+					for (size_t i = 0; i < nCount; i++)
+						pOut[nDone + i] += (float)dAmplitude * fNoise[i];
+				}
+				return;
+			}
+
+			if (dLFODepth == 0.0 && !bPolyBLEP && (eType == osc_types::saw || eType == osc_types::square || eType == osc_types::triangle)) {
+				// the increment is fixed for the block, so the mip level is too
+				wavetables::shape eShape = eType == osc_types::saw ? wavetables::saw : (eType == osc_types::square ? wavetables::square : wavetables::triangle);
+				const float* pTable = wavetables::get().table(eShape, dIncrement);
+				for (size_t i = 0; i < nFrames; i++) {
+					pOut[i] += (float)dAmplitude * wavetables::read(pTable, dPhase);
+					dPhase += dIncrement;
+					if (dPhase >= 1.0) dPhase -= 1.0;
+				}
+				return;
+			}
+
+			for (size_t i = 0; i < nFrames; i++)
+				pOut[i] += (float)(dAmplitude * next());
+		}
+
+		// same as process() but with a per-sample frequency multiplier, for FM / pitch bends
+		void process(float* pOut, size_t nFrames, const float* pFrequencyRatio) {
+			double dBaseIncrement = dIncrement;
+			for (size_t i = 0; i < nFrames; i++) {
+				dIncrement = dBaseIncrement * pFrequencyRatio[i];
+				pOut[i] += (float)(dAmplitude * next());
+			}
+			dIncrement = dBaseIncrement;
+		}
+	};
+
 	struct envelope {
 		virtual double amplitude(double dTime, double dTimePressed, double dTimeReleased) = 0;
 	};
@@ -104,262 +235,315 @@ namespace synth {
 		return env.amplitude(dTime, dTimePressed, dTimeReleased);
 	}
 
-	struct instrument_base {
-		double dVolume;
-		synth::envelope_adsr env;
-		virtual double sound(double dTime, synth::note n, bool& bNoteFinished) = 0;
+	enum class env_curve {
+		linear, exponential
 	};
 
-	struct instrument_harmonica : public instrument_base {
-		instrument_harmonica()
-		{
-			env.dAttackTime = 0.05;
-			env.dDecayTime = 1.0;
-			env.dSustainAmplitude = 0.95;
-			env.dReleaseTime = 0.1;
-
-			dVolume = 1.0;
+	// Stateful ADSR. Instead of working the segment out from note times every
+	// sample, it keeps the current level and moves it with one multiply-add per
+	// sample (level = level * mul + add), switching stage exactly when a segment
+	// boundary is reached. Finished means the release really got to zero.
+	struct envelope_generator {
+		enum stage {
+			idle, attack, decay, sustain, release
+		};
+
+		stage eStage = idle;
+		double dLevel = 0.0;
+
+		void set(envelope_adsr const& adsr, double dSampleRate, env_curve eCurveType = env_curve::linear) {
+			dAttackSamples = adsr.dAttackTime * dSampleRate;
+			dDecaySamples = adsr.dDecayTime * dSampleRate;
+			dReleaseSamples = adsr.dReleaseTime * dSampleRate;
+			dStartAmplitude = adsr.dStartAmplitude;
+			dSustainAmplitude = adsr.dSustainAmplitude;
+			eCurve = eCurveType;
 		}
 
-		virtual double sound(const double dTime, synth::note n, bool& bNoteFinished)
-		{
-			double dAmplitude = synth::env(dTime, env, n.pressed, n.released);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
-
-			double dSound =
-				+ 0.1 * oscillate(220, n.pressed - dTime, osc_types::square);
-
-			return dAmplitude * dSound * dVolume;
+		// (re)starts the attack from wherever the level is now, so retriggers don't click
+		void note_on() {
+			enter(attack);
 		}
-	};
-
-	struct instrument_synth1 : public instrument_base {
-		instrument_synth1()
-		{
-			env.dAttackTime = 0.1;
-			env.dDecayTime = 0.2;
-			env.dSustainAmplitude = 0.8;
-			env.dReleaseTime = 0.1;
 
-			dVolume = 0.8;
+		void note_off() {
+			if (eStage != idle)
+				enter(release);
 		}
 
-		virtual double sound(const double dTime, synth::note n, bool& bNoteFinished)
-		{
-			double dAmplitude = synth::env(dTime, env, n.pressed, n.released);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
-
-			double dSound = (
-				+0.1 * oscillate(220, dTime, osc_types::square)
-				+ 1 * oscillate(50, dTime, osc_types::sine)
-				+ 1 * oscillate(25, dTime, osc_types::sine)
-				+ 0.01 * oscillate(500, dTime, osc_types::noise)
-				);
+		bool finished() const { return eStage == idle; }
 
-			return dAmplitude * dSound * dVolume;
+		double next() {
+			float fGain;
+			process(&fGain, 1);
+			return fGain;
 		}
-	};
 
-	struct instrument_synth2 : public instrument_base {
-		instrument_synth2()
-		{
-			env.dAttackTime = 0.1;
-			env.dDecayTime = 0.2;
-			env.dSustainAmplitude = 0.8;
-			env.dReleaseTime = 0.1;
-
-			dVolume = 0.8;
+		// writes the gain for each of the next nFrames samples
+		void process(float* pGains, size_t nFrames) {
+			size_t i = 0;
+			while (i < nFrames) {
+				if (eStage == idle || eStage == sustain) {
+					fill(pGains + i, pGains + nFrames, (float)dLevel);
+					return;
+				}
+
+				// run the segment up to its boundary or the end of the block
+				size_t nRun = nFrames - i;
+				bool bBoundary = false;
+				if (dRemaining < (double)nRun) {
+					nRun = (size_t)dRemaining;
+					bBoundary = true;
+				}
+				for (size_t k = 0; k < nRun; k++) {
+					dLevel = dLevel * dMul + dAdd;
+					pGains[i++] = (float)dLevel;
+				}
+				dRemaining -= (double)nRun;
+
+				if (bBoundary) {
+					dLevel = dTarget; // land on it exactly
+					if (i < nFrames)
+						pGains[i++] = (float)dLevel;
+					enter(eStage == attack ? decay : (eStage == decay ? sustain : idle));
+				}
+			}
 		}
 
-		virtual double sound(const double dTime, synth::note n, bool& bNoteFinished)
-		{
-			double dAmplitude = synth::env(dTime, env, n.pressed, n.released);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
+	private:
+		double dAttackSamples = 0.0;
+		double dDecaySamples = 0.0;
+		double dReleaseSamples = 0.0;
+		double dStartAmplitude = 1.0;
+		double dSustainAmplitude = 1.0;
+		env_curve eCurve = env_curve::linear;
+
+		// current segment: where it's heading and how many samples it has left
+		double dTarget = 0.0;
+		double dRemaining = 0.0;
+		double dMul = 1.0;
+		double dAdd = 0.0;
+
+		void enter(stage eNext) {
+			eStage = eNext;
+			double dSamples = 0.0;
+			switch (eNext) {
+			case attack: dTarget = dStartAmplitude; dSamples = dAttackSamples * fabs(dStartAmplitude - dLevel) / (dStartAmplitude > 0.0 ? dStartAmplitude : 1.0); break;
+			case decay: dTarget = dSustainAmplitude; dSamples = dDecaySamples; break;
+			case release: dTarget = 0.0; dSamples = dReleaseSamples; break;
+			case sustain: dLevel = dSustainAmplitude; return;
+			case idle: dLevel = 0.0; return;
+			}
 
-			double dSound = (
-				+ 0.1 * oscillate(140, dTime, osc_types::square)
-				+ 1 * oscillate(50, dTime, osc_types::sine)
-				+ 1 * oscillate(25, dTime, osc_types::sine)
-				+ 0.01 * oscillate(500, dTime, osc_types::noise)
-				);
+			if (dSamples < 1.0 || dLevel == dTarget) { // nothing to ramp, go straight on
+				dLevel = dTarget;
+				enter(eNext == attack ? decay : (eNext == decay ? sustain : idle));
+				return;
+			}
 
-			return dAmplitude * dSound * dVolume;
+			dRemaining = ceil(dSamples) - 1.0; // the boundary sample itself is written on landing
+			if (eCurve == env_curve::linear) {
+				dMul = 1.0;
+				dAdd = (dTarget - dLevel) / ceil(dSamples);
+			}
+			else {
+				// one-pole towards a point a bit past the target so it gets there in dSamples
+				const double dOvershoot = 0.01;
+				double dAim = dTarget + (dTarget - dLevel) * dOvershoot;
+				dMul = pow(dOvershoot / (1.0 + dOvershoot), 1.0 / ceil(dSamples));
+				dAdd = dAim * (1.0 - dMul);
+			}
 		}
 	};
 
-	struct instrument_synth3 : public instrument_base {
-		instrument_synth3()
-		{
-			env.dAttackTime = 0.1;
-			env.dDecayTime = 0.2;
-			env.dSustainAmplitude = 0.8;
-			env.dReleaseTime = 0.1;
-
-			dVolume = 0.8;
-		}
-
-		virtual double sound(const double dTime, synth::note n, bool& bNoteFinished)
-		{
-			/*double dAmplitude = synth::env(dTime, env, n.pressed, n.released);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
-
-			double dSound = (
-				+ 0.6 * oscillate(550, dTime, osc_types::triangle)
-				+ 0.3 * oscillate(200, dTime, osc_types::sine)
-				+ .2 * oscillate(50, dTime, osc_types::square)
-				+ .2 * oscillate(25, dTime, osc_types::square)
-				+ 0.01 * oscillate(500, dTime, osc_types::noise)
-				);
-
-			return dAmplitude * dSound * dVolume;*/
-
-			double dAmplitude = synth::env(dTime, env, n.pressed, n.released);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
-
-			// Generate the raw sound
-			double dSound =
-				+0.1 * oscillate(220, n.pressed - dTime, osc_types::square);
+	const int nMaxOscillators = 8;
 
-
-			// Adjust amplitude and volume
-			dSound *= dAmplitude * dVolume;
-
-			return dSound;
-		}
+	struct note {
+		int id = -1; // position in scale
+		uint64_t pressed = 0; // frame note was pressed
+		uint64_t released = 0; // frame note was released
+		bool active = false;
+		int channel = -1;
+		uint64_t nSeed = 0; // seeds the voice's noise, so the same notes always sound the same
+
+		// per-voice oscillator and envelope state, set up by the instrument when the note starts
+		oscillator osc[nMaxOscillators];
+		int nOscillators = 0;
+		envelope_generator env;
+		voice_filter filter;
+		double dVolume = 1.0;
+		double dPan = 0.0; // -1 first channel .. +1 last channel
 	};
 
-	struct instrument_ethereal_pad : public instrument_base {
-		instrument_ethereal_pad() {
-			env.dAttackTime = 2.0;        // Slow attack for a gradual onset
-			env.dDecayTime = 4.0;         // A slow decay for a fading effect
-			env.dSustainAmplitude = 0.5; // Sustain at a moderate level
-			env.dReleaseTime = 5.0;       // Slow release for a smooth fade-out
-			dVolume = 0.5;                // Adjust the volume to your liking
-		}
-
-		virtual double sound(const double dTime, synth::note n, bool& bNoteFinished) {
-			double dAmplitude = synth::env(dTime, env, n.pressed, n.released);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
-
-			// Generate the raw sound with a combination of sine and triangle waves
-			double dSound =
-				+0.5 * oscillate(220, dTime, osc_types::sine)
-				+ 0.3 * oscillate(330, dTime, osc_types::sine)
-				+ 0.2 * oscillate(440, dTime, osc_types::triangle);
-
-			// Apply amplitude and volume
-			dSound *= dAmplitude * dVolume;
-
-			return dSound;
-		}
+	// One oscillator of an instrument, exactly what note_on sets up on the voice
+	struct partial {
+		osc_types eType;
+		double dAmplitude;
+		double dFrequency;
+		double dLFOFrequency = 0.0;
+		double dLFOAmplitude = 0.0;
+		noise_types eNoise = noise_types::white; // osc_types::noise only
 	};
 
-	struct instrument_celestial_pad : public instrument_base {
-		instrument_celestial_pad() {
-			env.dAttackTime = 3.0;         // Slow attack for gradual onset
-			env.dDecayTime = 6.0;          // Slow decay for a fading effect
-			env.dSustainAmplitude = 0.6;  // Sustain at a moderate level
-			env.dReleaseTime = 8.0;        // Slow release for a smooth fade-out
-			dVolume = 0.5;                 // Adjust the volume to your liking
-		}
-
-		virtual double sound(const double dTime, synth::note n, bool& bNoteFinished) {
-			double dAmplitude = synth::env(dTime, env, n.pressed, n.released);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
-
-			// Generate the celestial pad sound with a combination of sine and triangle waves
-			double dSound =
-				+0.4 * oscillate(150, dTime, osc_types::sine)
-				+ 0.3 * oscillate(220, dTime, osc_types::sine)
-				+ 0.2 * oscillate(330, dTime, osc_types::triangle);
-
-			// Apply amplitude and volume
-			dSound *= dAmplitude * dVolume;
-
-			return dSound;
-		}
+	// An instrument is just data: a flat list of partials, an envelope, a
+	// filter and a volume. Nothing about it is virtual; every voice of every
+	// instrument renders through the same render_voice() loop. Voices copy what
+	// they need in note_on and never look at the def again, so a def can be
+	// replaced (patch reload) while its old notes ring out.
+	struct instrument_def {
+		const char* sName;
+		double dVolume;
+		double dAttackTime;
+		double dDecayTime;
+		double dSustainAmplitude;
+		double dReleaseTime;
+		env_curve eCurve;
+		const partial* pPartials;
+		int nPartials;
+		filter_types eFilter;
+		double dFilterCutoff;
+		double dFilterResonance;
+		filter_topologies eFilterTopology;
+		double dPan;
 	};
 
-	struct instrument_classic_piano : public instrument_base {
-		instrument_classic_piano() {
-			env.dAttackTime = 0.1;       // Quick attack for a piano-like response
-			env.dDecayTime = 0.4;        // Moderate decay for a natural piano sound
-			env.dSustainAmplitude = 0.6; // Sustain at a moderate level
-			env.dReleaseTime = 0.3;      // Medium release for smooth note endings
-			dVolume = 0.8;               // Adjust the volume to your liking
-		}
-
-		virtual double sound(const double dTime, synth::note n, bool& bNoteFinished) {
-			double dAmplitude = synth::env(dTime, env, n.pressed, n.released);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
-
-			// Generate a classic piano sound with a combination of sine waves
-			double dSound =
-				+0.8 * oscillate(440, dTime, osc_types::sine)
-				+ 0.2 * oscillate(880, dTime, osc_types::sine);
-
-			// Apply amplitude and volume
-			dSound *= dAmplitude * dVolume;
+	// builds an instrument_def around a constexpr partial table, checking it fits a note
+	template<size_t N>
+	constexpr instrument_def make_instrument(const char* sName, double dVolume, double dAttackTime, double dDecayTime, double dSustainAmplitude, double dReleaseTime, const partial(&partials)[N], env_curve eCurve = env_curve::linear) {
+		static_assert(N <= nMaxOscillators, "an instrument can't have more partials than a note has oscillators");
+		return instrument_def{ sName, dVolume, dAttackTime, dDecayTime, dSustainAmplitude, dReleaseTime, eCurve, partials, (int)N, filter_types::none, 0.0, 0.707, filter_topologies::svf, 0.0 };
+	}
 
-			return dSound;
+	// Creates the voice state for a new note and starts its envelope. The first
+	// partial is taken as the instrument's fundamental: with dFrequency set it
+	// is moved there and the rest follow in proportion, so the sound keeps its
+	// shape at any pitch
+	inline void note_on(instrument_def const& inst, synth::note& n, double dSampleRate, double dFrequency = 0.0) {
+		double dRatio = dFrequency > 0.0 && inst.nPartials > 0 && inst.pPartials[0].dFrequency > 0.0 ? dFrequency / inst.pPartials[0].dFrequency : 1.0;
+		n.dVolume = inst.dVolume;
+		n.dPan = inst.dPan;
+		n.filter.set(inst.eFilter, inst.dFilterCutoff, inst.dFilterResonance, dSampleRate, inst.eFilterTopology);
+		n.nOscillators = inst.nPartials;
+		for (int o = 0; o < inst.nPartials; o++) {
+			partial const& p = inst.pPartials[o];
+			n.osc[o].set(p.eType, p.dAmplitude, p.dFrequency * dRatio, dSampleRate, p.dLFOFrequency, p.dLFOAmplitude, p.eNoise);
+			n.osc[o].noise.seed(n.nSeed * nMaxOscillators + o);
 		}
-	};
 
-	struct instrument_epic_choir : public instrument_base {
-		instrument_epic_choir() {
-			env.dAttackTime = 2.0;        // Slow attack for a grand choir entrance
-			env.dDecayTime = 3.0;         // Longer decay for expressive dynamics
-			env.dSustainAmplitude = 0.6; // Sustain at a moderate level
-			env.dReleaseTime = 2.0;       // Medium release for smooth note endings
-			dVolume = 0.7;                // Adjust the volume to your liking
-		}
+		envelope_adsr adsr;
+		adsr.dAttackTime = inst.dAttackTime;
+		adsr.dDecayTime = inst.dDecayTime;
+		adsr.dSustainAmplitude = inst.dSustainAmplitude;
+		adsr.dReleaseTime = inst.dReleaseTime;
+		n.env.set(adsr, dSampleRate, inst.eCurve);
+		n.env.note_on();
+	}
 
-		virtual double sound(const double dTime, synth::note n, bool& bNoteFinished) {
-			double dAmplitude = synth::env(dTime, env, n.pressed, n.released);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
+	// adds nFrames of the note into pOut (mono); the note is done once n.env.finished()
+	inline void render_voice(synth::note& n, float* pOut, size_t nFrames) {
+		const size_t nChunk = 64;
+		float fWave[nChunk];
+		float fGain[nChunk];
+		float fVolume = (float)n.dVolume;
 
-			// Generate an epic choir-like sound with a combination of sine waves
-			double dSound =
-				+0.7 * oscillate(220, dTime, osc_types::sine)
-				+ 0.3 * oscillate(330, dTime, osc_types::sine)
-				+ 0.2 * oscillate(440, dTime, osc_types::saw)  // Add a sawtooth wave for a vibrant texture
-				+ 0.1 * oscillate(550, dTime, osc_types::triangle);  // Add a triangle wave for variation
+		for (size_t nDone = 0; nDone < nFrames; nDone += nChunk) {
+			size_t nCount = min(nChunk, nFrames - nDone);
 
-			// Apply amplitude and volume
-			dSound *= dAmplitude * dVolume;
+			fill(fWave, fWave + nCount, 0.0f);
+			for (int o = 0; o < n.nOscillators; o++)
+				n.osc[o].process(fWave, nCount);
+			n.filter.process(fWave, nCount);
 
-			return dSound;
+			n.env.process(fGain, nCount);
+			for (size_t i = 0; i < nCount; i++)
+				pOut[nDone + i] += fGain[i] * fWave[i] * fVolume;
 		}
-	};
-
-	struct instrument_analog_pad : public instrument_base {
-		double dVolume;
+	}
 
-		instrument_analog_pad() {
-			dVolume = 0.6;  // Adjust the volume to your liking
-			env.dAttackTime = 2.0; // Adjust the attack time (in seconds)
-			env.dDecayTime = 3.0;  // Adjust the decay time (in seconds)
-			env.dSustainAmplitude = 0.6;
-			env.dReleaseTime = 2.0; // Adjust the release time (in seconds)
+	// Constant-power pan: how much of a voice at dPan goes to each of
+	// nChannels outputs. The channels are taken as a row of speakers from -1 to
+	// +1 and a voice sits between the two nearest, cos/sin shared so the power
+	// stays the same wherever it is; with two channels that's the usual stereo
+	// pan law. Mono always gets all of it
+	inline void pan_gains(double dPan, size_t nChannels, float* fGains) {
+		std::fill(fGains, fGains + nChannels, 0.0f);
+		if (nChannels == 1) {
+			fGains[0] = 1.0f;
+			return;
 		}
 
-		virtual double sound(const double dTime, synth::note n, bool& bNoteFinished) {
-			double dAmplitude = synth::env(dTime, env, n.pressed, n.released);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
-
-			// Create an evolving pad sound using multiple oscillators and modulation
-			double dSound = (
-				+0.4 * oscillate(220, dTime, osc_types::sine)
-				+ 0.3 * oscillate(440, dTime, osc_types::sine)
-				+ 0.2 * oscillate(880, dTime, osc_types::sine)
-				+ 0.1 * oscillate(1760, dTime, osc_types::sine)
-				);
-
-			// Apply amplitude and volume
-			dSound *= dAmplitude * dVolume;
+		double dPos = (std::min(1.0, std::max(-1.0, dPan)) + 1.0) * 0.5 * (double)(nChannels - 1);
+		size_t nLeft = std::min((size_t)dPos, nChannels - 2);
+		double dAngle = (dPos - (double)nLeft) * PI * 0.5;
+		fGains[nLeft] = (float)cos(dAngle);
+		fGains[nLeft + 1] = (float)sin(dAngle);
+	}
 
-			return dSound;
-		}
-	};
+	namespace instruments {
+		constexpr partial harmonica_partials[] = {
+			{ osc_types::square, 0.1, 220 },
+		};
+		constexpr instrument_def harmonica = make_instrument("harmonica", 1.0, 0.05, 1.0, 0.95, 0.1, harmonica_partials);
+
+		constexpr partial synth1_partials[] = {
+			{ osc_types::square, 0.1, 220 },
+			{ osc_types::sine, 1, 50 },
+			{ osc_types::sine, 1, 25 },
+			{ osc_types::noise, 0.01, 500 },
+		};
+		constexpr instrument_def synth1 = make_instrument("synth1", 0.8, 0.1, 0.2, 0.8, 0.1, synth1_partials);
+
+		constexpr partial synth2_partials[] = {
+			{ osc_types::square, 0.1, 140 },
+			{ osc_types::sine, 1, 50 },
+			{ osc_types::sine, 1, 25 },
+			{ osc_types::noise, 0.01, 500 },
+		};
+		constexpr instrument_def synth2 = make_instrument("synth2", 0.8, 0.1, 0.2, 0.8, 0.1, synth2_partials);
+
+		// was: triangle 0.6 550, sine 0.3 200, square .2 50, square .2 25, noise 0.01 500
+		constexpr partial synth3_partials[] = {
+			{ osc_types::square, 0.1, 220 },
+		};
+		constexpr instrument_def synth3 = make_instrument("synth3", 0.8, 0.1, 0.2, 0.8, 0.1, synth3_partials);
+
+		// sine and triangle, slow attack for a gradual onset and a slow release for a smooth fade-out
+		constexpr partial ethereal_pad_partials[] = {
+			{ osc_types::sine, 0.5, 220 },
+			{ osc_types::sine, 0.3, 330 },
+			{ osc_types::triangle, 0.2, 440 },
+		};
+		constexpr instrument_def ethereal_pad = make_instrument("ethereal_pad", 0.5, 2.0, 4.0, 0.5, 5.0, ethereal_pad_partials);
+
+		constexpr partial celestial_pad_partials[] = {
+			{ osc_types::sine, 0.4, 150 },
+			{ osc_types::sine, 0.3, 220 },
+			{ osc_types::triangle, 0.2, 330 },
+		};
+		constexpr instrument_def celestial_pad = make_instrument("celestial_pad", 0.5, 3.0, 6.0, 0.6, 8.0, celestial_pad_partials);
+
+		// quick attack for a piano-like response
+		constexpr partial classic_piano_partials[] = {
+			{ osc_types::sine, 0.8, 440 },
+			{ osc_types::sine, 0.2, 880 },
+		};
+		constexpr instrument_def classic_piano = make_instrument("classic_piano", 0.8, 0.1, 0.4, 0.6, 0.3, classic_piano_partials);
+
+		// a sawtooth for a vibrant texture and a triangle for variation
+		constexpr partial epic_choir_partials[] = {
+			{ osc_types::sine, 0.7, 220 },
+			{ osc_types::sine, 0.3, 330 },
+			{ osc_types::saw, 0.2, 440 },
+			{ osc_types::triangle, 0.1, 550 },
+		};
+		constexpr instrument_def epic_choir = make_instrument("epic_choir", 0.7, 2.0, 3.0, 0.6, 2.0, epic_choir_partials);
+
+		constexpr partial analog_pad_partials[] = {
+			{ osc_types::sine, 0.4, 220 },
+			{ osc_types::sine, 0.3, 440 },
+			{ osc_types::sine, 0.2, 880 },
+			{ osc_types::sine, 0.1, 1760 },
+		};
+		constexpr instrument_def analog_pad = make_instrument("analog_pad", 0.6, 2.0, 3.0, 0.6, 2.0, analog_pad_partials);
+	}
 
-}
\ No newline at end of file
+}
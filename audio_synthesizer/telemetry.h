@@ -0,0 +1,187 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+
+namespace synth {
+	// Counts of values in fixed buckets between dLow and dHigh, evenly spaced or
+	// (bLog) spaced by a constant ratio; a value right on an edge counts in the
+	// bucket below it, anything outside lands in the first or last one. One
+	// thread records, any number read, nothing locks: every bucket is its own
+	// atomic and all the buckets are allocated up front. A reader racing the
+	// writer may see a count a record or two behind, never a torn one.
+	class histogram {
+	public:
+		histogram(double dLow, double dHigh, size_t nBuckets, bool bLog = false)
+			: m_dLow(dLow), m_dHigh(dHigh), m_nBuckets(std::max((size_t)1, nBuckets)), m_bLog(bLog),
+			  m_pCounts(new std::atomic<uint64_t>[m_nBuckets]) {
+			m_dScale = m_bLog ? (double)m_nBuckets / log(m_dHigh / m_dLow) : (double)m_nBuckets / (m_dHigh - m_dLow);
+			clear();
+		}
+
+		// writer; call from one thread only
+		void record(double dValue) {
+			m_pCounts[bucket(dValue)].fetch_add(1, std::memory_order_relaxed);
+			m_nCount.fetch_add(1, std::memory_order_relaxed);
+			m_dSum.store(m_dSum.load(std::memory_order_relaxed) + dValue, std::memory_order_relaxed);
+			if (dValue > m_dMax.load(std::memory_order_relaxed))
+				m_dMax.store(dValue, std::memory_order_relaxed);
+		}
+
+		// not while the writer is recording
+		void clear() {
+			for (size_t i = 0; i < m_nBuckets; i++)
+				m_pCounts[i] = 0;
+			m_nCount = 0;
+			m_dSum = 0.0;
+			m_dMax = 0.0;
+		}
+
+		uint64_t count() const { return m_nCount.load(std::memory_order_relaxed); }
+		double max() const { return m_dMax.load(std::memory_order_relaxed); }
+		double mean() const {
+			uint64_t n = count();
+			return n > 0 ? m_dSum.load(std::memory_order_relaxed) / (double)n : 0.0;
+		}
+
+		// The value dQuantile (0..1) of the records are at or below, as the upper
+		// edge of the bucket it falls in, so it never reads low. Capped at the
+		// largest value actually seen
+		double quantile(double dQuantile) const {
+			uint64_t nTotal = 0;
+			for (size_t i = 0; i < m_nBuckets; i++)
+				nTotal += m_pCounts[i].load(std::memory_order_relaxed);
+			if (nTotal == 0)
+				return 0.0;
+
+			uint64_t nWanted = (uint64_t)ceil(std::min(1.0, std::max(0.0, dQuantile)) * (double)nTotal);
+			uint64_t nSeen = 0;
+			for (size_t i = 0; i < m_nBuckets; i++) {
+				nSeen += m_pCounts[i].load(std::memory_order_relaxed);
+				if (nSeen >= std::max((uint64_t)1, nWanted))
+					return std::min(upper_edge(i), max());
+			}
+			return max();
+		}
+
+		size_t buckets() const { return m_nBuckets; }
+		uint64_t bucket_count(size_t i) const { return m_pCounts[i].load(std::memory_order_relaxed); }
+		double upper_edge(size_t i) const {
+			double d = (double)(i + 1) / m_dScale;
+			return m_bLog ? m_dLow * exp(d) : m_dLow + d;
+		}
+
+	private:
+		double m_dLow, m_dHigh;
+		size_t m_nBuckets;
+		bool m_bLog;
+		double m_dScale; // buckets per unit, or per unit of log for bLog
+		std::unique_ptr<std::atomic<uint64_t>[]> m_pCounts;
+		std::atomic<uint64_t> m_nCount{ 0 };
+		std::atomic<double> m_dSum{ 0.0 };
+		std::atomic<double> m_dMax{ 0.0 };
+
+		size_t bucket(double dValue) const {
+			double d;
+			if (m_bLog)
+				d = dValue > m_dLow ? log(dValue / m_dLow) * m_dScale : 0.0;
+			else
+				d = (dValue - m_dLow) * m_dScale;
+			return d <= 1.0 ? 0 : std::min(m_nBuckets - 1, (size_t)ceil(d) - 1);
+		}
+	};
+
+	// Everything render_telemetry knows at one moment. Times in microseconds,
+	// load is render time over the time the block lasts (1 = used all of it)
+	struct telemetry_snapshot {
+		double dSeconds = 0.0;      // audio rendered so far
+		uint64_t nBlocks = 0;
+		uint64_t nLate = 0;         // blocks that took longer to render than they last
+		uint64_t nUnderruns = 0;    // times the device ran out of blocks
+		double dRenderMean = 0.0, dRenderP50 = 0.0, dRenderP99 = 0.0, dRenderMax = 0.0;
+		double dLoadMean = 0.0, dLoadP50 = 0.0, dLoadP99 = 0.0, dLoadMax = 0.0;
+		double dVoicesMean = 0.0, dVoicesP99 = 0.0, dVoicesMax = 0.0;
+
+		static void write_csv_header(std::ostream& os) {
+			os << "seconds,blocks,late,underruns,render_mean_us,render_p50_us,render_p99_us,render_max_us,"
+				"load_mean,load_p50,load_p99,load_max,voices_mean,voices_p99,voices_max\n";
+		}
+
+		void write_csv(std::ostream& os) const {
+			os << dSeconds << "," << nBlocks << "," << nLate << "," << nUnderruns << ","
+				<< dRenderMean << "," << dRenderP50 << "," << dRenderP99 << "," << dRenderMax << ","
+				<< dLoadMean << "," << dLoadP50 << "," << dLoadP99 << "," << dLoadMax << ","
+				<< dVoicesMean << "," << dVoicesP99 << "," << dVoicesMax << "\n";
+		}
+
+		// one object on one line, so a file of them is JSON Lines
+		void write_json(std::ostream& os) const {
+			os << "{\"seconds\":" << dSeconds << ",\"blocks\":" << nBlocks << ",\"late\":" << nLate << ",\"underruns\":" << nUnderruns
+				<< ",\"render_us\":{\"mean\":" << dRenderMean << ",\"p50\":" << dRenderP50 << ",\"p99\":" << dRenderP99 << ",\"max\":" << dRenderMax << "}"
+				<< ",\"load\":{\"mean\":" << dLoadMean << ",\"p50\":" << dLoadP50 << ",\"p99\":" << dLoadP99 << ",\"max\":" << dLoadMax << "}"
+				<< ",\"voices\":{\"mean\":" << dVoicesMean << ",\"p99\":" << dVoicesP99 << ",\"max\":" << dVoicesMax << "}}\n";
+		}
+	};
+
+	// What the render side is costing. The audio thread calls record_block()
+	// once per block with how long the block took to render, how long it lasts
+	// and how many voices were playing; the device side calls
+	// record_underrun(). Both are a handful of relaxed atomic adds, cheap
+	// enough to leave on all the time. Any other thread takes a snapshot().
+	class render_telemetry {
+	public:
+		// render time from 1 us to 1 s, load from 0.1% to 10x, voices one bucket each from 0 to 256
+		render_telemetry()
+			: m_histRender(1.0, 1e6, 96, true), m_histLoad(0.001, 10.0, 64, true), m_histVoices(-1.0, 256.0, 257) {}
+
+		// audio thread
+		void record_block(double dRenderSeconds, double dBlockSeconds, size_t nVoices) {
+			double dLoad = dBlockSeconds > 0.0 ? dRenderSeconds / dBlockSeconds : 0.0;
+			m_histRender.record(dRenderSeconds * 1e6);
+			m_histLoad.record(dLoad);
+			m_histVoices.record((double)nVoices);
+			if (dLoad > 1.0)
+				m_nLate.fetch_add(1, std::memory_order_relaxed);
+			m_dSeconds.store(m_dSeconds.load(std::memory_order_relaxed) + dBlockSeconds, std::memory_order_relaxed);
+		}
+
+		// device thread
+		void record_underrun() { m_nUnderruns.fetch_add(1, std::memory_order_relaxed); }
+
+		telemetry_snapshot snapshot() const {
+			telemetry_snapshot s;
+			s.dSeconds = m_dSeconds.load(std::memory_order_relaxed);
+			s.nBlocks = m_histRender.count();
+			s.nLate = m_nLate.load(std::memory_order_relaxed);
+			s.nUnderruns = m_nUnderruns.load(std::memory_order_relaxed);
+			s.dRenderMean = m_histRender.mean();
+			s.dRenderP50 = m_histRender.quantile(0.5);
+			s.dRenderP99 = m_histRender.quantile(0.99);
+			s.dRenderMax = m_histRender.max();
+			s.dLoadMean = m_histLoad.mean();
+			s.dLoadP50 = m_histLoad.quantile(0.5);
+			s.dLoadP99 = m_histLoad.quantile(0.99);
+			s.dLoadMax = m_histLoad.max();
+			s.dVoicesMean = m_histVoices.mean();
+			s.dVoicesP99 = m_histVoices.quantile(0.99);
+			s.dVoicesMax = m_histVoices.max();
+			return s;
+		}
+
+		// the full distributions, for anything the snapshot doesn't cover
+		histogram const& render_times() const { return m_histRender; }
+		histogram const& loads() const { return m_histLoad; }
+		histogram const& voices() const { return m_histVoices; }
+
+	private:
+		histogram m_histRender; // microseconds
+		histogram m_histLoad;
+		histogram m_histVoices;
+		std::atomic<uint64_t> m_nLate{ 0 };
+		std::atomic<uint64_t> m_nUnderruns{ 0 };
+		std::atomic<double> m_dSeconds{ 0.0 };
+	};
+}
@@ -0,0 +1,123 @@
+#pragma once
+#include "synth.h"
+
+namespace synth {
+	// who makes room when a new note arrives and the pool is at its polyphony limit
+	enum class steal_policy {
+		oldest,        // the voice that started first
+		quietest,      // the lowest envelope level right now
+		released_first // the oldest voice already in its release, else the oldest
+	};
+
+	// All the notes the audio thread can ever hold, allocated once up front.
+	// Free slots sit on a stack and the sounding ones in a dense list, so
+	// starting or retiring a voice is O(1) and never touches the heap. Once the
+	// polyphony limit is reached a new note takes over a sounding voice picked
+	// by the steal policy, which puts a hard bound on the work per block.
+	class voice_pool {
+	public:
+		voice_pool(size_t nCapacity = 256) {
+			reserve(nCapacity);
+		}
+
+		// control thread, before audio starts: allocates every slot
+		void reserve(size_t nCapacity) {
+			m_vecVoices.assign(nCapacity, note());
+			m_vecStarted.assign(nCapacity, 0);
+			m_vecActive.clear();
+			m_vecActive.reserve(nCapacity);
+			m_vecFree.clear();
+			m_vecFree.reserve(nCapacity);
+			for (size_t i = nCapacity; i-- > 0;)
+				m_vecFree.push_back(i);
+			m_nPolyphony = std::min(m_nPolyphony.load(), nCapacity);
+		}
+
+		size_t capacity() const { return m_vecVoices.size(); }
+
+		// both safe to change from the control thread while audio runs
+		void set_polyphony(size_t nVoices) { m_nPolyphony = std::max((size_t)1, std::min(nVoices, capacity())); }
+		void set_policy(steal_policy ePolicy) { m_ePolicy = ePolicy; }
+		size_t polyphony() const { return m_nPolyphony; }
+
+		// the sounding voices, in no particular order
+		size_t size() const { return m_vecActive.size(); }
+		note& operator[](size_t i) { return m_vecVoices[m_vecActive[i]]; }
+
+		// how many voices have been cut off to make room so far
+		uint64_t stolen() const { return m_nStolen; }
+
+		note* find(int id) {
+			for (size_t i = 0; i < m_vecActive.size(); i++)
+				if (m_vecVoices[m_vecActive[i]].id == id)
+					return &m_vecVoices[m_vecActive[i]];
+			return nullptr;
+		}
+
+		// a fresh, default note that is now sounding; steals one first if the pool is full
+		note& activate() {
+			while (!m_vecActive.empty() && (m_vecActive.size() >= m_nPolyphony || m_vecFree.empty())) {
+				retire(victim());
+				m_nStolen++;
+			}
+
+			size_t nSlot = m_vecFree.back();
+			m_vecFree.pop_back();
+			m_vecActive.push_back(nSlot);
+			m_vecStarted[nSlot] = m_nStarts++;
+			m_vecVoices[nSlot] = note();
+			return m_vecVoices[nSlot];
+		}
+
+		// i is a position in the sounding list; the last voice moves into its place
+		void retire(size_t i) {
+			m_vecFree.push_back(m_vecActive[i]);
+			m_vecActive[i] = m_vecActive.back();
+			m_vecActive.pop_back();
+		}
+
+		// retires every voice whose note has been switched off
+		void retire_inactive() {
+			for (size_t i = m_vecActive.size(); i-- > 0;)
+				if (!m_vecVoices[m_vecActive[i]].active)
+					retire(i);
+		}
+
+	private:
+		std::vector<note> m_vecVoices;
+		std::vector<uint64_t> m_vecStarted; // start order of each slot, for oldest first
+		std::vector<size_t> m_vecActive;
+		std::vector<size_t> m_vecFree;
+		uint64_t m_nStarts = 0;
+		std::atomic<uint64_t> m_nStolen{ 0 };
+
+		std::atomic<size_t> m_nPolyphony{ 64 };
+		std::atomic<steal_policy> m_ePolicy{ steal_policy::oldest };
+
+		// position in the sounding list of the voice to give up
+		size_t victim() const {
+			size_t nBest = 0;
+			steal_policy ePolicy = m_ePolicy;
+			for (size_t i = 1; i < m_vecActive.size(); i++) {
+				note const& a = m_vecVoices[m_vecActive[i]];
+				note const& b = m_vecVoices[m_vecActive[nBest]];
+				bool bOlder = m_vecStarted[m_vecActive[i]] < m_vecStarted[m_vecActive[nBest]];
+
+				if (ePolicy == steal_policy::quietest) {
+					if (a.env.dLevel < b.env.dLevel || (a.env.dLevel == b.env.dLevel && bOlder))
+						nBest = i;
+				}
+				else if (ePolicy == steal_policy::released_first) {
+					bool bReleasedA = a.env.eStage == envelope_generator::release;
+					bool bReleasedB = b.env.eStage == envelope_generator::release;
+					if ((bReleasedA && !bReleasedB) || (bReleasedA == bReleasedB && bOlder))
+						nBest = i;
+				}
+				else if (bOlder) {
+					nBest = i;
+				}
+			}
+			return nBest;
+		}
+	};
+}
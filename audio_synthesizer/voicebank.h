@@ -0,0 +1,379 @@
+#pragma once
+#include "synth.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SYNTH_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC/Clang need the ISA spelled out per function, MSVC lets intrinsics through anywhere.
+// The per-ISA entry points are flattened so the shared kernel template gets inlined
+// into them and compiled for that ISA.
+#if defined(_MSC_VER)
+#define SYNTH_TARGET(isa)
+#define SYNTH_FLATTEN
+#else
+#define SYNTH_TARGET(isa) __attribute__((target(isa)))
+#define SYNTH_FLATTEN __attribute__((flatten))
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi" // only ever called from the matching flattened entry point
+#endif
+
+// GCC fuses a multiply and an add into an FMA wherever the ISA has one, even
+// across intrinsics, which would make the AVX paths round differently from the
+// others; not in here. MSVC and Clang don't fuse separate operations
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+namespace synth {
+	enum class simd_level {
+		scalar, sse2, avx2, avx512
+	};
+
+	// what the machine we're running on can do, checked once
+	inline simd_level detect_simd() {
+#if defined(SYNTH_X86) && defined(_MSC_VER)
+		int nInfo[4];
+		__cpuid(nInfo, 0);
+		int nMaxLeaf = nInfo[0];
+		__cpuid(nInfo, 1);
+		bool bOSXSave = (nInfo[2] & (1 << 27)) != 0;
+		bool bFMA = (nInfo[2] & (1 << 12)) != 0;
+		bool bSSE2 = (nInfo[3] & (1 << 26)) != 0;
+		unsigned long long nXCR0 = bOSXSave ? _xgetbv(0) : 0;
+		if (nMaxLeaf >= 7) {
+			__cpuidex(nInfo, 7, 0);
+			if ((nInfo[1] & (1 << 16)) && (nXCR0 & 0xe6) == 0xe6)
+				return simd_level::avx512;
+			if ((nInfo[1] & (1 << 5)) && bFMA && (nXCR0 & 0x6) == 0x6)
+				return simd_level::avx2;
+		}
+		return bSSE2 ? simd_level::sse2 : simd_level::scalar;
+#elif defined(SYNTH_X86)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			return simd_level::avx512;
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+			return simd_level::avx2;
+		if (__builtin_cpu_supports("sse2"))
+			return simd_level::sse2;
+		return simd_level::scalar;
+#else
+		return simd_level::scalar;
+#endif
+	}
+
+	// Thin wrappers so one kernel template covers every width. Every op is
+	// lane by lane and rounds the same way at every width: muladd is a multiply
+	// then an add, never a fused one, because SSE2 and the scalar path have no
+	// fused form. That is what keeps the bank's output the same bit for bit
+	// whichever ISA runs it
+	struct simd_scalar {
+		typedef float type;
+		static const int width = 1;
+		static type set1(float f) { return f; }
+		static type load(const float* p) { return *p; }
+		static void store(float* p, type v) { *p = v; }
+		static type add(type a, type b) { return a + b; }
+		static type sub(type a, type b) { return a - b; }
+		static type mul(type a, type b) { return a * b; }
+		static type muladd(type a, type b, type c) { return a * b + c; }
+		static type min(type a, type b) { return a < b ? a : b; }
+		static type max(type a, type b) { return a > b ? a : b; }
+		static type wrap(type p) { return p >= 1.0f ? p - 1.0f : p; } // p in 0..2 -> 0..1
+	};
+
+#ifdef SYNTH_X86
+	struct simd_sse2 {
+		typedef __m128 type;
+		static const int width = 4;
+		SYNTH_TARGET("sse2") static type set1(float f) { return _mm_set1_ps(f); }
+		SYNTH_TARGET("sse2") static type load(const float* p) { return _mm_loadu_ps(p); }
+		SYNTH_TARGET("sse2") static void store(float* p, type v) { _mm_storeu_ps(p, v); }
+		SYNTH_TARGET("sse2") static type add(type a, type b) { return _mm_add_ps(a, b); }
+		SYNTH_TARGET("sse2") static type sub(type a, type b) { return _mm_sub_ps(a, b); }
+		SYNTH_TARGET("sse2") static type mul(type a, type b) { return _mm_mul_ps(a, b); }
+		SYNTH_TARGET("sse2") static type muladd(type a, type b, type c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+		SYNTH_TARGET("sse2") static type min(type a, type b) { return _mm_min_ps(a, b); }
+		SYNTH_TARGET("sse2") static type max(type a, type b) { return _mm_max_ps(a, b); }
+		SYNTH_TARGET("sse2") static type wrap(type p) {
+			__m128 one = _mm_set1_ps(1.0f);
+			return _mm_sub_ps(p, _mm_and_ps(_mm_cmpge_ps(p, one), one));
+		}
+	};
+
+	struct simd_avx2 {
+		typedef __m256 type;
+		static const int width = 8;
+		SYNTH_TARGET("avx2,fma") static type set1(float f) { return _mm256_set1_ps(f); }
+		SYNTH_TARGET("avx2,fma") static type load(const float* p) { return _mm256_loadu_ps(p); }
+		SYNTH_TARGET("avx2,fma") static void store(float* p, type v) { _mm256_storeu_ps(p, v); }
+		SYNTH_TARGET("avx2,fma") static type add(type a, type b) { return _mm256_add_ps(a, b); }
+		SYNTH_TARGET("avx2,fma") static type sub(type a, type b) { return _mm256_sub_ps(a, b); }
+		SYNTH_TARGET("avx2,fma") static type mul(type a, type b) { return _mm256_mul_ps(a, b); }
+		SYNTH_TARGET("avx2,fma") static type muladd(type a, type b, type c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+		SYNTH_TARGET("avx2,fma") static type min(type a, type b) { return _mm256_min_ps(a, b); }
+		SYNTH_TARGET("avx2,fma") static type max(type a, type b) { return _mm256_max_ps(a, b); }
+		SYNTH_TARGET("avx2,fma") static type wrap(type p) {
+			__m256 one = _mm256_set1_ps(1.0f);
+			return _mm256_sub_ps(p, _mm256_and_ps(_mm256_cmp_ps(p, one, _CMP_GE_OQ), one));
+		}
+	};
+
+	struct simd_avx512 {
+		typedef __m512 type;
+		static const int width = 16;
+		SYNTH_TARGET("avx512f") static type set1(float f) { return _mm512_set1_ps(f); }
+		SYNTH_TARGET("avx512f") static type load(const float* p) { return _mm512_loadu_ps(p); }
+		SYNTH_TARGET("avx512f") static void store(float* p, type v) { _mm512_storeu_ps(p, v); }
+		SYNTH_TARGET("avx512f") static type add(type a, type b) { return _mm512_add_ps(a, b); }
+		SYNTH_TARGET("avx512f") static type sub(type a, type b) { return _mm512_sub_ps(a, b); }
+		SYNTH_TARGET("avx512f") static type mul(type a, type b) { return _mm512_mul_ps(a, b); }
+		SYNTH_TARGET("avx512f") static type muladd(type a, type b, type c) { return _mm512_add_ps(_mm512_mul_ps(a, b), c); }
+		// as blends, a < b ? a : b like the others; _mm512_min_ps drags in an undefined vector GCC warns about
+		SYNTH_TARGET("avx512f") static type min(type a, type b) { return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ), b, a); }
+		SYNTH_TARGET("avx512f") static type max(type a, type b) { return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_GT_OQ), b, a); }
+		SYNTH_TARGET("avx512f") static type wrap(type p) {
+			__m512 one = _mm512_set1_ps(1.0f);
+			return _mm512_mask_sub_ps(p, _mm512_cmp_ps_mask(p, one, _CMP_GE_OQ), p, one);
+		}
+	};
+#endif
+
+	// Renders many sine/triangle voices at once. Voice state is gathered into
+	// structure-of-arrays lanes at the start of a block (one lane per voice, one
+	// row per partial) and 4/8/16 lanes are computed per instruction. The notes
+	// stay the owners of their oscillator phases; the bank just advances them.
+	class voice_bank {
+	public:
+		static const int nMaxVoices = 256;
+		static const int nMaxPartials = 8;
+		static const int nHarmonicsPerTriangle = (wavetables::nTriangleHarmonics + 1) / 2; // the odd ones of the triangle table
+		static const int nMaxChannels = 8;
+
+		voice_bank() {
+			m_eSimd = detect_simd();
+			clear();
+		}
+
+		simd_level simd() const { return m_eSimd; }
+		void force_simd(simd_level eLevel) { m_eSimd = eLevel; } // for testing the fallbacks
+		int voices() const { return m_nVoices; }
+
+		void clear() {
+			m_nVoices = 0;
+			m_nPartials = 0;
+		}
+
+		// true if add() can take this note: every oscillator is a sine or a
+		// triangle without LFO, and there's a free lane
+		bool accepts(note const& n) const {
+			float fPhase[nMaxPartials], fIncrement[nMaxPartials], fGain[nMaxPartials];
+			return m_nVoices < nMaxVoices && gather(n, 1.0, fPhase, fIncrement, fGain) >= 0;
+		}
+
+		// Queues an accepted note for this block. pEnv holds its envelope gain
+		// for every frame of the block and has to stay put until render();
+		// fPan is how much of it goes to each of the channels render() fills
+		void add(note& n, double dVolume, const float* pEnv, const float* fPan) {
+			float fPhase[nMaxPartials], fIncrement[nMaxPartials], fGain[nMaxPartials];
+			int nPartials = gather(n, dVolume, fPhase, fIncrement, fGain);
+			if (nPartials < 0 || m_nVoices >= nMaxVoices)
+				return;
+
+			int v = m_nVoices++;
+			for (int p = 0; p < nMaxPartials; p++) {
+				m_fPhase[p][v] = p < nPartials ? fPhase[p] : 0.0f;
+				m_fIncrement[p][v] = p < nPartials ? fIncrement[p] : 0.0f;
+				m_fGain[p][v] = p < nPartials ? fGain[p] : 0.0f;
+			}
+			m_nPartials = max(m_nPartials, nPartials);
+			m_pEnv[v] = pEnv;
+			for (int c = 0; c < nMaxChannels; c++)
+				m_fPan[c][v] = fPan[c];
+			m_pNotes[v] = &n;
+		}
+
+		// Adds every banked voice into the nChannels buffers at pOut (up to
+		// nMaxChannels), panned as add() was told, and moves their note
+		// oscillators on by nFrames
+		void render(float* const* pOut, size_t nChannels, size_t nFrames) {
+			if (m_nVoices == 0)
+				return;
+
+			// pad the last group out with silent lanes
+			int nPadded = (m_nVoices + nLanes - 1) & ~(nLanes - 1);
+			for (int v = m_nVoices; v < nPadded; v++) {
+				for (int p = 0; p < nMaxPartials; p++)
+					m_fPhase[p][v] = m_fIncrement[p][v] = m_fGain[p][v] = 0.0f;
+				for (int c = 0; c < nMaxChannels; c++)
+					m_fPan[c][v] = 0.0f;
+			}
+
+			switch (m_eSimd) {
+#ifdef SYNTH_X86
+			case simd_level::avx512: render_avx512(pOut, nChannels, nFrames); break;
+			case simd_level::avx2: render_avx2(pOut, nChannels, nFrames); break;
+			case simd_level::sse2: render_sse2(pOut, nChannels, nFrames); break;
+#endif
+			default: render_lanes<simd_scalar>(pOut, nChannels, nFrames); break;
+			}
+
+			for (int v = 0; v < m_nVoices; v++) {
+				note& n = *m_pNotes[v];
+				for (int o = 0; o < n.nOscillators; o++) {
+					double dPh = n.osc[o].dPhase + n.osc[o].dIncrement * nFrames;
+					n.osc[o].dPhase = dPh - floor(dPh);
+				}
+			}
+		}
+
+	private:
+		static const size_t nChunk = 64;
+
+		// the note's oscillators as sine partials, or -1 if they can't all be expressed that way
+		int gather(note const& n, double dVolume, float* fPhase, float* fIncrement, float* fGain) const {
+			int nPartials = 0;
+			for (int o = 0; o < n.nOscillators; o++) {
+				oscillator const& osc = n.osc[o];
+				if (osc.dAmplitude == 0.0)
+					continue;
+				if (osc.dLFODepth != 0.0 || (osc.eType != osc_types::sine && osc.eType != osc_types::triangle))
+					return -1;
+
+				// a triangle gets the harmonics of the table the per-voice path would read
+				int nHarmonics = osc.eType == osc_types::sine ? 1 : nHarmonicsPerTriangle;
+				int nHighest = osc.eType == osc_types::sine ? 1 : wavetables::harmonics(wavetables::level(osc.dIncrement));
+				for (int k = 0; k < nHarmonics; k++) {
+					int h = 2 * k + 1;
+					if (k > 0 && h > nHighest)
+						break;
+					if (nPartials >= nMaxPartials)
+						return -1;
+
+					double dGain = osc.dAmplitude;
+					if (osc.eType == osc_types::triangle)
+						dGain *= (8.0 / (PI * PI)) / ((double)h * h) * ((h & 2) ? -1.0 : 1.0);
+
+					double dPh = osc.dPhase * h;
+					fPhase[nPartials] = (float)(dPh - floor(dPh));
+					fIncrement[nPartials] = (float)(osc.dIncrement * h);
+					fGain[nPartials] = (float)(dGain * dVolume);
+					nPartials++;
+				}
+			}
+			return nPartials;
+		}
+
+		// Voices are added up in groups of nLanes whatever the vector width: voice
+		// v always lands in accumulator lane v % nLanes, a narrower vector just
+		// takes a group a slice at a time, and the lanes are summed in one fixed
+		// order at the end. With the lane by lane ops above that makes every ISA
+		// produce the same samples
+		static const int nLanes = 16;
+
+		static float sum_lanes(const float* f) {
+			float fSum = 0.0f;
+			for (int i = 0; i < nLanes; i += 4)
+				fSum += (f[i] + f[i + 1]) + (f[i + 2] + f[i + 3]);
+			return fSum;
+		}
+
+		template<class V>
+		void render_lanes(float* const* pOut, size_t nChannels, size_t nFrames) {
+			typedef typename V::type vec;
+			const int W = V::width;
+			alignas(64) float fTmp[nChunk * nLanes];
+			alignas(64) float fEnv[nChunk * nLanes]; // the group's envelopes, lane by lane
+			alignas(64) float fAcc[nMaxChannels][nChunk * nLanes]; // one accumulator per channel
+
+			for (size_t nDone = 0; nDone < nFrames; nDone += nChunk) {
+				size_t nCount = min(nFrames - nDone, (size_t)nChunk);
+				for (size_t c = 0; c < nChannels; c++)
+					std::fill(fAcc[c], fAcc[c] + nCount * nLanes, 0.0f);
+
+				// m_nVoices is padded to a whole group with silent lanes by render()
+				for (int g = 0; g < m_nVoices; g += nLanes) {
+					std::fill(fTmp, fTmp + nCount * nLanes, 0.0f);
+					for (int l = 0; l < nLanes; l++) {
+						const float* pEnv = g + l < m_nVoices ? m_pEnv[g + l] + nDone : nullptr;
+						for (size_t f = 0; f < nCount; f++)
+							fEnv[f * nLanes + l] = pEnv != nullptr ? pEnv[f] : 0.0f;
+					}
+
+					for (int k = 0; k < nLanes; k += W) {
+						int v = g + k;
+
+						// one partial row at a time keeps the working set in registers
+						for (int p = 0; p < m_nPartials; p++) {
+							vec vPhase = V::load(&m_fPhase[p][v]);
+							vec vIncrement = V::load(&m_fIncrement[p][v]);
+							vec vGain = V::load(&m_fGain[p][v]);
+							for (size_t f = 0; f < nCount; f++) {
+								// sin(2 * PI * phase): fold to a quarter wave, then an odd polynomial (~4e-6 error)
+								vec u = V::sub(vPhase, V::set1(0.5f)); // -0.5..0.5, sin flips sign
+								u = V::min(u, V::sub(V::set1(0.5f), u));
+								u = V::max(u, V::sub(V::set1(-0.5f), u)); // now -0.25..0.25
+								vec x = V::mul(u, V::set1(-2.0f * (float)PI)); // sign flip folded in here
+								vec x2 = V::mul(x, x);
+								vec r = V::muladd(V::set1(1.0f / 362880.0f), x2, V::set1(-1.0f / 5040.0f));
+								r = V::muladd(r, x2, V::set1(1.0f / 120.0f));
+								r = V::muladd(r, x2, V::set1(-1.0f / 6.0f));
+								r = V::muladd(r, x2, V::set1(1.0f));
+
+								float* pTmp = fTmp + f * nLanes + k;
+								V::store(pTmp, V::muladd(vGain, V::mul(r, x), V::load(pTmp)));
+								vPhase = V::wrap(V::add(vPhase, vIncrement));
+							}
+							V::store(&m_fPhase[p][v], vPhase);
+						}
+
+						// the pan goes on with the envelope, each lane into every channel
+						for (size_t c = 0; c < nChannels; c++) {
+							vec vPan = V::load(&m_fPan[c][v]);
+							float* pAcc = fAcc[c] + k;
+							for (size_t f = 0; f < nCount; f++) {
+								vec vEnv = V::load(fEnv + f * nLanes + k);
+								V::store(pAcc + f * nLanes, V::muladd(V::load(fTmp + f * nLanes + k), V::mul(vEnv, vPan), V::load(pAcc + f * nLanes)));
+							}
+						}
+					}
+				}
+
+				for (size_t c = 0; c < nChannels; c++)
+					for (size_t f = 0; f < nCount; f++)
+						pOut[c][nDone + f] += sum_lanes(fAcc[c] + f * nLanes);
+			}
+		}
+
+#ifdef SYNTH_X86
+		SYNTH_TARGET("sse2") SYNTH_FLATTEN void render_sse2(float* const* pOut, size_t nChannels, size_t nFrames) { render_lanes<simd_sse2>(pOut, nChannels, nFrames); }
+		SYNTH_TARGET("avx2,fma") SYNTH_FLATTEN void render_avx2(float* const* pOut, size_t nChannels, size_t nFrames) { render_lanes<simd_avx2>(pOut, nChannels, nFrames); }
+		SYNTH_TARGET("avx512f") SYNTH_FLATTEN void render_avx512(float* const* pOut, size_t nChannels, size_t nFrames) { render_lanes<simd_avx512>(pOut, nChannels, nFrames); }
+#endif
+
+		simd_level m_eSimd;
+		int m_nVoices;
+		int m_nPartials;
+
+		// structure of arrays, one row per partial, one column (lane) per voice
+		alignas(64) float m_fPhase[nMaxPartials][nMaxVoices + 16];
+		alignas(64) float m_fIncrement[nMaxPartials][nMaxVoices + 16];
+		alignas(64) float m_fGain[nMaxPartials][nMaxVoices + 16];
+		alignas(64) float m_fPan[nMaxChannels][nMaxVoices + 16];
+		const float* m_pEnv[nMaxVoices]; // each voice's gains for the block, from add()
+		note* m_pNotes[nMaxVoices];
+	};
+}
+
+#if !defined(_MSC_VER)
+#pragma GCC diagnostic pop
+#endif
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
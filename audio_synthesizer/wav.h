@@ -0,0 +1,233 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "sample_format.h"
+
+namespace synth {
+	// Streams interleaved float frames to a .wav file as they are rendered. The
+	// sizes in the header are filled in by close(), so nothing is held in memory.
+	class wav_writer {
+	public:
+		~wav_writer() {
+			close();
+		}
+
+		// bDither adds TPDF dither to the integer formats
+		bool open(std::string const& sPath, unsigned int nSampleRate, unsigned int nChannels, sample_format eFormat, bool bDither = false) {
+			close();
+			m_file.open(sPath, std::ios::binary | std::ios::trunc);
+			if (!m_file.is_open())
+				return false;
+
+			m_nSampleRate = nSampleRate;
+			m_nChannels = nChannels;
+			m_converter = sample_converter(eFormat, bDither);
+			m_nDataBytes = 0;
+			write_header(); // placeholder sizes for now
+			return true;
+		}
+
+		bool is_open() const { return m_file.is_open(); }
+
+		unsigned int bytes_per_sample() const { return m_converter.bytes_per_sample(); }
+
+		// pSamples holds nFrames * channels interleaved samples in -1..1
+		bool write(const float* pSamples, size_t nFrames) {
+			if (!m_file.is_open())
+				return false;
+
+			size_t nSamples = nFrames * m_nChannels;
+			m_vecBytes.resize(nSamples * bytes_per_sample());
+			m_converter.convert(pSamples, nSamples, m_vecBytes.data());
+
+			size_t nBytes = m_vecBytes.size();
+			m_nDataBytes += nBytes;
+			m_file.write((const char*)m_vecBytes.data(), nBytes);
+			return m_file.good();
+		}
+
+		void close() {
+			if (!m_file.is_open())
+				return;
+
+			if (m_nDataBytes & 1)
+				m_file.put(0); // chunks are word aligned
+
+			m_file.seekp(0);
+			write_header();
+			m_file.close();
+		}
+
+	private:
+		std::ofstream m_file;
+		unsigned int m_nSampleRate = 44100;
+		unsigned int m_nChannels = 1;
+		sample_converter m_converter;
+		uint64_t m_nDataBytes = 0;
+		std::vector<uint8_t> m_vecBytes;
+
+		void put16(uint16_t n) { m_file.put((char)(n & 0xff)); m_file.put((char)(n >> 8)); }
+		void put32(uint32_t n) { put16((uint16_t)(n & 0xffff)); put16((uint16_t)(n >> 16)); }
+
+		// 16 bit mono and stereo get the plain PCM header; anything wider, float
+		// or with more channels needs WAVE_FORMAT_EXTENSIBLE to be read right,
+		// and float (not being PCM) also wants a fact chunk with the frame count
+		void write_header() {
+			bool bFloat = m_converter.format() == sample_format::float32;
+			bool bExtensible = m_converter.format() != sample_format::pcm16 || m_nChannels > 2;
+			uint16_t nTag = bFloat ? 3 : 1; // WAVE_FORMAT_IEEE_FLOAT / WAVE_FORMAT_PCM
+			uint16_t nBlockAlign = (uint16_t)(bytes_per_sample() * m_nChannels);
+			uint32_t nFormat = bExtensible ? 40 : 16;
+			uint32_t nHeader = 12 + 8 + nFormat + (bFloat ? 12 : 0) + 8;
+			uint32_t nData = (uint32_t)std::min<uint64_t>(m_nDataBytes, 0xffffffffull - nHeader);
+
+			m_file.write("RIFF", 4);
+			put32(nHeader - 8 + nData + (nData & 1));
+			m_file.write("WAVEfmt ", 8);
+			put32(nFormat);
+			put16(bExtensible ? 0xfffe : nTag);
+			put16((uint16_t)m_nChannels);
+			put32(m_nSampleRate);
+			put32(m_nSampleRate * nBlockAlign);
+			put16(nBlockAlign);
+			put16((uint16_t)(bytes_per_sample() * 8));
+			if (bExtensible) {
+				put16(22);
+				put16((uint16_t)(bytes_per_sample() * 8)); // every bit is valid
+				put32(channel_mask());
+				put16(nTag); // the sub format guid is the old tag on the KSDATAFORMAT base guid
+				static const uint8_t guid[14] = { 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 };
+				m_file.write((const char*)guid, sizeof(guid));
+			}
+			if (bFloat) {
+				m_file.write("fact", 4);
+				put32(4);
+				put32(nData / nBlockAlign);
+			}
+			m_file.write("data", 4);
+			put32(nData);
+		}
+
+		// mono is the front centre speaker, more channels take the speaker bits in order (front left, front right, ...)
+		uint32_t channel_mask() const {
+			if (m_nChannels == 1)
+				return 0x4;
+			return m_nChannels < 18 ? (1u << m_nChannels) - 1 : 0x3ffff;
+		}
+	};
+
+	// Reads a whole .wav into interleaved floats in -1..1: 16/24/32 bit PCM
+	// and 32 bit float, any channel count. Meant for small things like
+	// impulse responses, it all goes into memory
+	class wav_reader {
+	public:
+		unsigned int sample_rate() const { return m_nSampleRate; }
+		unsigned int channels() const { return m_nChannels; }
+		size_t frames() const { return m_nChannels > 0 ? m_vecSamples.size() / m_nChannels : 0; }
+		std::vector<float> const& samples() const { return m_vecSamples; }
+
+		bool load(std::string const& sPath, std::string& sError) {
+			std::ifstream file(sPath, std::ios::binary);
+			if (!file.is_open()) {
+				sError = "can't open " + sPath;
+				return false;
+			}
+
+			char sId[4];
+			uint32_t nSize;
+			if (!file.read(sId, 4) || memcmp(sId, "RIFF", 4) != 0 || !get32(file, nSize) || !file.read(sId, 4) || memcmp(sId, "WAVE", 4) != 0) {
+				sError = sPath + ": not a wav file";
+				return false;
+			}
+
+			uint16_t nTag = 0, nBits = 0;
+			bool bFormat = false;
+			while (file.read(sId, 4) && get32(file, nSize)) {
+				std::streampos posChunk = file.tellg();
+				if (memcmp(sId, "data", 4) == 0) {
+					if (!bFormat)
+						break;
+					return read_data(file, nSize, nTag, nBits, sPath, sError);
+				}
+				if (memcmp(sId, "fmt ", 4) == 0) {
+					uint16_t nChannels, nBlockAlign;
+					uint32_t nRate, nByteRate;
+					if (nSize < 16 || !get16(file, nTag) || !get16(file, nChannels) || !get32(file, nRate) || !get32(file, nByteRate) || !get16(file, nBlockAlign) || !get16(file, nBits))
+						break;
+					if (nTag == 0xfffe && nSize >= 26) { // WAVE_FORMAT_EXTENSIBLE, the real tag opens the sub format guid
+						file.seekg(8, std::ios::cur);
+						get16(file, nTag);
+					}
+					m_nChannels = nChannels;
+					m_nSampleRate = nRate;
+					bFormat = true;
+				}
+				file.seekg(posChunk + (std::streamoff)(nSize + (nSize & 1))); // chunks are word aligned
+			}
+
+			sError = sPath + ": no format or data chunk";
+			return false;
+		}
+
+	private:
+		unsigned int m_nSampleRate = 0;
+		unsigned int m_nChannels = 0;
+		std::vector<float> m_vecSamples;
+
+		static bool get16(std::ifstream& file, uint16_t& n) {
+			uint8_t b[2];
+			if (!file.read((char*)b, 2))
+				return false;
+			n = (uint16_t)(b[0] | (b[1] << 8));
+			return true;
+		}
+
+		static bool get32(std::ifstream& file, uint32_t& n) {
+			uint8_t b[4];
+			if (!file.read((char*)b, 4))
+				return false;
+			n = (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+			return true;
+		}
+
+		bool read_data(std::ifstream& file, uint32_t nSize, uint16_t nTag, uint16_t nBits, std::string const& sPath, std::string& sError) {
+			bool bFloat = nTag == 3 && nBits == 32;
+			bool bPCM = nTag == 1 && (nBits == 16 || nBits == 24 || nBits == 32);
+			if ((!bFloat && !bPCM) || m_nChannels == 0) {
+				sError = sPath + ": only 16/24/32 bit PCM and 32 bit float are supported";
+				return false;
+			}
+
+			std::vector<uint8_t> vecBytes(nSize);
+			file.read((char*)vecBytes.data(), nSize);
+			vecBytes.resize((size_t)file.gcount()); // a truncated file still gives what's there
+
+			size_t nBytes = nBits / 8;
+			m_vecSamples.resize(vecBytes.size() / nBytes / m_nChannels * m_nChannels);
+			const uint8_t* p = vecBytes.data();
+			for (size_t i = 0; i < m_vecSamples.size(); i++, p += nBytes) {
+				if (bFloat) {
+					memcpy(&m_vecSamples[i], p, 4);
+				}
+				else if (nBits == 16) {
+					m_vecSamples[i] = (int16_t)(p[0] | (p[1] << 8)) / 32768.0f;
+				}
+				else if (nBits == 24) {
+					int32_t n = (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24)) >> 8;
+					m_vecSamples[i] = n / 8388608.0f;
+				}
+				else {
+					int32_t n = (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+					m_vecSamples[i] = (float)(n / 2147483648.0);
+				}
+			}
+			return true;
+		}
+	};
+}
@@ -0,0 +1,145 @@
+#pragma once
+#include "noisemaker.h"
+
+namespace synth {
+	// Band-limited versions of the saw, square and triangle shapes.
+	//
+	// Each shape gets one table per half octave ("mip level"), built once from
+	// its Fourier series with only the harmonics that fit below Nyquist at that
+	// pitch. Levels are indexed by phase increment rather than frequency so the
+	// same tables work at any sample rate. Triangles stop at nTriangleHarmonics
+	// even when more would fit, so the voice bank can sum exactly the same sines.
+	class wavetables {
+	public:
+		enum shape {
+			saw, square, triangle, shape_count
+		};
+
+		static const int nTableSize = 2048; // samples per cycle, power of two
+		static const int nLevels = 21; // level l holds up to harmonics(l) harmonics, 1024 down to 1
+		static const int nTriangleHarmonics = 11; // 1/h^2 makes the 13th -44 dB already
+
+		// builds everything on the first call - call it at startup so the audio thread never does
+		static wavetables& get() {
+			static wavetables tables;
+			return tables;
+		}
+
+		// picks the richest table that won't alias at this phase increment
+		const float* table(shape eShape, double dIncrement) const {
+			return m_tables[eShape][level(dIncrement)].data();
+		}
+
+		static int level(double dIncrement) {
+			double dMaxHarmonic = 0.5 / (dIncrement > 0.0 ? dIncrement : 1e-9);
+			if (dMaxHarmonic >= 1024.0)
+				return 0;
+			int l = (int)ceil(2.0 * log2(1024.0 / dMaxHarmonic));
+			while (l < nLevels - 1 && harmonics(l) > dMaxHarmonic) // ceil() can land one short
+				l++;
+			return l < nLevels ? l : nLevels - 1;
+		}
+
+		static int harmonics(int nLevel) {
+			return (int)(1024.0 / pow(2.0, nLevel * 0.5));
+		}
+
+		// linear interpolated read, dPhase in 0..1
+		static float read(const float* pTable, double dPhase) {
+			double dIndex = dPhase * nTableSize;
+			int i = (int)dIndex;
+			float fFrac = (float)(dIndex - i);
+			i &= nTableSize - 1;
+			return pTable[i] + fFrac * (pTable[i + 1] - pTable[i]);
+		}
+
+		float lookup(shape eShape, double dPhase, double dIncrement) const {
+			return read(table(eShape, dIncrement), dPhase);
+		}
+
+		// one cycle of sine for read(); a single harmonic never aliases, so it has no levels
+		const float* sine_table() const {
+			return m_vecSineTable.data();
+		}
+
+		float sine(double dPhase) const {
+			return read(sine_table(), dPhase);
+		}
+
+	private:
+		wavetables() {
+			// h * i wraps exactly, so one cycle of sine serves every harmonic
+			m_vecSine.resize(nTableSize);
+			for (int i = 0; i < nTableSize; i++)
+				m_vecSine[i] = sin(2.0 * PI * i / nTableSize);
+			m_vecSineTable.assign(m_vecSine.begin(), m_vecSine.end());
+			m_vecSineTable.push_back(m_vecSineTable[0]);
+
+			for (int s = 0; s < shape_count; s++)
+				for (int l = 0; l < nLevels; l++)
+					build((shape)s, l);
+		}
+
+		void build(shape eShape, int nLevel) {
+			std::vector<float>& vecTable = m_tables[eShape][nLevel];
+			vecTable.assign(nTableSize + 1, 0.0f); // +1 guard sample for interpolation
+
+			int nHarmonics = harmonics(nLevel);
+			if (eShape == triangle)
+				nHarmonics = std::min(nHarmonics, (int)nTriangleHarmonics);
+			std::vector<double> vecSum(nTableSize, 0.0);
+			for (int h = 1; h <= nHarmonics; h++) {
+				double dGain = 0.0;
+				switch (eShape) {
+				case saw: // same series oscillate() used to sum every sample
+					dGain = (2.0 / PI) / h;
+					break;
+				case square:
+					dGain = (h & 1) ? (4.0 / PI) / h : 0.0;
+					break;
+				case triangle:
+					dGain = (h & 1) ? (8.0 / (PI * PI)) / ((double)h * h) * ((h & 2) ? -1.0 : 1.0) : 0.0;
+					break;
+				default: break;
+				}
+				if (dGain == 0.0)
+					continue;
+
+				for (int i = 0; i < nTableSize; i++)
+					vecSum[i] += dGain * m_vecSine[(h * i) & (nTableSize - 1)];
+			}
+
+			for (int i = 0; i < nTableSize; i++)
+				vecTable[i] = (float)vecSum[i];
+			vecTable[nTableSize] = vecTable[0];
+		}
+
+		std::vector<double> m_vecSine;
+		std::vector<float> m_vecSineTable; // m_vecSine plus the guard sample, for sine()
+		std::vector<float> m_tables[shape_count][nLevels];
+	};
+
+	// PolyBLEP residual: smooths a unit step at phase 0, dT is the phase increment
+	inline double polyblep(double dT, double dIncrement) {
+		if (dT < dIncrement) {
+			dT /= dIncrement;
+			return dT + dT - dT * dT - 1.0;
+		}
+		if (dT > 1.0 - dIncrement) {
+			dT = (dT - 1.0) / dIncrement;
+			return dT * dT + dT + dT + 1.0;
+		}
+		return 0.0;
+	}
+
+	// cheap band-limited edges without tables, matches the wavetable saw/square shapes
+	inline double polyblep_saw(double dPhase, double dIncrement) {
+		return 1.0 - 2.0 * dPhase + polyblep(dPhase, dIncrement);
+	}
+
+	inline double polyblep_square(double dPhase, double dIncrement) {
+		double dHalf = dPhase + 0.5;
+		if (dHalf >= 1.0) dHalf -= 1.0;
+		return (dPhase < 0.5 ? 1.0 : -1.0) + polyblep(dPhase, dIncrement) - polyblep(dHalf, dIncrement);
+	}
+}
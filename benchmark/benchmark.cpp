@@ -0,0 +1,309 @@
+// Microbenchmarks for the DSP kernels and the full mix, in ns per sample.
+// Needs no sound card, everything runs straight into buffers. On Linux:
+//   g++ -std=c++17 -O2 -pthread benchmark.cpp -o benchmark
+//
+// Each case is run a few times after a warm-up and the median and fastest run
+// are reported. --out writes the results as CSV, and a file written that way
+// can be handed back as --baseline to see how a change moved every number;
+// anything slower than the baseline by more than --tolerance percent is
+// flagged and the exit code is 1, so a script can fail on it
+#include "../audio_synthesizer/engine.h"
+
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+const double dSampleRate = 44100.0;
+const size_t nBlock = 512;
+
+struct bench_result {
+	string sName;
+	double dMedian; // ns per sample
+	double dFastest;
+	uint64_t nSamples; // per run
+	size_t nRuns;
+};
+
+struct bench_options {
+	size_t nRuns = 15;
+	unsigned int nThreads = 1;
+	unsigned int nChannels = 1;
+	string sFilter;
+};
+
+// whatever the kernels produce ends up here, so the compiler can't drop the work
+volatile float fSink = 0.0f;
+
+// Runs fnRun(), which does nSamples samples of work per call, opt.nRuns times
+// after a warm-up and adds the result; cases --filter doesn't match are skipped
+template<class F>
+void measure(bench_options const& opt, vector<bench_result>& vecResults, string const& sName, uint64_t nSamples, F fnRun)
+{
+	if (sName.find(opt.sFilter) == string::npos)
+		return;
+
+	fnRun(); // warm-up: caches, tables, branch predictors
+
+	vector<double> vecTimes;
+	for (size_t r = 0; r < opt.nRuns; r++) {
+		auto tStart = chrono::steady_clock::now();
+		fnRun();
+		double dSeconds = chrono::duration<double>(chrono::steady_clock::now() - tStart).count();
+		vecTimes.push_back(dSeconds * 1e9 / (double)nSamples);
+	}
+	sort(vecTimes.begin(), vecTimes.end());
+	vecResults.push_back(bench_result{ sName, vecTimes[vecTimes.size() / 2], vecTimes[0], nSamples, opt.nRuns });
+}
+
+const char* OscName(synth::osc_types eType)
+{
+	switch (eType) {
+	case synth::osc_types::sine: return "sine";
+	case synth::osc_types::square: return "square";
+	case synth::osc_types::triangle: return "triangle";
+	case synth::osc_types::saw: return "saw";
+	case synth::osc_types::noise: return "noise";
+	default: return "unknown";
+	}
+}
+
+// one second of samples through every branch of oscillate(), and the stateful oscillator that replaced it
+void BenchOscillators(bench_options const& opt, vector<bench_result>& vecResults)
+{
+	const synth::osc_types eTypes[] = { synth::osc_types::sine, synth::osc_types::square, synth::osc_types::triangle, synth::osc_types::saw, synth::osc_types::noise };
+	const size_t nSamples = (size_t)dSampleRate;
+	vector<float> vecOut(nSamples);
+
+	for (auto eType : eTypes) {
+		double dTime = 0.0;
+		measure(opt, vecResults, string("oscillate/") + OscName(eType), nSamples, [&]() {
+			for (size_t i = 0; i < nSamples; i++) {
+				vecOut[i] = (float)synth::oscillate(440.0, dTime, eType, 0.0, 0.0, dSampleRate);
+				dTime += 1.0 / dSampleRate;
+			}
+			fSink = fSink + vecOut[nSamples - 1];
+		});
+	}
+
+	for (int nPolyBLEP = 0; nPolyBLEP < 2; nPolyBLEP++) {
+		for (auto eType : eTypes) {
+			if (nPolyBLEP && eType != synth::osc_types::square && eType != synth::osc_types::saw)
+				continue;
+
+			synth::oscillator osc;
+			osc.set(eType, 1.0, 440.0, dSampleRate);
+			osc.bPolyBLEP = nPolyBLEP != 0;
+			string sName = string("oscillator/") + OscName(eType) + (nPolyBLEP ? "_polyblep" : "");
+			measure(opt, vecResults, sName, nSamples, [&]() {
+				fill(vecOut.begin(), vecOut.end(), 0.0f);
+				for (size_t i = 0; i < nSamples; i += nBlock)
+					osc.process(vecOut.data() + i, min(nBlock, nSamples - i));
+				fSink = fSink + vecOut[nSamples - 1];
+			});
+		}
+	}
+}
+
+// The envelope goes round attack, decay, sustain and release every 0.8 s:
+// held for 0.6 s, then let go
+void BenchEnvelopes(bench_options const& opt, vector<bench_result>& vecResults)
+{
+	const size_t nSamples = (size_t)dSampleRate;
+	const double dCycle = 0.8, dHeld = 0.6;
+	vector<float> vecOut(nSamples);
+
+	synth::envelope_adsr adsr;
+	measure(opt, vecResults, "envelope_adsr/amplitude", nSamples, [&]() {
+		for (size_t i = 0; i < nSamples; i++) {
+			double dTime = fmod((double)i / dSampleRate, dCycle);
+			vecOut[i] = (float)adsr.amplitude(dTime, 0.0, dTime < dHeld ? -1.0 : dHeld);
+		}
+		fSink = fSink + vecOut[nSamples - 1];
+	});
+
+	synth::envelope_generator gen;
+	gen.set(adsr, dSampleRate);
+	size_t nCycle = (size_t)(dCycle * dSampleRate), nHeld = (size_t)(dHeld * dSampleRate);
+	measure(opt, vecResults, "envelope_generator/process", nSamples, [&]() {
+		for (size_t i = 0; i < nSamples; i += nBlock) {
+			size_t n = min(nBlock, nSamples - i);
+			size_t nInCycle = i % nCycle;
+			if (nInCycle < nBlock)
+				gen.note_on();
+			else if (nInCycle >= nHeld && nInCycle < nHeld + nBlock)
+				gen.note_off();
+			gen.process(vecOut.data() + i, n);
+		}
+		fSink = fSink + vecOut[nSamples - 1];
+	});
+}
+
+// every built in instrument, one held note through render_voice(), which is what each instrument's sound() used to be
+void BenchInstruments(bench_options const& opt, vector<bench_result>& vecResults)
+{
+	const size_t nSamples = (size_t)dSampleRate;
+	vector<float> vecOut(nSamples);
+
+	synth::instrument_registry registry;
+	synth::register_default_instruments(registry);
+	for (auto pDef : registry.begin_block()->vecKnown) {
+		unique_ptr<synth::note> pNote(new synth::note());
+		synth::note_on(*pDef, *pNote, dSampleRate);
+		measure(opt, vecResults, string("instrument/") + pDef->sName, nSamples, [&]() {
+			fill(vecOut.begin(), vecOut.end(), 0.0f);
+			for (size_t i = 0; i < nSamples; i += nBlock)
+				synth::render_voice(*pNote, vecOut.data() + i, min(nBlock, nSamples - i));
+			fSink = fSink + vecOut[nSamples - 1];
+		});
+	}
+}
+
+// The whole engine, exactly what MakeNoise runs per block, with nVoices notes
+// held: the built in instruments in turn on ids 0..nVoices-1, default
+// effects and dynamics. ns per sample here is per frame of output
+void BenchMix(bench_options const& opt, size_t nVoices, vector<bench_result>& vecResults)
+{
+	ostringstream ssName;
+	ssName << "mix/" << nVoices << "_voices";
+	if (ssName.str().find(opt.sFilter) == string::npos)
+		return; // skips setting up the engine as well
+
+	const size_t nBlocks = 32;
+	unique_ptr<synth::engine> eng(new synth::engine(dSampleRate, opt.nThreads));
+	eng->set_max_voices(max((size_t)256, nVoices));
+	eng->set_polyphony(nVoices);
+	eng->instruments().update([&](synth::instrument_registry::table& t) {
+		for (size_t id = 0; id < nVoices; id++)
+			t.pById[id] = t.vecKnown[id % t.vecKnown.size()];
+	});
+	eng->prepare(nBlock, opt.nChannels);
+
+	// the event queue only holds so many, so the notes go in a batch per block
+	vector<float> vecOut(nBlock * opt.nChannels);
+	uint64_t nFrame = 0;
+	for (size_t id = 0; id < nVoices; ) {
+		for (size_t nBatch = 0; nBatch < 128 && id < nVoices; nBatch++, id++) {
+			synth::note_event e;
+			e.type = synth::event_type::note_on;
+			e.id = (int)id;
+			e.nFrame = nFrame;
+			eng->post(e);
+		}
+		eng->process(vecOut.data(), nBlock, opt.nChannels, nFrame);
+		nFrame += nBlock;
+	}
+	if (eng->active_notes() != nVoices)
+		cerr << ssName.str() << ": only " << eng->active_notes() << " voices sounding" << endl;
+
+	measure(opt, vecResults, ssName.str(), nBlocks * nBlock, [&]() {
+		for (size_t b = 0; b < nBlocks; b++) {
+			eng->process(vecOut.data(), nBlock, opt.nChannels, nFrame);
+			nFrame += nBlock;
+		}
+		fSink = fSink + vecOut[0];
+	});
+}
+
+void WriteResults(ostream& os, vector<bench_result> const& vecResults)
+{
+	os << "benchmark,ns_per_sample,fastest_ns_per_sample,samples,runs\n";
+	for (auto const& r : vecResults)
+		os << r.sName << "," << r.dMedian << "," << r.dFastest << "," << r.nSamples << "," << r.nRuns << "\n";
+}
+
+// a file WriteResults wrote, name -> median ns per sample
+bool ReadBaseline(string const& sPath, map<string, double>& mapBaseline)
+{
+	ifstream file(sPath);
+	if (!file.is_open())
+		return false;
+
+	string sLine;
+	getline(file, sLine); // header
+	while (getline(file, sLine)) {
+		istringstream ss(sLine);
+		string sName, sValue;
+		if (getline(ss, sName, ',') && getline(ss, sValue, ','))
+			mapBaseline[sName] = stod(sValue);
+	}
+	return true;
+}
+
+// benchmark [--runs n] [--threads n] [--channels n] [--filter text] [--out results.csv] [--baseline results.csv] [--tolerance percent]
+int main(int argc, char** argv)
+{
+	bench_options opt;
+	string sOut, sBaseline;
+	double dTolerance = 10.0;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		string sOpt = argv[i], sVal = argv[i + 1];
+		if (sOpt == "--runs")
+			opt.nRuns = max((size_t)1, (size_t)stoul(sVal));
+		else if (sOpt == "--threads")
+			opt.nThreads = (unsigned int)stoul(sVal);
+		else if (sOpt == "--channels")
+			opt.nChannels = max(1u, (unsigned int)stoul(sVal));
+		else if (sOpt == "--filter")
+			opt.sFilter = sVal;
+		else if (sOpt == "--out")
+			sOut = sVal;
+		else if (sOpt == "--baseline")
+			sBaseline = sVal;
+		else if (sOpt == "--tolerance")
+			dTolerance = stod(sVal);
+		else {
+			cerr << "usage: " << argv[0] << " [--runs n] [--threads n] [--channels n] [--filter text] [--out results.csv] [--baseline results.csv] [--tolerance percent]" << endl;
+			return 1;
+		}
+	}
+
+	map<string, double> mapBaseline;
+	if (!sBaseline.empty() && !ReadBaseline(sBaseline, mapBaseline)) {
+		cerr << "can't read " << sBaseline << endl;
+		return 1;
+	}
+
+	synth::wavetables::get(); // built once up front, not inside the first case
+
+	vector<bench_result> vecResults;
+	BenchOscillators(opt, vecResults);
+	BenchEnvelopes(opt, vecResults);
+	BenchInstruments(opt, vecResults);
+	for (size_t nVoices : { 1, 8, 32, 128, 512 })
+		BenchMix(opt, nVoices, vecResults);
+
+	int nSlower = 0;
+	cout << left << setw(34) << "benchmark" << right << setw(12) << "ns/sample" << setw(12) << "fastest";
+	if (!mapBaseline.empty())
+		cout << setw(12) << "baseline" << setw(10) << "change";
+	cout << endl;
+	for (auto const& r : vecResults) {
+		cout << left << setw(34) << r.sName << right << fixed << setprecision(2) << setw(12) << r.dMedian << setw(12) << r.dFastest;
+		auto it = mapBaseline.find(r.sName);
+		if (it != mapBaseline.end() && it->second > 0.0) {
+			double dChange = (r.dMedian / it->second - 1.0) * 100.0;
+			cout << setw(12) << it->second << setw(9) << showpos << dChange << noshowpos << "%";
+			if (dChange > dTolerance) {
+				cout << "  slower";
+				nSlower++;
+			}
+		}
+		cout << defaultfloat << endl;
+	}
+
+	if (!sOut.empty()) {
+		ofstream file(sOut);
+		if (!file.is_open()) {
+			cerr << "can't write " << sOut << endl;
+			return 1;
+		}
+		file << setprecision(6);
+		WriteResults(file, vecResults);
+	}
+
+	if (nSlower > 0) {
+		cout << nSlower << " slower than " << sBaseline << " by more than " << dTolerance << "%" << endl;
+		return 1;
+	}
+	return 0;
+}